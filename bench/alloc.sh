@@ -0,0 +1,81 @@
+#!/bin/sh
+
+# counts the allocations of a no-op build of a generated project, with 500
+# sources including some of 50 chained headers. run from the repository root
+# after bootstrapping, e.g. on both sides of a change to compare them.
+
+CC=gcc
+CFLAGS="-std=c99 -pedantic -D_GNU_SOURCE -O2 -fPIC -shared"
+
+NSRCS=500
+NHDRS=50
+
+MINCBUILD=$(pwd)/mincbuild
+BENCH_DIR=$(mktemp -d)
+trap 'rm -rf $BENCH_DIR' EXIT
+
+$CC $CFLAGS -o $BENCH_DIR/alloc_count.so bench/alloc_count.c || exit 1
+
+mkdir $BENCH_DIR/proj $BENCH_DIR/proj/src $BENCH_DIR/proj/include
+cd $BENCH_DIR/proj
+
+i=0
+while [ $i -lt $NHDRS ]
+do
+	{
+		echo "#ifndef H$i"
+		echo "#define H$i"
+		[ $i -lt $((NHDRS - 1)) ] && echo "#include \"h$((i + 1)).h\""
+		echo "int h$i(void);"
+		echo "#endif"
+	} > include/h$i.h
+	i=$((i + 1))
+done
+
+i=0
+while [ $i -lt $NSRCS ]
+do
+	{
+		j=0
+		while [ $j -lt 5 ]
+		do
+			echo "#include \"h$(((i + j * 7) % NHDRS)).h\""
+			j=$((j + 1))
+		done
+		echo "int f$i(void) { return $i; }"
+	} > src/s$i.c
+	i=$((i + 1))
+done
+
+cat > mincbuild.conf << EOF
+# toolchain.
+cc = $(command -v $CC)
+ld = $(command -v $CC)
+cflags = -std=c99 -O0
+ldflags = NONE
+
+# project.
+src_dir = src
+inc_dir = include
+lib_dir = lib
+produce_output = false
+output = app
+src_exts = c
+hdr_exts = h
+
+# dependencies.
+incs = NONE
+libs = NONE
+
+# toolchain information.
+cc_inc_fmt = -I%i
+cc_cmd_fmt = %c %f -o %o -c %s %i
+ld_lib_fmt = -l%l
+ld_obj_fmt = %o
+ld_cmd_fmt = %c %f -o %b %o %l
+cc_success_rc = 0
+ld_success_rc = 0
+EOF
+
+$MINCBUILD > /dev/null || exit 1
+LD_PRELOAD="$BENCH_DIR/alloc_count.so $LD_PRELOAD" $MINCBUILD > /dev/null
@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+
+// preloaded into a program to count its calls into the allocator, which are
+// written to stderr once it exits.
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long nmalloc, ncalloc, nrealloc;
+
+__attribute__((constructor)) static void count_begin(void);
+__attribute__((destructor)) static void count_end(void);
+
+void *
+malloc(size_t size)
+{
+	__sync_fetch_and_add(&nmalloc, 1);
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	__sync_fetch_and_add(&ncalloc, 1);
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	__sync_fetch_and_add(&nrealloc, 1);
+	return __libc_realloc(ptr, size);
+}
+
+static void
+count_begin(void)
+{
+	// only the program started under the counter is counted, not the
+	// commands it runs.
+	unsetenv("LD_PRELOAD");
+}
+
+static void
+count_end(void)
+{
+	// written without stdio, which would allocate while counting.
+	char buf[128];
+	int len = snprintf(buf, sizeof(buf), "malloc: %lu, calloc: %lu, realloc: %lu\n",
+	                   nmalloc, ncalloc, nrealloc);
+	write(STDERR_FILENO, buf, len);
+}
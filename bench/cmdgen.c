@@ -0,0 +1,111 @@
+// times the generation of compile commands for 10k sources, both through a
+// target's precompiled template and by expanding the whole of `cc_cmd_fmt`
+// for every source. the jobs and their templates are only reachable from
+// within compile.c.
+#include "../src/compile.c"
+
+#include <time.h>
+
+#define NSRCS 10000
+#define NINCS 8
+#define NROUNDS 5
+
+static double now_ms(void);
+
+int
+main(void)
+{
+	struct conf conf =
+	{
+		.cc = "/usr/bin/gcc",
+		.cflags = "-std=c99 -pedantic -D_POSIX_C_SOURCE=200809 -D_GNU_SOURCE -O3 -Wall -Wextra",
+		.inc_dir = "include",
+		.incs = str_list_create(),
+		.cc_inc_fmt = "-I%i",
+		.cc_cmd_fmt = "%c %f -o %o -c %s %i",
+		.remote = str_list_create(),
+	};
+
+	struct intern paths = intern_create();
+	struct id_list srcs = id_list_create(), objs = id_list_create();
+	char buf[64];
+	for (size_t i = 0; i < NINCS; ++i)
+	{
+		sprintf(buf, "/opt/third party/lib%zu/include", i);
+		str_list_add(&conf.incs, buf);
+	}
+	for (size_t i = 0; i < NSRCS; ++i)
+	{
+		sprintf(buf, "src/module%zu/file%zu.c", i / 100, i);
+		id_list_add(&srcs, intern_add(&paths, buf));
+		sprintf(buf, "lib/module%zu/file%zu.c.o", i / 100, i);
+		id_list_add(&objs, intern_add(&paths, buf));
+	}
+
+	struct bitset up_to_date = bitset_create(paths.size);
+	struct graph_opts opts = {0};
+	struct graph graph = graph_create(&opts);
+	compile_schedule(&graph, &conf, &paths, &srcs, &objs, &up_to_date, NULL, NULL);
+
+	// the fastest of several rounds, so that a stray context switch does not
+	// count.
+	double tmpl_ms = 0.0, fmt_ms = 0.0;
+	size_t len = 0;
+	bool same = true;
+	for (size_t round = 0; round < NROUNDS; ++round)
+	{
+		double begin = now_ms();
+		for (size_t i = 0; i < graph.size; ++i)
+		{
+			struct fmt_data *data = graph.data[i].ctx;
+			free(fmt_tmpl_str(data->tmpl, data));
+		}
+		double mid = now_ms();
+		for (size_t i = 0; i < graph.size; ++i)
+		{
+			struct fmt_data *data = graph.data[i].ctx;
+			free(compile_fmt(&conf, conf.cc_cmd_fmt, data->src, data->obj));
+		}
+		double end = now_ms();
+
+		if (!round || mid - begin < tmpl_ms)
+			tmpl_ms = mid - begin;
+		if (!round || end - mid < fmt_ms)
+			fmt_ms = end - mid;
+	}
+
+	for (size_t i = 0; i < graph.size; ++i)
+	{
+		struct fmt_data *data = graph.data[i].ctx;
+		char *tmpl_cmd = fmt_tmpl_str(data->tmpl, data);
+		char *fmt_cmd = compile_fmt(&conf, conf.cc_cmd_fmt, data->src, data->obj);
+		same = same && !strcmp(tmpl_cmd, fmt_cmd);
+		len += strlen(tmpl_cmd);
+		free(fmt_cmd);
+		free(tmpl_cmd);
+	}
+
+	printf("%zu commands of %zu bytes on average\n", graph.size, len / graph.size);
+	printf("template: %.2f ms\n", tmpl_ms);
+	printf("full format: %.2f ms\n", fmt_ms);
+	if (!same)
+		fputs("commands differ between template and full format!\n", stderr);
+
+	graph_destroy(&graph);
+	bitset_destroy(&up_to_date);
+	id_list_destroy(&objs);
+	id_list_destroy(&srcs);
+	intern_destroy(&paths);
+	str_list_destroy(&conf.remote);
+	str_list_destroy(&conf.incs);
+
+	return !same;
+}
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
@@ -0,0 +1,16 @@
+#!/bin/sh
+
+# builds and runs the command generation benchmark in bench/cmdgen.c, from
+# the repository root.
+
+CC=gcc
+CFLAGS="-std=c99 -pedantic -Iinclude -D_POSIX_C_SOURCE=200809 -D_GNU_SOURCE -O3"
+LIBS="-lpthread"
+
+OUT_NAME=$(mktemp)
+trap 'rm -f $OUT_NAME' EXIT
+
+SRCS=$(ls src/*.c | grep -v -e '^src/main\.c$' -e '^src/compile\.c$')
+
+$CC $CFLAGS -o $OUT_NAME bench/cmdgen.c $SRCS $LIBS || exit 1
+$OUT_NAME
@@ -0,0 +1,67 @@
+#ifndef BUILD_H
+#define BUILD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "conf.h"
+#include "graph.h"
+#include "prune.h"
+#include "util.h"
+
+enum build_err
+{
+	BUILD_OK = 0,
+	BUILD_FAILED,
+	BUILD_ERR_CONF,
+	BUILD_ERR_PRUNE,
+	BUILD_ERR_PROC,
+	BUILD_ERR_USAGE,
+	BUILD_ERR_MODULES,
+	BUILD_TESTS_FAILED,
+	BUILD_ERR_TRAIN,
+};
+
+// what a single run of a build does, which may differ from run to run.
+struct build_opts
+{
+	// `force` rebuilds everything without pruning, and `link_only` links the
+	// objects gathered from shards without compiling. with `nshards` set, only
+	// the `shard`-th of that many parts of the compiles is run.
+	bool force, link_only, pgo, test, skip_passed, stats;
+	size_t shard, nshards;
+
+	// statistics are also written as JSON to this file, "-" for stdout.
+	char const *stats_json;
+	struct graph_opts graph;
+};
+
+struct build
+{
+	char *conf_file, *profile;
+	struct timespec conf_mt;
+	struct conf_set cs;
+
+	// time spent loading the configuration, counted towards the next run.
+	uint64_t load_ns;
+
+	// paths keep their ids for as long as the build exists, which is what
+	// the scan cache is indexed by.
+	struct intern paths;
+	struct prune_cache cache;
+
+	// a persistent build is run again and again by a long-lived process, so
+	// scans are cached between runs and changes to the configuration are
+	// picked up.
+	bool persist;
+};
+
+int build_create(struct build *out_b, char const *conf_file, char const *profile, bool persist);
+int build_run(struct build *b, struct build_opts const *opts);
+int build_header_report(struct build *b, FILE *fp);
+void build_destroy(struct build *b);
+char const *build_strerror(int err);
+
+#endif
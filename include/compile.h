@@ -1,9 +1,14 @@
 #ifndef COMPILE_H
 #define COMPILE_H
 
+#include <stddef.h>
+
 #include "conf.h"
+#include "graph.h"
 #include "util.h"
 
-void compile(struct conf const *conf, struct str_list const *srcs, struct str_list const *objs);
+void compile_schedule(struct graph *graph, struct conf const *conf, struct intern const *paths, struct id_list const *srcs, struct id_list const *objs, struct bitset const *up_to_date, char *const *mods, size_t *out_jobs);
+char *compile_fmt(struct conf const *conf, char const *fmt, char const *src, char const *obj);
+char *compile_remote_cmd(struct conf const *conf, char const *cflags);
 
 #endif
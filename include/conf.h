@@ -2,11 +2,21 @@
 #define CONF_H
 
 #include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
 
 #include "util.h"
 
+struct flag_rule;
+
 struct conf
 {
+	// target, `name` is NULL for the implicit target of a configuration
+	// without target sections.
+	char *name;
+	struct str_list deps;
+
 	// toolchain.
 	char *cc, *ld;
 	char *cflags, *ldflags;
@@ -25,11 +35,99 @@ struct conf
 	char *cc_inc_fmt, *ld_lib_fmt, *ld_obj_fmt;
 	char *cc_cmd_fmt, *ld_cmd_fmt;
 	int cc_success_rc, ld_success_rc;
+
+	// response files, a format is NULL if the toolchain has none.
+	char *cc_rsp_fmt, *ld_rsp_fmt;
+	size_t rsp_threshold;
+
+	// distributed compilation, `remote` is empty when compiling locally.
+	// workers only run `cc_remote_fmt`, for clients knowing the secret in
+	// `remote_secret_file`.
+	struct str_list remote;
+	char *cc_pp_fmt, *cc_remote_fmt, *remote_secret_file;
+
+	// c++20 modules, the formats are NULL if the toolchain has no use for
+	// them.
+	bool modules;
+	char *cc_p1689_fmt, *cc_bmi_out_fmt, *cc_bmi_in_fmt;
+
+	// link-time optimization, the formats are NULL unless `lto` is set.
+	// `lto_cache_size` is in MiB, 0 if the cache is never pruned.
+	bool lto;
+	char *cc_lto_fmt, *ld_lto_fmt;
+	size_t lto_cache_size;
+
+	// rules changing the flags of some sources, owned by the set.
+	struct flag_rule const *rules;
+	size_t nrules;
+};
+
+struct gen_conf
+{
+	// outputs are patterns expanded for every input matching `inputs`, and
+	// `deps` are further files all of a generator's outputs depend on.
+	char *name;
+	struct str_list inputs, outputs, deps;
+	char *cmd_fmt;
+	int success_rc;
+};
+
+struct test_conf
+{
+	// `deps` are targets which have to be built for the test to run, and
+	// `timeout` is in seconds, 0 if unlimited.
+	char *name, *cmd;
+	struct str_list deps;
+	int timeout;
+};
+
+struct flag_rule
+{
+	// sources matching a pattern of `match`, or under a directory given with
+	// a trailing '/', get `set` instead of the target's flags and `add` after
+	// them, either may be NULL. `targets` is empty for rules on all targets.
+	char *name;
+	struct str_list match, targets;
+	char *set, *add;
+};
+
+struct conf_set
+{
+	struct conf *data;
+	size_t size, cap;
+	char *lib_dir;
+
+	// generators, in the order they were declared.
+	struct gen_conf *gens;
+	size_t ngens;
+
+	// tests, in the order they were declared.
+	struct test_conf *tests;
+	size_t ntests;
+
+	// flag rules, applied in the order they were declared.
+	struct flag_rule *rules;
+	size_t nrules;
+
+	// profile-guided optimization, the formats are NULL if not configured.
+	char *pgo_gen_fmt, *pgo_use_fmt, *pgo_train_cmd, *pgo_merge_cmd;
+	struct str_list pgo_exts;
+
+	// job admission, `mem_budget` is in KiB and 0 when unlimited.
+	size_t mem_budget;
+	int job_nice;
+	bool job_affinity;
+
+	// builds kept in the build log, 0 if it is never trimmed.
+	size_t log_builds;
 };
 
-struct conf conf_from_file(char const *file);
+bool conf_set_from_file(struct conf_set *out_cs, char const *file, char const *profile);
+void conf_set_destroy(struct conf_set *cs);
+ssize_t conf_set_find(struct conf_set const *cs, char const *name);
 void conf_apply_overrides(struct conf *conf);
-void conf_validate(struct conf const *conf);
+bool conf_validate(struct conf const *conf);
+char *conf_src_cflags(struct conf const *conf, char const *src);
 void conf_destroy(struct conf *conf);
 
 #endif
@@ -0,0 +1,12 @@
+#ifndef FLAGSIG_H
+#define FLAGSIG_H
+
+#include "conf.h"
+#include "util.h"
+
+struct str_map flagsig_load(char const *file);
+void flagsig_invalidate(struct str_map const *sigs, struct conf const *conf, struct intern const *paths, struct id_list const *srcs, struct id_list const *objs, struct bitset *up_to_date);
+void flagsig_put(struct str_map *sigs, struct conf const *conf, char const *src, char const *obj);
+bool flagsig_save(struct str_map const *sigs, char const *file);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef GEN_H
+#define GEN_H
+
+#include <stdbool.h>
+
+#include "conf.h"
+#include "graph.h"
+
+bool gen_run(struct conf_set const *cs, bool force, struct graph_opts const *opts);
+
+#endif
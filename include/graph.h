@@ -0,0 +1,96 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+struct job
+{
+	// called on the thread running the job to produce the shell command to
+	// execute. jobs without `mk_cmd`, or for which it returns NULL, only
+	// exist to order other jobs.
+	char *(*mk_cmd)(void *ctx);
+	void *ctx;
+
+	// owned by the scheduler once the job is added. `out` is the file the
+	// job produces, if any. when `out_tmp` is set the command writes there
+	// instead, and it is only renamed to `out` once the job has succeeded,
+	// otherwise a failed job's `out` is removed.
+	char *name, *err, *out, *out_tmp;
+	int success_rc;
+	bool counted;
+
+	// expected peak memory of the command in KiB, 0 if unknown, and the
+	// number of job slots the command keeps busy by itself, 0 counting as 1.
+	size_t mem_est, threads;
+
+	// a command still running after `timeout` seconds is killed and fails
+	// with `timed_out` set, 0 lets it run for as long as it takes. when `log`
+	// is set, the output of the command is also written there, and `quiet`
+	// only shows it when the command fails.
+	double timeout;
+	char *log;
+	bool quiet, timed_out;
+
+	// set once the job has succeeded, whether or not it ran a command.
+	bool succeeded;
+
+	// measurements filled in for jobs whose command ran and succeeded.
+	bool measured;
+	size_t peak_rss, out_size;
+	double duration, cpu_time;
+
+	// jobs which wait on this one, and the number of jobs this one is still
+	// waiting on.
+	size_t *rdeps;
+	size_t nrdeps, rdeps_cap, nwait;
+};
+
+// how jobs are run, shared by the graphs of a build. `keep_going` keeps
+// running what does not depend on a failed job, `verbose` shows the command of
+// each job and `threads` waits on jobs from a pool of threads instead of one
+// event loop. job events are written as JSON lines to `events_fp` if set.
+struct graph_opts
+{
+	bool keep_going, verbose, threads;
+	FILE *events_fp;
+};
+
+struct graph_res
+{
+	void *ptr;
+	void (*destroy)(void *);
+};
+
+struct graph
+{
+	struct job *data;
+	size_t size, cap;
+	struct graph_opts opts;
+
+	// job contexts are never freed by the scheduler itself, anything they
+	// point to should be handed over through `graph_own()`.
+	struct graph_res *res;
+	size_t res_size, res_cap;
+
+	// jobs are only started while their summed `mem_est` stays within the
+	// budget in KiB, unless nothing else is running. 0 disables the limit.
+	size_t mem_budget;
+	int nice;
+	bool affinity;
+
+	// jobs are independent of each other, so a failure never stops the rest
+	// and the caller reports the outcome itself.
+	bool independent;
+};
+
+size_t graph_slots(void);
+struct graph graph_create(struct graph_opts const *opts);
+void graph_destroy(struct graph *s);
+size_t graph_add(struct graph *s, struct job const *job);
+void graph_dep(struct graph *s, size_t job, size_t dep);
+void graph_own(struct graph *s, void *ptr, void (*destroy)(void *));
+bool graph_run(struct graph *s);
+
+#endif
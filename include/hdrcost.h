@@ -0,0 +1,34 @@
+#ifndef HDRCOST_H
+#define HDRCOST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "conf.h"
+#include "hist.h"
+#include "util.h"
+
+struct hdrcost
+{
+	// indexed by path id, only meaningful for headers. `tus` counts the
+	// sources including a header at all, `direct` the files including it
+	// themselves.
+	size_t *direct, *tus, *parse_tus;
+	double *rebuild, *parse;
+	struct bitset is_hdr;
+	struct id_list hdrs;
+	size_t size, nsrcs;
+	bool have_hist, have_traces;
+
+	// headers by real path, for matching up compiler traces.
+	struct str_map real;
+};
+
+struct hdrcost hdrcost_create(size_t npaths);
+void hdrcost_destroy(struct hdrcost *hc);
+bool hdrcost_add_target(struct hdrcost *hc, struct conf const *conf, struct intern const *paths, struct id_list const *srcs, struct id_list const *objs, struct id_list const *hdrs, struct hist const *hist);
+bool hdrcost_add_traces(struct hdrcost *hc, char *lib_dir);
+void hdrcost_print(struct hdrcost const *hc, struct intern const *paths, FILE *fp);
+
+#endif
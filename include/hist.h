@@ -0,0 +1,36 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "util.h"
+
+struct hist_rec
+{
+	char const *name;
+	size_t peak_rss; // KiB.
+	size_t size; // of the output in bytes.
+	double duration, cpu_time;
+};
+
+struct hist
+{
+	// the most recent measurement of every job which ever succeeded.
+	struct hist_rec *data;
+	size_t size, cap;
+	struct str_map ids;
+};
+
+struct hist hist_load(char const *file);
+void hist_save(struct hist const *h, char const *file);
+void hist_destroy(struct hist *h);
+struct hist_rec const *hist_find(struct hist const *h, char const *name);
+void hist_put(struct hist *h, struct hist_rec const *rec);
+size_t hist_mean_rss(struct hist const *h);
+void hist_log_append(char const *file, size_t keep, struct timespec const *when, double wall, bool success, struct hist_rec const *recs, size_t nrecs);
+bool hist_log_compare(char const *file, char const *base, double threshold, FILE *out_fp, bool *out_regressed);
+
+#endif
@@ -1,8 +1,13 @@
 #ifndef LINK_H
 #define LINK_H
 
+#include <stddef.h>
+
 #include "conf.h"
+#include "graph.h"
+#include "util.h"
 
-void link_objs(struct conf const *conf);
+size_t link_schedule(struct graph *graph, struct conf const *conf, struct str_list const *objs, struct str_list const *dep_outs);
+void link_prune_cache(struct conf const *conf);
 
 #endif
@@ -0,0 +1,45 @@
+#ifndef MODULES_H
+#define MODULES_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "conf.h"
+#include "graph.h"
+#include "util.h"
+
+struct mod_src
+{
+	// the module a source provides, NULL if none, and those it imports.
+	char *provides;
+	struct str_list requires;
+};
+
+struct mod_prov
+{
+	// position of the providing source in its target's list.
+	size_t target, src;
+	char *name, *bmi;
+	int mark;
+	bool dirty;
+};
+
+struct modules
+{
+	// indexed by target, then by the position of the source in its list.
+	// `flags` is NULL for sources which have nothing to do with modules.
+	struct mod_src **srcs;
+	char ***flags;
+	size_t *nsrcs, ntargets;
+
+	struct mod_prov *provs;
+	size_t nprovs, provs_cap;
+	struct str_map names;
+};
+
+bool modules_create(struct modules *out_m, struct conf_set const *cs, struct intern const *paths, struct id_list const *srcs, struct id_list const *objs, struct bitset const *up_to_date, struct graph_opts const *opts);
+void modules_destroy(struct modules *m);
+bool modules_plan(struct modules *m, struct conf_set const *cs, struct id_list const *srcs, struct bitset *up_to_date);
+void modules_deps(struct modules const *m, struct graph *graph, size_t *const *jobs);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef PGO_H
+#define PGO_H
+
+#include <stdbool.h>
+
+#include "conf.h"
+#include "graph.h"
+#include "util.h"
+
+enum pgo_phase
+{
+	PGO_NONE = 0,
+	PGO_GEN,
+	PGO_USE,
+};
+
+bool pgo_variant(struct conf_set *cs, enum pgo_phase phase);
+bool pgo_train(struct conf_set const *gen_cs, struct graph_opts const *opts);
+bool pgo_invalidate(struct conf_set const *cs, struct intern const *paths, struct id_list const *srcs, struct id_list const *objs, struct bitset *up_to_date);
+
+#endif
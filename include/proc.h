@@ -0,0 +1,26 @@
+#ifndef PROC_H
+#define PROC_H
+
+#include <stdbool.h>
+
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include "util.h"
+
+struct proc
+{
+	// the child leads its own process group, so that everything it starts
+	// can be signalled together.
+	pid_t pid;
+	int out_fd;
+};
+
+bool proc_spawn(struct proc *out_p, char const *cmd, int nice_inc, int cpu);
+int proc_wait(struct proc *p, struct string *out_output, struct rusage *out_ru);
+bool proc_read(struct proc *p, struct string *out_output);
+int proc_reap(struct proc *p, struct rusage *out_ru);
+int proc_pidfd(pid_t pid);
+void proc_kill(pid_t pid, bool force);
+
+#endif
@@ -1,9 +1,35 @@
 #ifndef PRUNE_H
 #define PRUNE_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <sys/types.h>
+
 #include "conf.h"
 #include "util.h"
 
-void prune(struct conf const *conf, struct str_list *srcs, struct str_list *objs, struct str_list const *hdrs);
+struct prune_cache_ent
+{
+	// the include names of a file as of its modification time and size,
+	// NULL if it was never scanned.
+	char *names;
+	size_t nnames;
+	struct timespec mt;
+	off_t size;
+};
+
+struct prune_cache
+{
+	// indexed by path id, kept across builds by a long-lived process.
+	struct prune_cache_ent *data;
+	size_t size;
+};
+
+struct prune_cache prune_cache_create(void);
+void prune_cache_destroy(struct prune_cache *pc);
+bool prune(struct conf const *conf, struct intern const *paths, struct id_list const *srcs, struct id_list const *objs, struct id_list const *hdrs, struct prune_cache *cache, struct bitset *out_up_to_date);
+bool prune_scan(struct conf const *conf, struct intern const *paths, struct id_list const *hdrs, struct id_list const *files, struct id_list *out_incs);
 
 #endif
@@ -0,0 +1,14 @@
+#ifndef REXEC_H
+#define REXEC_H
+
+#include "util.h"
+
+// names the preprocessed input and the object inside a worker's job
+// directory, as seen by the remote compile command.
+#define REXEC_IN_NAME "in.pp"
+#define REXEC_OUT_NAME "out.o"
+
+int rexec_client(char const *hosts, char const *secret_file, char const *target, char const *cflags, char const *pp_cmd, char const *pp_file, char const *local_cmd, char const *obj);
+int rexec_worker(char const *addr, char const *conf_file, char const *profile);
+
+#endif
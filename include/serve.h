@@ -0,0 +1,9 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "build.h"
+
+int serve(char const *sock_path, char const *conf_file, char const *profile, struct build_opts const *opts);
+int serve_client(char const *sock_path, int argc, char const *argv[]);
+
+#endif
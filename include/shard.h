@@ -0,0 +1,11 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stddef.h>
+
+#include "hist.h"
+#include "util.h"
+
+void shard_select(struct intern const *paths, struct id_list const *srcs, struct id_list const *objs, struct bitset *up_to_date, size_t ntargets, struct hist const *hist, size_t shard, size_t nshards);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef SNAP_H
+#define SNAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <sys/types.h>
+
+#include "util.h"
+
+struct snap_dir
+{
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	struct str_list files, dirs;
+};
+
+struct snap
+{
+	// `old` is sorted by path for lookup, `cur` is built during the walk and
+	// is what gets persisted.
+	struct snap_dir *old, *cur;
+	size_t old_size, cur_size, cur_cap;
+	struct timespec old_taken, cur_taken;
+	size_t hits, misses;
+
+	// owns every path and name held by the directories.
+	struct arena arena;
+};
+
+struct snap snap_load(char const *file);
+void snap_save(struct snap *snap, char const *file);
+void snap_destroy(struct snap *snap);
+struct str_list snap_ext_find(struct snap *snap, char const *dir, struct str_list const *exts);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// all counters may be bumped from several threads at once and so must only
+// be changed through `stats_add()`. times are in nanoseconds.
+struct stats
+{
+	// phases of a build.
+	uint64_t conf_ns, gen_ns, discover_ns, prune_ns, schedule_ns, build_ns;
+	uint64_t train_ns, test_ns, total_ns;
+
+	// discovery.
+	uint64_t files_found, snap_hits, snap_misses;
+
+	// pruning.
+	uint64_t files_read, bytes_read, stat_calls, scan_ns, cache_hits;
+
+	// building.
+	uint64_t jobs_spawned, child_cpu_ns, compile_ns, link_ns, lto_ns;
+
+	// of mincbuild itself, in KiB.
+	uint64_t peak_rss;
+};
+
+extern struct stats stats;
+
+uint64_t stats_now(void);
+void stats_add(uint64_t *ctr, uint64_t n);
+void stats_print(FILE *fp);
+void stats_write_json(FILE *fp);
+
+#endif
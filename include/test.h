@@ -0,0 +1,12 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdbool.h>
+
+#include "conf.h"
+#include "graph.h"
+#include "hist.h"
+
+bool test_run(struct conf_set const *cs, bool const *built, struct hist *hist, bool skip_passed, struct graph_opts const *opts);
+
+#endif
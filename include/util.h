@@ -14,6 +14,54 @@ struct str_list
 {
 	char **data;
 	size_t size, cap;
+
+	// borrowed lists only hold pointers owned elsewhere (e.g. by an arena)
+	// and never copy or free their items.
+	bool borrowed;
+};
+
+struct arena_blk
+{
+	struct arena_blk *next;
+	size_t size, used;
+	char data[];
+};
+
+struct arena
+{
+	struct arena_blk *head;
+};
+
+struct str_map_ent
+{
+	char *key;
+	size_t val;
+};
+
+struct str_map
+{
+	struct str_map_ent *data;
+	size_t size, cap;
+};
+
+struct id_list
+{
+	size_t *data;
+	size_t size, cap;
+};
+
+struct bitset
+{
+	unsigned long *data;
+	size_t size;
+};
+
+struct intern
+{
+	// ids index `strs`, which point at the keys owned by `ids`.
+	struct str_map ids;
+	char const **strs;
+	size_t size, cap;
 };
 
 struct fmt_spec_ent
@@ -28,13 +76,31 @@ struct fmt_spec
 	size_t size, cap;
 };
 
+struct fmt_tok
+{
+	// literal text when `fn` is NULL.
+	void (*fn)(struct string *, void *);
+	char ch;
+	char *lit;
+	size_t lit_len;
+};
+
+struct fmt_tmpl
+{
+	struct fmt_tok *data;
+	size_t size, cap;
+	size_t lit_len;
+};
+
 struct string string_create(void);
 void string_destroy(struct string *s);
 void string_push_ch(struct string *s, char ch);
 void string_push_str(struct string *s, char const *str);
+void string_push_buf(struct string *s, char const *buf, size_t len);
 char *string_to_str(struct string const *s);
 
 struct str_list str_list_create(void);
+struct str_list str_list_create_borrowed(void);
 void str_list_destroy(struct str_list *s);
 struct str_list str_list_copy(struct str_list const *s);
 void str_list_add(struct str_list *s, char const *new);
@@ -42,6 +108,36 @@ void str_list_rm(struct str_list *s, size_t ind);
 void str_list_rm_no_free(struct str_list *s, size_t ind);
 bool str_list_contains(struct str_list const *s, char const *str);
 
+struct arena arena_create(void);
+void arena_destroy(struct arena *a);
+void *arena_alloc(struct arena *a, size_t size);
+char *arena_strdup(struct arena *a, char const *str);
+char *arena_strndup(struct arena *a, char const *str, size_t len);
+
+struct str_map str_map_create(void);
+void str_map_destroy(struct str_map *m);
+char const *str_map_put(struct str_map *m, char const *key, size_t val);
+bool str_map_get(struct str_map const *m, char const *key, size_t *out_val);
+size_t str_hash(char const *str);
+size_t file_hash(char const *path, size_t hash);
+
+struct id_list id_list_create(void);
+void id_list_destroy(struct id_list *l);
+void id_list_add(struct id_list *l, size_t id);
+
+struct bitset bitset_create(size_t size);
+void bitset_destroy(struct bitset *b);
+void bitset_set(struct bitset *b, size_t ind);
+void bitset_set_atomic(struct bitset *b, size_t ind);
+void bitset_clr(struct bitset *b, size_t ind);
+bool bitset_test(struct bitset const *b, size_t ind);
+
+struct intern intern_create(void);
+void intern_destroy(struct intern *in);
+size_t intern_add(struct intern *in, char const *str);
+bool intern_find(struct intern const *in, char const *str, size_t *out_id);
+char const *intern_str(struct intern const *in, size_t id);
+
 struct fmt_spec fmt_spec_create(void);
 void fmt_spec_destroy(struct fmt_spec *f);
 void fmt_spec_add_ent(struct fmt_spec *f, char ch, void (*fn)(struct string *, void *));
@@ -49,8 +145,20 @@ struct string fmt_string(struct fmt_spec const *f, char const *fmt, void *data);
 void fmt_inplace(struct string *out_str, struct fmt_spec const *f, char const *fmt, void *data);
 char *fmt_str(struct fmt_spec const *f, char const *fmt, void *data);
 
+struct fmt_tmpl fmt_tmpl_create(struct fmt_spec const *f, char const *fmt);
+void fmt_tmpl_destroy(struct fmt_tmpl *t);
+void fmt_tmpl_bake(struct fmt_tmpl *t, char const *chs, void *data);
+void fmt_tmpl_inplace(struct string *out_str, struct fmt_tmpl const *t, void *data);
+char *fmt_tmpl_str(struct fmt_tmpl const *t, void *data);
+
 void mkdir_recursive(char const *dir);
+bool read_file(char const *path, struct string *out_conts);
+bool write_file(char const *path, char const *buf, size_t len);
+size_t mem_available(void);
 char *sanitize_path(char const *path);
-struct str_list ext_find(char *dir, struct str_list const *exts);
+void sanitize_path_inplace(struct string *out_str, char const *path);
+void json_str_inplace(struct string *out_str, char const *buf, size_t len);
+void shell_quote_inplace(struct string *out_str, char const *str);
+bool ext_find(char *dir, struct str_list const *exts, struct str_list *out_files);
 
 #endif
@@ -0,0 +1,685 @@
+#include "build.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "compile.h"
+#include "flagsig.h"
+#include "gen.h"
+#include "graph.h"
+#include "hdrcost.h"
+#include "hist.h"
+#include "link.h"
+#include "modules.h"
+#include "pgo.h"
+#include "shard.h"
+#include "snap.h"
+#include "stats.h"
+#include "test.h"
+
+#define SNAP_FILE "mincbuild.snap"
+#define HIST_FILE "mincbuild.hist"
+#define LOG_FILE "mincbuild.log"
+#define FLAGSIG_FILE "mincbuild.flags"
+
+// what was found out about the targets before anything is run.
+struct plan
+{
+	struct conf_set const *cs;
+	struct build_opts const *opts;
+	enum pgo_phase phase;
+	struct id_list *srcs, *objs;
+	struct bitset *up_to_date;
+	struct modules mods;
+	struct hist hist;
+	struct str_map flagsigs;
+	char *hist_file, *log_file, *flagsig_file;
+};
+
+static int load_conf(struct build *b);
+static int generate(struct build const *b, struct build_opts const *opts);
+static int run(struct build *b, struct build_opts const *opts, struct conf_set const *cs, enum pgo_phase phase, uint64_t start);
+static int run_pgo(struct build *b, struct build_opts const *opts, uint64_t start);
+static void discover(struct build *b, struct snap *snap, struct conf const *conf, bool want_hdrs, struct id_list *out_srcs, struct id_list *out_objs, struct id_list *out_hdrs);
+static char *lib_file(struct conf_set const *cs, char const *name);
+static int execute(struct build const *b, struct plan *plan, uint64_t start);
+static void rm_stale_tmps(struct conf_set const *cs);
+static bool link_only_ck(struct intern const *paths, struct id_list const *srcs, struct id_list const *objs, struct bitset *out_up_to_date);
+
+int
+build_create(struct build *out_b, char const *conf_file, char const *profile,
+             bool persist)
+{
+	*out_b = (struct build)
+	{
+		.conf_file = strdup(conf_file),
+		.profile = profile ? strdup(profile) : NULL,
+		.paths = intern_create(),
+		.cache = prune_cache_create(),
+		.persist = persist,
+	};
+
+	int err = load_conf(out_b);
+	if (err)
+	{
+		free(out_b->conf_file);
+		free(out_b->profile);
+		intern_destroy(&out_b->paths);
+		prune_cache_destroy(&out_b->cache);
+	}
+	
+	return err;
+}
+
+int
+build_run(struct build *b, struct build_opts const *opts)
+{
+	stats = (struct stats){0};
+
+	// a long-lived process picks up changes to the configuration.
+	struct stat s;
+	if (b->persist && !stat(b->conf_file, &s)
+	    && (s.st_mtim.tv_sec != b->conf_mt.tv_sec
+	        || s.st_mtim.tv_nsec != b->conf_mt.tv_nsec))
+	{
+		int err = load_conf(b);
+		if (err)
+			return err;
+	}
+
+	uint64_t start = stats_now();
+	rm_stale_tmps(&b->cs);
+	stats.conf_ns = stats_now() - start + b->load_ns;
+	start -= b->load_ns;
+	b->load_ns = 0;
+
+	// generated files have to be in place before anything is discovered.
+	int err = generate(b, opts);
+	if (err)
+		return err;
+
+	return opts->pgo ? run_pgo(b, opts, start) : run(b, opts, &b->cs, PGO_NONE, start);
+}
+
+int
+build_header_report(struct build *b, FILE *fp)
+{
+	struct conf_set const *cs = &b->cs;
+	char *snap_file = lib_file(cs, SNAP_FILE);
+	struct snap snap = snap_load(snap_file);
+
+	struct id_list *srcs = malloc(sizeof(struct id_list) * cs->size);
+	struct id_list *objs = malloc(sizeof(struct id_list) * cs->size);
+	struct id_list *hdrs = malloc(sizeof(struct id_list) * cs->size);
+	for (size_t i = 0; i < cs->size; ++i)
+		discover(b, &snap, &cs->data[i], true, &srcs[i], &objs[i], &hdrs[i]);
+
+	snap_save(&snap, snap_file);
+	snap_destroy(&snap);
+	free(snap_file);
+
+	// what a header costs to change comes from the recorded compile times of
+	// the sources including it.
+	char *hist_file = lib_file(cs, HIST_FILE);
+	struct hist hist = hist_load(hist_file);
+	free(hist_file);
+	
+	struct hdrcost hc = hdrcost_create(b->paths.size);
+	int err = BUILD_OK;
+	for (size_t i = 0; i < cs->size && !err; ++i)
+	{
+		if (!hdrcost_add_target(&hc, &cs->data[i], &b->paths, &srcs[i], &objs[i],
+		                        &hdrs[i], &hist))
+		{
+			err = BUILD_ERR_PRUNE;
+		}
+	}
+
+	for (size_t i = 0; i < cs->size && !err; ++i)
+	{
+		if (!hdrcost_add_traces(&hc, cs->data[i].lib_dir))
+			err = BUILD_ERR_PRUNE;
+	}
+
+	if (!err)
+		hdrcost_print(&hc, &b->paths, fp);
+
+	hdrcost_destroy(&hc);
+	hist_destroy(&hist);
+	for (size_t i = 0; i < cs->size; ++i)
+	{
+		id_list_destroy(&srcs[i]);
+		id_list_destroy(&objs[i]);
+		id_list_destroy(&hdrs[i]);
+	}
+	free(srcs);
+	free(objs);
+	free(hdrs);
+	
+	return err;
+}
+
+void
+build_destroy(struct build *b)
+{
+	free(b->conf_file);
+	free(b->profile);
+	conf_set_destroy(&b->cs);
+	intern_destroy(&b->paths);
+	prune_cache_destroy(&b->cache);
+}
+
+char const *
+build_strerror(int err)
+{
+	switch (err)
+	{
+	case BUILD_OK:
+		return "build succeeded";
+	case BUILD_FAILED:
+		return "build failed";
+	case BUILD_ERR_CONF:
+		return "invalid configuration";
+	case BUILD_ERR_PRUNE:
+		return "failed to check what is out of date";
+	case BUILD_ERR_PROC:
+		return "failed to run build process";
+	case BUILD_ERR_USAGE:
+		return "invalid options";
+	case BUILD_ERR_MODULES:
+		return "failed to order modules";
+	case BUILD_TESTS_FAILED:
+		return "tests failed";
+	case BUILD_ERR_TRAIN:
+		return "profile training failed";
+	default:
+		return "unknown error";
+	}
+}
+
+static int
+load_conf(struct build *b)
+{
+	uint64_t start = stats_now();
+
+	// the time the configuration was changed is only taken over once it
+	// loaded, so a persistent build keeps reporting errors until fixed.
+	struct stat s;
+	bool have_mt = !stat(b->conf_file, &s);
+	
+	struct conf_set cs;
+	if (!conf_set_from_file(&cs, b->conf_file, b->profile))
+		return BUILD_ERR_CONF;
+
+	bool ok = true;
+	for (size_t i = 0; i < cs.size && ok; ++i)
+	{
+		conf_apply_overrides(&cs.data[i]);
+		ok = conf_validate(&cs.data[i]);
+	}
+
+	if (!ok)
+	{
+		conf_set_destroy(&cs);
+		return BUILD_ERR_CONF;
+	}
+
+	conf_set_destroy(&b->cs);
+	b->cs = cs;
+	if (have_mt)
+		b->conf_mt = s.st_mtim;
+
+	b->load_ns = stats_now() - start;
+	return BUILD_OK;
+}
+
+static int
+generate(struct build const *b, struct build_opts const *opts)
+{
+	if (!b->cs.ngens)
+		return BUILD_OK;
+
+	uint64_t start = stats_now();
+	int err = gen_run(&b->cs, opts->force, &opts->graph) ? BUILD_OK : BUILD_FAILED;
+	stats.gen_ns = stats_now() - start;
+	return err;
+}
+
+static int
+run(struct build *b, struct build_opts const *opts,
+    struct conf_set const *cs, enum pgo_phase phase, uint64_t start)
+{
+	uint64_t phase_start = stats_now(), prune_ns = stats.prune_ns;
+
+	// directory listings are cached between runs so that only directories
+	// which actually changed are read again.
+	char *snap_file = lib_file(cs, SNAP_FILE);
+	struct snap snap = snap_load(snap_file);
+
+	// every path is interned once, after which sources, objects and headers
+	// are only ever handled as indices into the shared table.
+	struct plan plan =
+	{
+		.cs = cs,
+		.opts = opts,
+		.phase = phase,
+		.srcs = malloc(sizeof(struct id_list) * cs->size),
+		.objs = malloc(sizeof(struct id_list) * cs->size),
+		.up_to_date = malloc(sizeof(struct bitset) * cs->size),
+		.flagsig_file = lib_file(cs, FLAGSIG_FILE),
+	};
+	plan.flagsigs = flagsig_load(plan.flagsig_file);
+	
+	bool pruned = true;
+	for (size_t i = 0; i < cs->size; ++i)
+	{
+		struct conf const *conf = &cs->data[i];
+		
+		struct id_list hdrs;
+		discover(b, &snap, conf, !opts->force && !opts->link_only, &plan.srcs[i],
+		         &plan.objs[i], &hdrs);
+
+		plan.up_to_date[i] = bitset_create(b->paths.size);
+		if (opts->link_only && pruned)
+			pruned = link_only_ck(&b->paths, &plan.srcs[i], &plan.objs[i], &plan.up_to_date[i]);
+		else if (!opts->force && pruned)
+		{
+			uint64_t prune_start = stats_now();
+			pruned = prune(conf, &b->paths, &plan.srcs[i], &plan.objs[i], &hdrs,
+			               b->persist ? &b->cache : NULL, &plan.up_to_date[i]);
+			stats.prune_ns += stats_now() - prune_start;
+
+			// neither are profiles nor the flags of single sources.
+			if (pruned && phase == PGO_USE)
+				pruned = pgo_invalidate(cs, &b->paths, &plan.srcs[i], &plan.objs[i], &plan.up_to_date[i]);
+			if (pruned)
+				flagsig_invalidate(&plan.flagsigs, conf, &b->paths, &plan.srcs[i], &plan.objs[i], &plan.up_to_date[i]);
+		}
+		
+		id_list_destroy(&hdrs);
+	}
+
+	snap_save(&snap, snap_file);
+	stats.snap_hits = snap.hits;
+	stats.snap_misses = snap.misses;
+	snap_destroy(&snap);
+	free(snap_file);
+	
+	// pruning happens while discovering each target.
+	stats.discover_ns += stats_now() - phase_start - (stats.prune_ns - prune_ns);
+
+	plan.hist_file = lib_file(cs, HIST_FILE);
+	plan.hist = hist_load(plan.hist_file);
+	plan.log_file = lib_file(cs, LOG_FILE);
+
+	int err = pruned ? BUILD_OK : BUILD_ERR_PRUNE;
+
+	// modules order compiles, and may require more of them than pruning found.
+	bool have_mods = false;
+	if (!err)
+	{
+		have_mods = modules_create(&plan.mods, cs, &b->paths, plan.srcs, plan.objs,
+		                           plan.up_to_date, &opts->graph);
+		if (!have_mods || !modules_plan(&plan.mods, cs, plan.srcs, plan.up_to_date))
+			err = BUILD_ERR_MODULES;
+		else if (plan.mods.nprovs && opts->nshards)
+		{
+			fputs("builds using modules cannot be sharded!\n", stderr);
+			err = BUILD_ERR_USAGE;
+		}
+	}
+	
+	if (!err)
+		err = execute(b, &plan, start);
+
+	if (have_mods)
+		modules_destroy(&plan.mods);
+	hist_destroy(&plan.hist);
+	str_map_destroy(&plan.flagsigs);
+	free(plan.hist_file);
+	free(plan.log_file);
+	free(plan.flagsig_file);
+	
+	for (size_t i = 0; i < cs->size; ++i)
+	{
+		id_list_destroy(&plan.srcs[i]);
+		id_list_destroy(&plan.objs[i]);
+		bitset_destroy(&plan.up_to_date[i]);
+	}
+	free(plan.srcs);
+	free(plan.objs);
+	free(plan.up_to_date);
+
+	return err;
+}
+
+static int
+run_pgo(struct build *b, struct build_opts const *opts, uint64_t start)
+{
+	// both phases are built from sets of their own, loaded like the one of
+	// a regular build and then moved to their own trees.
+	struct conf_set gen_cs;
+	if (!conf_set_from_file(&gen_cs, b->conf_file, b->profile))
+		return BUILD_ERR_CONF;
+	
+	int err = pgo_variant(&gen_cs, PGO_GEN) ? BUILD_OK : BUILD_ERR_CONF;
+	if (!err)
+		err = run(b, opts, &gen_cs, PGO_GEN, start);
+	
+	if (!err)
+	{
+		uint64_t train_start = stats_now();
+		err = pgo_train(&gen_cs, &opts->graph) ? BUILD_OK : BUILD_ERR_TRAIN;
+		stats.train_ns = stats_now() - train_start;
+	}
+	
+	conf_set_destroy(&gen_cs);
+	if (err)
+		return err;
+
+	struct conf_set use_cs;
+	if (!conf_set_from_file(&use_cs, b->conf_file, b->profile))
+		return BUILD_ERR_CONF;
+	
+	err = pgo_variant(&use_cs, PGO_USE) ? BUILD_OK : BUILD_ERR_CONF;
+	if (!err)
+		err = run(b, opts, &use_cs, PGO_USE, start);
+
+	conf_set_destroy(&use_cs);
+	return err;
+}
+
+static void
+discover(struct build *b, struct snap *snap, struct conf const *conf,
+         bool want_hdrs, struct id_list *out_srcs, struct id_list *out_objs,
+         struct id_list *out_hdrs)
+{
+	struct str_list src_paths = snap_ext_find(snap, conf->src_dir, &conf->src_exts);
+	
+	*out_srcs = id_list_create();
+	*out_objs = id_list_create();
+	struct string obj = string_create();
+	size_t src_dir_len = strlen(conf->src_dir);
+	for (size_t i = 0; i < src_paths.size; ++i)
+	{
+		char const *src = src_paths.data[i] + src_dir_len;
+		src += *src == '/';
+
+		obj.len = 0;
+		string_push_str(&obj, conf->lib_dir);
+		string_push_ch(&obj, '/');
+		string_push_str(&obj, src);
+		string_push_buf(&obj, ".o", 3);
+
+		id_list_add(out_srcs, intern_add(&b->paths, src_paths.data[i]));
+		id_list_add(out_objs, intern_add(&b->paths, obj.str));
+	}
+
+	stats.files_found += src_paths.size;
+	string_destroy(&obj);
+	str_list_destroy(&src_paths);
+
+	*out_hdrs = id_list_create();
+	if (want_hdrs)
+	{
+		struct str_list hdr_paths = snap_ext_find(snap, conf->inc_dir, &conf->hdr_exts);
+		for (size_t i = 0; i < hdr_paths.size; ++i)
+			id_list_add(out_hdrs, intern_add(&b->paths, hdr_paths.data[i]));
+		stats.files_found += hdr_paths.size;
+		str_list_destroy(&hdr_paths);
+	}
+}
+
+static char *
+lib_file(struct conf_set const *cs, char const *name)
+{
+	char *file = malloc(strlen(cs->lib_dir) + strlen(name) + 2);
+	sprintf(file, "%s/%s", cs->lib_dir, name);
+	return file;
+}
+
+static int
+execute(struct build const *b, struct plan *plan, uint64_t start)
+{
+	struct conf_set const *cs = plan->cs;
+	struct build_opts const *opts = plan->opts;
+	uint64_t phase_start = stats_now();
+	
+	// a shard only compiles its part of what is out of date, and leaves
+	// linking to a later `--link-only` run over the gathered objects.
+	if (opts->nshards)
+	{
+		shard_select(&b->paths, plan->srcs, plan->objs, plan->up_to_date, cs->size,
+		             &plan->hist, opts->shard, opts->nshards);
+	}
+
+	// all targets share one pool of workers, and a target's link starts as
+	// soon as its own objects and the targets it depends on are done.
+	struct graph graph = graph_create(&opts->graph);
+	size_t *link_jobs = malloc(sizeof(size_t) * cs->size);
+	size_t **jobs = malloc(sizeof(size_t *) * cs->size);
+	for (size_t i = 0; i < cs->size; ++i)
+	{
+		struct conf const *conf = &cs->data[i];
+		
+		struct str_list dep_outs = str_list_create();
+		for (size_t j = 0; j < conf->deps.size; ++j)
+		{
+			struct conf const *dep = &cs->data[conf_set_find(cs, conf->deps.data[j])];
+			if (dep->produce_output)
+				str_list_add(&dep_outs, dep->output);
+		}
+
+		struct str_list objs = str_list_create();
+		for (size_t j = 0; j < plan->objs[i].size; ++j)
+			str_list_add(&objs, intern_str(&b->paths, plan->objs[i].data[j]));
+
+		if (conf->produce_output && !opts->nshards)
+			link_jobs[i] = link_schedule(&graph, conf, &objs, &dep_outs);
+		else
+			link_jobs[i] = graph_add(&graph, &(struct job){0});
+		
+		str_list_destroy(&objs);
+		str_list_destroy(&dep_outs);
+
+		size_t first = graph.size;
+		jobs[i] = malloc(sizeof(size_t) * (plan->srcs[i].size + 1));
+		compile_schedule(&graph, conf, &b->paths, &plan->srcs[i], &plan->objs[i],
+		                 &plan->up_to_date[i], plan->mods.flags[i], jobs[i]);
+		for (size_t j = first; j < graph.size; ++j)
+			graph_dep(&graph, link_jobs[i], j);
+	}
+
+	for (size_t i = 0; i < cs->size; ++i)
+	{
+		struct conf const *conf = &cs->data[i];
+		for (size_t j = 0; j < conf->deps.size; ++j)
+			graph_dep(&graph, link_jobs[i], link_jobs[conf_set_find(cs, conf->deps.data[j])]);
+	}
+
+	modules_deps(&plan->mods, &graph, jobs);
+
+	// memory use of each job is predicted from what it needed last time, and
+	// jobs never seen before are assumed to be about average.
+	size_t mean_rss = hist_mean_rss(&plan->hist);
+	for (size_t i = 0; i < graph.size; ++i)
+	{
+		struct job *job = &graph.data[i];
+		if (!job->name)
+			continue;
+
+		struct hist_rec const *rec = hist_find(&plan->hist, job->name);
+		job->mem_est = rec ? rec->peak_rss : mean_rss;
+	}
+
+	graph.mem_budget = cs->mem_budget;
+	graph.nice = cs->job_nice;
+	graph.affinity = cs->job_affinity;
+	stats.schedule_ns += stats_now() - phase_start;
+	
+	struct timespec build_start;
+	clock_gettime(CLOCK_REALTIME, &build_start);
+	
+	phase_start = stats_now();
+	bool success = graph_run(&graph);
+	stats.build_ns += stats_now() - phase_start;
+
+	// objects which are now up to date record the flags they were compiled
+	// with, while failed ones keep what they had. a shard cannot tell the
+	// objects of other shards from those which are up to date.
+	for (size_t i = 0; i < cs->size; ++i)
+	{
+		for (size_t j = 0; j < plan->srcs[i].size; ++j)
+		{
+			size_t job = jobs[i][j];
+			if (job == SIZE_MAX ? opts->nshards : !graph.data[job].measured)
+				continue;
+
+			flagsig_put(&plan->flagsigs, &cs->data[i],
+			            intern_str(&b->paths, plan->srcs[i].data[j]),
+			            intern_str(&b->paths, plan->objs[i].data[j]));
+		}
+		free(jobs[i]);
+	}
+	free(jobs);
+	bool saved = flagsig_save(&plan->flagsigs, plan->flagsig_file);
+
+	// tests only make sense against complete targets, which neither shards
+	// nor instrumented builds produce. with `-k`, the tests of the targets
+	// which did build still run after a failure.
+	bool tests_ok = true;
+	if ((success || opts->graph.keep_going) && opts->test && !opts->nshards
+	    && plan->phase != PGO_GEN)
+	{
+		bool *built = malloc(sizeof(bool) * cs->size);
+		for (size_t i = 0; i < cs->size; ++i)
+			built[i] = graph.data[link_jobs[i]].succeeded;
+
+		phase_start = stats_now();
+		tests_ok = test_run(cs, built, &plan->hist, opts->skip_passed, &opts->graph);
+		stats.test_ns = stats_now() - phase_start;
+		free(built);
+	}
+
+	struct hist_rec *recs = malloc(sizeof(struct hist_rec) * (graph.size + 1));
+	size_t nrecs = 0;
+
+	for (size_t i = 0; i < graph.size; ++i)
+	{
+		struct job const *job = &graph.data[i];
+		if (!job->measured)
+			continue;
+
+		// only lto links take up several slots, and they are timed apart
+		// from plain links as they also optimize and generate code.
+		if (job->counted)
+			stats.compile_ns += job->duration * 1e9;
+		else if (job->threads)
+			stats.lto_ns += job->duration * 1e9;
+		else
+			stats.link_ns += job->duration * 1e9;
+
+		struct hist_rec rec =
+		{
+			.name = job->name,
+			.peak_rss = job->peak_rss,
+			.size = job->out_size,
+			.duration = job->duration,
+			.cpu_time = job->cpu_time,
+		};
+		hist_put(&plan->hist, &rec);
+		recs[nrecs++] = rec;
+	}
+
+	// the log keeps the latest builds, for comparing them with `--compare`.
+	hist_log_append(plan->log_file, cs->log_builds, &build_start, stats.build_ns / 1e9, success, recs, nrecs);
+	free(recs);
+	
+	hist_save(&plan->hist, plan->hist_file);
+
+	// the linker only ever adds to its cache.
+	for (size_t i = 0; i < cs->size; ++i)
+	{
+		if (cs->data[i].produce_output && graph.data[link_jobs[i]].measured)
+			link_prune_cache(&cs->data[i]);
+	}
+	
+	graph_destroy(&graph);
+	free(link_jobs);
+
+	// an instrumented build is only the first half of the build.
+	stats.total_ns = stats_now() - start;
+	if (success && plan->phase == PGO_GEN)
+		return saved ? BUILD_OK : BUILD_ERR_PROC;
+	
+	if (opts->stats)
+		stats_print(stdout);
+	
+	if (opts->stats_json)
+	{
+		FILE *fp = strcmp(opts->stats_json, "-") ? fopen(opts->stats_json, "w") : stdout;
+		if (fp)
+		{
+			stats_write_json(fp);
+			if (fp != stdout)
+				fclose(fp);
+		}
+		else
+			fprintf(stderr, "failed to write statistics: '%s'!\n", opts->stats_json);
+	}
+	
+	return !success ? BUILD_FAILED
+	       : !saved ? BUILD_ERR_PROC
+	       : !tests_ok ? BUILD_TESTS_FAILED
+	       : BUILD_OK;
+}
+
+static void
+rm_stale_tmps(struct conf_set const *cs)
+{
+	// temporaries are only left behind by builds which were killed outright.
+	// every job removes its own before it runs, and only those of outputs
+	// are removed up front, as they end up beside the outputs and not in
+	// `lib_dir`. walking `lib_dir` for others would cost as much as the
+	// objects in it, and could hit those of another build sharing it.
+	struct string out_tmp = string_create();
+	for (size_t i = 0; i < cs->size; ++i)
+	{
+		if (!cs->data[i].produce_output)
+			continue;
+
+		out_tmp.len = 0;
+		string_push_str(&out_tmp, cs->data[i].output);
+		string_push_buf(&out_tmp, ".tmp", 5);
+		unlink(out_tmp.str);
+	}
+	string_destroy(&out_tmp);
+}
+
+static bool
+link_only_ck(struct intern const *paths, struct id_list const *srcs,
+             struct id_list const *objs, struct bitset *out_up_to_date)
+{
+	// nothing is compiled, so every object has to have been gathered from
+	// the shards already.
+	for (size_t i = 0; i < srcs->size; ++i)
+	{
+		char const *obj = intern_str(paths, objs->data[i]);
+		if (access(obj, F_OK))
+		{
+			fprintf(stderr, "missing object for linking: '%s'!\n", obj);
+			return false;
+		}
+		
+		bitset_set(out_up_to_date, srcs->data[i]);
+	}
+
+	return true;
+}
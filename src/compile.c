@@ -2,45 +2,71 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sys/types.h>
 #include <unistd.h>
 
-#ifndef COMPILE_SINGLE_THREAD
-#include <pthread.h>
-#include <sys/sysinfo.h>
-#endif
+#include "rexec.h"
 
-struct thread_arg
+struct remote
 {
-	size_t start, cnt;
-	struct conf const *conf;
-	struct str_list const *srcs, *objs;
-	size_t *out_progress;
-	struct fmt_spec const *spec;
+	// `args` are those of the client shared by every job of a batch, already
+	// quoted for the shell.
+	struct fmt_tmpl pp_tmpl;
+	struct string args;
+	char *self;
 };
 
 struct fmt_data
 {
 	struct conf const *conf;
-	char const *src, *obj;
+	char const *cflags, *src, *obj;
+	struct fmt_tmpl const *tmpl;
+	char const *rsp, *mods;
+	struct remote const *remote;
+};
+
+// sources sharing the same flags share one template, and those with flags
+// of their own are few.
+struct batch
+{
+	char *cflags;
+	struct fmt_tmpl tmpl;
+	struct remote *remote;
 };
 
-extern bool flag_v;
+struct batches
+{
+	struct batch **data;
+	size_t size;
+	struct fmt_data *jobs;
+};
 
-static void *worker(void *vp_arg);
+static char *mk_cmd(void *vp_data);
+static char *mk_remote_cmd(struct fmt_data const *data);
+static struct remote *remote_create(struct conf const *conf, struct fmt_spec const *spec, struct fmt_data *inv_data);
+static struct batch *batch_create(struct conf const *conf, struct fmt_spec const *spec, char const *cflags);
+static struct batch *batch_find(struct batches *batches, struct conf const *conf, struct fmt_spec const *spec, char const *cflags);
+static void batch_destroy(struct batch *batch);
+static void batches_destroy(void *vp_batches);
 static void fmt_command(struct string *out_cmd, void *vp_data);
 static void fmt_cflags(struct string *out_cmd, void *vp_data);
 static void fmt_source(struct string *out_cmd, void *vp_data);
 static void fmt_object(struct string *out_cmd, void *vp_data);
+static void fmt_modules(struct string *out_cmd, void *vp_data);
 static void inc_fmt_include(struct string *out_cmd, void *vp_data);
 static void fmt_includes(struct string *out_cmd, void *vp_data);
+static void rsp_fmt_file(struct string *out_cmd, void *vp_data);
 
 void
-compile(struct conf const *conf, struct str_list const *srcs,
-        struct str_list const *objs)
+compile_schedule(struct graph *graph, struct conf const *conf,
+                 struct intern const *paths, struct id_list const *srcs,
+                 struct id_list const *objs, struct bitset const *up_to_date,
+                 char *const *mods, size_t *out_jobs)
 {
 	struct fmt_spec spec = fmt_spec_create();
 	fmt_spec_add_ent(&spec, 'c', fmt_command);
@@ -48,189 +74,379 @@ compile(struct conf const *conf, struct str_list const *srcs,
 	fmt_spec_add_ent(&spec, 's', fmt_source);
 	fmt_spec_add_ent(&spec, 'o', fmt_object);
 	fmt_spec_add_ent(&spec, 'i', fmt_includes);
-	
-#ifndef COMPILE_SINGLE_THREAD
-	// multithreaded pthread dependent code.
-	
-	ssize_t cnt = get_nprocs();
-	if (cnt < 1)
-	{
-		fputs("no CPU threads available for compilation!\n", stderr);
-		exit(1);
-	}
-	cnt = srcs->size < cnt ? srcs->size : cnt;
+	fmt_spec_add_ent(&spec, 'm', fmt_modules);
 
-	printf("compiling project with %zu worker(s)\n", cnt);
-	size_t progress = 0;
-	
-	struct thread_arg *th_args = malloc(sizeof(struct thread_arg) * cnt);
-	for (size_t i = 0; i < cnt; ++i)
+	struct batches *batches = malloc(sizeof(struct batches));
+	batches->data = malloc(sizeof(struct batch *));
+	batches->data[0] = batch_create(conf, &spec, conf->cflags);
+	batches->size = 1;
+	batches->jobs = malloc(sizeof(struct fmt_data) * (srcs->size + 1));
+	graph_own(graph, batches, batches_destroy);
+
+	for (size_t i = 0; i < srcs->size; ++i)
 	{
-		th_args[i] = (struct thread_arg)
+		if (out_jobs)
+			out_jobs[i] = SIZE_MAX;
+		if (bitset_test(up_to_date, srcs->data[i]))
+			continue;
+		
+		char const *src = intern_str(paths, srcs->data[i]);
+		char const *obj = intern_str(paths, objs->data[i]);
+
+		char *cflags = conf_src_cflags(conf, src);
+		struct batch *batch = cflags ? batch_find(batches, conf, &spec, cflags)
+		                      : batches->data[0];
+		free(cflags);
+
+		// the compiler writes next to the object, so that an interrupted
+		// compile never leaves behind an object which looks up to date.
+		char *obj_tmp = malloc(strlen(obj) + 5);
+		sprintf(obj_tmp, "%s.tmp", obj);
+		
+		batches->jobs[i] = (struct fmt_data)
 		{
 			.conf = conf,
-			.srcs = srcs,
-			.objs = objs,
-			.out_progress = &progress,
-			.spec = &spec,
+			.cflags = batch->cflags,
+			.src = src,
+			.obj = obj_tmp,
+			.tmpl = &batch->tmpl,
+			.rsp = NULL,
+			.mods = mods ? mods[i] : NULL,
+			.remote = batch->remote,
 		};
-	}
 
-	for (size_t i = 0; i < srcs->size; ++i)
-		++th_args[i % cnt].cnt;
+		// module interfaces are only ever found locally, so anything which
+		// has to do with them is never sent to a worker.
+		if (batches->jobs[i].mods)
+			batches->jobs[i].remote = NULL;
 
-	pthread_t *ths = malloc(sizeof(pthread_t) * cnt);
-	for (size_t i = 0; i < cnt; ++i)
-	{
-		struct thread_arg const *prev = i == 0 ? NULL : &th_args[i - 1];
-		th_args[i].start = i == 0 ? 0 : prev->start + prev->cnt;
-		if (pthread_create(&ths[i], NULL, worker, &th_args[i]))
+		char *err = malloc(strlen(src) + 34);
+		sprintf(err, "compilation failed on file: '%s'!", src);
+
+		struct job job =
 		{
-			fputs("failed to create worker thread for compilation!\n", stderr);
-			exit(1);
-		}
+			.mk_cmd = mk_cmd,
+			.ctx = &batches->jobs[i],
+			.name = strdup(obj),
+			.err = err,
+			.out = strdup(obj),
+			.out_tmp = obj_tmp,
+			.success_rc = conf->cc_success_rc,
+			.counted = true,
+		};
+		
+		size_t ind = graph_add(graph, &job);
+		if (out_jobs)
+			out_jobs[i] = ind;
 	}
 
-	for (size_t i = 0; i < cnt; ++i)
-		pthread_join(ths[i], NULL);
+	fmt_spec_destroy(&spec);
+}
 
-	free(ths);
-	free(th_args);
-#else
-	// singlethreaded pthread independent code.
-	
-	puts("compiling project in single thread mode");
-	size_t progress = 0;
-	
-	struct thread_arg th_arg =
+char *
+compile_fmt(struct conf const *conf, char const *fmt, char const *src,
+            char const *obj)
+{
+	struct fmt_spec spec = fmt_spec_create();
+	fmt_spec_add_ent(&spec, 'c', fmt_command);
+	fmt_spec_add_ent(&spec, 'f', fmt_cflags);
+	fmt_spec_add_ent(&spec, 's', fmt_source);
+	fmt_spec_add_ent(&spec, 'o', fmt_object);
+	fmt_spec_add_ent(&spec, 'i', fmt_includes);
+
+	char *cflags = conf_src_cflags(conf, src);
+	struct fmt_data data =
 	{
 		.conf = conf,
-		.srcs = srcs,
-		.objs = objs,
-		.out_progress = &progress,
-		.spec = &spec,
-		.start = 0,
-		.cnt = srcs->size,
+		.cflags = cflags ? cflags : conf->cflags,
+		.src = src,
+		.obj = obj,
+		.rsp = NULL,
+		.mods = NULL,
 	};
 	
-	worker(&th_arg);
-#endif
+	char *cmd = fmt_str(&spec, fmt, &data);
+	fmt_spec_destroy(&spec);
+	free(cflags);
+	return cmd;
+}
+
+char *
+compile_remote_cmd(struct conf const *conf, char const *cflags)
+{
+	// the worker compiles the preprocessed source under fixed names in its
+	// own directory, and a response file would not exist there.
+	struct fmt_spec spec = fmt_spec_create();
+	fmt_spec_add_ent(&spec, 'c', fmt_command);
+	fmt_spec_add_ent(&spec, 'f', fmt_cflags);
+	fmt_spec_add_ent(&spec, 's', fmt_source);
+	fmt_spec_add_ent(&spec, 'o', fmt_object);
+	fmt_spec_add_ent(&spec, 'i', fmt_includes);
+
+	struct fmt_data data =
+	{
+		.conf = conf,
+		.cflags = cflags,
+		.src = REXEC_IN_NAME,
+		.obj = REXEC_OUT_NAME,
+		.rsp = NULL,
+		.mods = NULL,
+	};
 	
+	char *cmd = fmt_str(&spec, conf->cc_remote_fmt, &data);
 	fmt_spec_destroy(&spec);
+	return cmd;
 }
 
-static void *
-worker(void *vp_arg)
+static char *
+mk_cmd(void *vp_data)
 {
-#ifndef COMPILE_SINGLE_THREAD
-	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-#endif
+	struct fmt_data const *data = vp_data;
 	
-	struct thread_arg *arg = vp_arg;
+	mkdir_recursive(data->obj);
+	rmdir(data->obj);
+
+	return data->remote ? mk_remote_cmd(data) : fmt_tmpl_str(data->tmpl, vp_data);
+}
 
-	for (size_t i = arg->start; i < arg->start + arg->cnt; ++i)
+static char *
+mk_remote_cmd(struct fmt_data const *data)
+{
+	// the job runs this program again as a client, which preprocesses next to
+	// the object and then hands the compile to one of the workers.
+	size_t obj_len = strlen(data->obj) - 4;
+	char *pp_out = malloc(obj_len + 8);
+	sprintf(pp_out, "%.*s.pp.tmp", (int)obj_len, data->obj);
+
+	struct fmt_data pp_data = *data;
+	pp_data.obj = pp_out;
+	char *pp_cmd = fmt_tmpl_str(&data->remote->pp_tmpl, &pp_data);
+	char *local_cmd = fmt_tmpl_str(data->tmpl, (void *)data);
+
+	struct string cmd = string_create();
+	shell_quote_inplace(&cmd, data->remote->self);
+	string_push_str(&cmd, " --rexec ");
+	string_push_buf(&cmd, data->remote->args.str, data->remote->args.len);
+	string_push_ch(&cmd, ' ');
+	shell_quote_inplace(&cmd, pp_cmd);
+	string_push_ch(&cmd, ' ');
+	shell_quote_inplace(&cmd, pp_out);
+	string_push_ch(&cmd, ' ');
+	shell_quote_inplace(&cmd, local_cmd);
+	string_push_ch(&cmd, ' ');
+	shell_quote_inplace(&cmd, data->obj);
+	string_push_ch(&cmd, 0);
+
+	free(local_cmd);
+	free(pp_cmd);
+	free(pp_out);
+	return cmd.str;
+}
+
+static struct remote *
+remote_create(struct conf const *conf, struct fmt_spec const *spec,
+              struct fmt_data *inv_data)
+{
+	// without the client to run on its behalf, a batch compiles locally.
+	char *self = realpath("/proc/self/exe", NULL);
+	if (!self)
 	{
-		char const *src = arg->srcs->data[i], *obj = arg->objs->data[i];
-		
-		struct fmt_data data =
-		{
-			.conf = arg->conf,
-			.src = src,
-			.obj = obj,
-		};
-		
-		mkdir_recursive(obj);
-		rmdir(obj);
+		fputs("cannot find own executable for remote compilation!\n", stderr);
+		return NULL;
+	}
 
-		char *cmd = fmt_str(arg->spec, arg->conf->cc_cmd_fmt, &data);
-		
-#ifndef COMPILE_SINGLE_THREAD
-		pthread_mutex_lock(&mutex);
-#endif
-		
-		++*arg->out_progress;
-		printf("(%zu/%zu)\t%s", *arg->out_progress, arg->srcs->size, obj);
-		if (flag_v)
-			printf("\t<- %s", cmd);
-		puts("");
-		
-#ifndef COMPILE_SINGLE_THREAD
-		pthread_mutex_unlock(&mutex);
-#endif
-		
-		int rc = system(cmd);
-		free(cmd);
-		
-		if (rc != arg->conf->cc_success_rc)
-		{
-			fprintf(stderr, "compilation failed on file: '%s'!\n", src);
-			exit(1);
-		}
+	struct remote *remote = malloc(sizeof(struct remote));
+	remote->pp_tmpl = fmt_tmpl_create(spec, conf->cc_pp_fmt);
+	fmt_tmpl_bake(&remote->pp_tmpl, "cfi", inv_data);
+	remote->self = self;
+
+	struct string hosts = string_create();
+	for (size_t i = 0; i < conf->remote.size; ++i)
+	{
+		if (i)
+			string_push_ch(&hosts, ',');
+		string_push_str(&hosts, conf->remote.data[i]);
+	}
+	string_push_ch(&hosts, 0);
+
+	// workers expand their own compile command for the target, so only the
+	// flags are sent along.
+	remote->args = string_create();
+	shell_quote_inplace(&remote->args, hosts.str);
+	string_push_ch(&remote->args, ' ');
+	shell_quote_inplace(&remote->args, conf->remote_secret_file);
+	string_push_ch(&remote->args, ' ');
+	shell_quote_inplace(&remote->args, conf->name ? conf->name : "");
+	string_push_ch(&remote->args, ' ');
+	shell_quote_inplace(&remote->args, inv_data->cflags);
+	string_destroy(&hosts);
+
+	return remote;
+}
+
+static struct batch *
+batch_create(struct conf const *conf, struct fmt_spec const *spec,
+             char const *cflags)
+{
+	// everything except the source and object is the same for every job of
+	// a batch, so it is expanded once up front.
+	struct fmt_data inv_data =
+	{
+		.conf = conf,
+		.cflags = cflags,
+		.rsp = NULL,
+	};
+	
+	struct batch *batch = malloc(sizeof(struct batch));
+	batch->cflags = strdup(cflags);
+	batch->tmpl = fmt_tmpl_create(spec, conf->cc_cmd_fmt);
+	fmt_tmpl_bake(&batch->tmpl, "cf", &inv_data);
+
+	// the include directories are the only part of a compile command which
+	// can grow without bound, so they go to a response file if too long.
+	struct string incs = string_create();
+	fmt_includes(&incs, &inv_data);
+	char *rsp = NULL;
+	if (conf->cc_rsp_fmt
+	    && batch->tmpl.lit_len + incs.len > conf->rsp_threshold)
+	{
+		string_push_ch(&incs, '\n');
+		// if it cannot be written, the directories are still passed directly.
+		rsp = malloc(strlen(conf->lib_dir) + 8);
+		sprintf(rsp, "%s/cc.rsp", conf->lib_dir);
+		if (write_file(rsp, incs.str, incs.len))
+			inv_data.rsp = rsp;
+	}
+	string_destroy(&incs);
+	
+	fmt_tmpl_bake(&batch->tmpl, "i", &inv_data);
+	batch->remote = conf->remote.size ? remote_create(conf, spec, &inv_data) : NULL;
+	free(rsp);
+
+	return batch;
+}
+
+static struct batch *
+batch_find(struct batches *batches, struct conf const *conf,
+           struct fmt_spec const *spec, char const *cflags)
+{
+	for (size_t i = 0; i < batches->size; ++i)
+	{
+		if (!strcmp(batches->data[i]->cflags, cflags))
+			return batches->data[i];
 	}
 
-	return NULL;
+	batches->data = realloc(batches->data, sizeof(struct batch *) * (batches->size + 1));
+	batches->data[batches->size] = batch_create(conf, spec, cflags);
+	return batches->data[batches->size++];
+}
+
+static void
+batch_destroy(struct batch *batch)
+{
+	if (batch->remote)
+	{
+		fmt_tmpl_destroy(&batch->remote->pp_tmpl);
+		string_destroy(&batch->remote->args);
+		free(batch->remote->self);
+		free(batch->remote);
+	}
+	
+	fmt_tmpl_destroy(&batch->tmpl);
+	free(batch->cflags);
+	free(batch);
+}
+
+static void
+batches_destroy(void *vp_batches)
+{
+	struct batches *batches = vp_batches;
+	for (size_t i = 0; i < batches->size; ++i)
+		batch_destroy(batches->data[i]);
+
+	free(batches->data);
+	free(batches->jobs);
+	free(batches);
 }
 
 static void
 fmt_command(struct string *out_cmd, void *vp_data)
 {
 	struct fmt_data const *data = vp_data;
-	char *cc = sanitize_path(data->conf->cc);
-	string_push_str(out_cmd, cc);
-	free(cc);
+	sanitize_path_inplace(out_cmd, data->conf->cc);
 }
 
 static void
 fmt_cflags(struct string *out_cmd, void *vp_data)
 {
 	struct fmt_data const *data = vp_data;
-	string_push_str(out_cmd, data->conf->cflags);
+	string_push_str(out_cmd, data->cflags);
+	if (data->conf->lto)
+	{
+		string_push_ch(out_cmd, ' ');
+		string_push_str(out_cmd, data->conf->cc_lto_fmt);
+	}
 }
 
 static void
 fmt_source(struct string *out_cmd, void *vp_data)
 {
 	struct fmt_data const *data = vp_data;
-	char *src = sanitize_path(data->src);
-	string_push_str(out_cmd, src);
-	free(src);
+	sanitize_path_inplace(out_cmd, data->src);
 }
 
 static void
 fmt_object(struct string *out_cmd, void *vp_data)
 {
 	struct fmt_data const *data = vp_data;
-	char *obj = sanitize_path(data->obj);
-	string_push_str(out_cmd, obj);
-	free(obj);
+	sanitize_path_inplace(out_cmd, data->obj);
+}
+
+static void
+fmt_modules(struct string *out_cmd, void *vp_data)
+{
+	struct fmt_data const *data = vp_data;
+	if (data->mods)
+		string_push_str(out_cmd, data->mods);
 }
 
 static void
 inc_fmt_include(struct string *out_cmd, void *vp_data)
 {
-	char *inc = sanitize_path(vp_data);
-	string_push_str(out_cmd, inc);
-	free(inc);
+	sanitize_path_inplace(out_cmd, vp_data);
 }
 
 static void
 fmt_includes(struct string *out_cmd, void *vp_data)
 {
 	struct fmt_data const *data = vp_data;
-	
-	struct str_list incs = str_list_copy(&data->conf->incs);
-	str_list_add(&incs, data->conf->inc_dir);
+	struct str_list const *incs = &data->conf->incs;
 
 	struct fmt_spec spec = fmt_spec_create();
+	if (data->rsp)
+	{
+		fmt_spec_add_ent(&spec, 'r', rsp_fmt_file);
+		fmt_inplace(out_cmd, &spec, data->conf->cc_rsp_fmt, (void *)data->rsp);
+		fmt_spec_destroy(&spec);
+		return;
+	}
+	
 	fmt_spec_add_ent(&spec, 'i', inc_fmt_include);
 	
-	for (size_t i = 0; i < incs.size; ++i)
+	// the project include directory always comes last.
+	for (size_t i = 0; i < incs->size; ++i)
 	{
-		fmt_inplace(out_cmd, &spec, data->conf->cc_inc_fmt, incs.data[i]);
-		if (i < incs.size - 1)
-			string_push_ch(out_cmd, ' ');
+		fmt_inplace(out_cmd, &spec, data->conf->cc_inc_fmt, incs->data[i]);
+		string_push_ch(out_cmd, ' ');
 	}
+	
+	fmt_inplace(out_cmd, &spec, data->conf->cc_inc_fmt, data->conf->inc_dir);
 
 	fmt_spec_destroy(&spec);
-	str_list_destroy(&incs);
+}
+
+static void
+rsp_fmt_file(struct string *out_cmd, void *vp_data)
+{
+	sanitize_path_inplace(out_cmd, vp_data);
 }
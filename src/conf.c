@@ -1,6 +1,7 @@
 #include "conf.h"
 
 #include <ctype.h>
+#include <fnmatch.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -10,59 +11,341 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-#define RAW_KEY_BUF_SIZE 64
-#define RAW_VAL_BUF_SIZE 1024
-#define SCAN_FMT "%63s = %1023[^\r\n]"
+#define KEY_GLOBAL 0x1
+#define KEY_TARGET 0x2
+#define KEY_PROFILE 0x4
+#define KEY_GENERATOR 0x8
+#define KEY_TEST 0x10
+#define KEY_FLAGS 0x20
 
-static ssize_t get_raw(FILE *fp, char const *key, char out_vbuf[]);
-static char *get_str(FILE *fp, char const *key);
-static struct str_list get_str_list(FILE *fp, char const *key);
-static bool get_bool(FILE *fp, char const *key);
-static int get_int(FILE *fp, char const *key);
+// `system()` passes the whole command to the shell as a single argument, which
+// Linux limits to 128 KiB, so stay well below that by default.
+#define DEFAULT_RSP_THRESHOLD 65536
 
-struct conf
-conf_from_file(char const *file)
+// without a configured memory budget, jobs may use this share of the memory
+// available when the build starts.
+#define DEFAULT_MEM_BUDGET_PERCENT 75
+
+// in MiB, enough for the incremental state of a few large links.
+#define DEFAULT_LTO_CACHE_SIZE 1024
+
+// enough to compare against builds from a while back without the log, and
+// reading it, growing without bound.
+#define DEFAULT_LOG_BUILDS 100
+
+struct tab_ent
+{
+	char *key, *val;
+	size_t line, sect;
+};
+
+struct tab_sect
+{
+	char *kind, *name;
+	size_t line;
+};
+
+struct tab
+{
+	struct tab_ent *data;
+	size_t size, cap;
+	struct str_map keys;
+
+	// section 0 is the global section, holding keys before any header.
+	struct tab_sect *sects;
+	size_t sects_size, sects_cap;
+
+	// index of the selected profile section, or 0 if none is selected.
+	size_t profile;
+
+	// set once a key was found missing or invalid, after which the lookups
+	// keep going with harmless values so that every error gets reported.
+	bool err;
+};
+
+struct known_key
+{
+	char const *key;
+	unsigned where;
+};
+
+static struct known_key const known_keys[] =
+{
+	{"cc", KEY_GLOBAL | KEY_TARGET | KEY_PROFILE},
+	{"ld", KEY_GLOBAL | KEY_TARGET | KEY_PROFILE},
+	{"cflags", KEY_GLOBAL | KEY_TARGET | KEY_PROFILE},
+	{"ldflags", KEY_GLOBAL | KEY_TARGET | KEY_PROFILE},
+	{"src_dir", KEY_GLOBAL | KEY_TARGET},
+	{"inc_dir", KEY_GLOBAL | KEY_TARGET},
+	{"lib_dir", KEY_GLOBAL},
+	{"produce_output", KEY_GLOBAL | KEY_TARGET},
+	{"output", KEY_GLOBAL | KEY_TARGET | KEY_PROFILE},
+	{"src_exts", KEY_GLOBAL | KEY_TARGET},
+	{"hdr_exts", KEY_GLOBAL | KEY_TARGET},
+	{"incs", KEY_GLOBAL | KEY_TARGET | KEY_PROFILE},
+	{"libs", KEY_GLOBAL | KEY_TARGET | KEY_PROFILE},
+	{"deps", KEY_TARGET},
+	{"cc_inc_fmt", KEY_GLOBAL | KEY_TARGET},
+	{"cc_cmd_fmt", KEY_GLOBAL | KEY_TARGET},
+	{"ld_lib_fmt", KEY_GLOBAL | KEY_TARGET},
+	{"ld_obj_fmt", KEY_GLOBAL | KEY_TARGET},
+	{"ld_cmd_fmt", KEY_GLOBAL | KEY_TARGET},
+	{"cc_success_rc", KEY_GLOBAL | KEY_TARGET},
+	{"ld_success_rc", KEY_GLOBAL | KEY_TARGET},
+	{"cc_rsp_fmt", KEY_GLOBAL | KEY_TARGET},
+	{"ld_rsp_fmt", KEY_GLOBAL | KEY_TARGET},
+	{"rsp_threshold", KEY_GLOBAL | KEY_TARGET},
+	{"remote", KEY_GLOBAL | KEY_TARGET | KEY_PROFILE},
+	{"cc_pp_fmt", KEY_GLOBAL | KEY_TARGET},
+	{"cc_remote_fmt", KEY_GLOBAL | KEY_TARGET},
+	{"remote_secret_file", KEY_GLOBAL | KEY_TARGET},
+	{"modules", KEY_GLOBAL | KEY_TARGET},
+	{"cc_p1689_fmt", KEY_GLOBAL | KEY_TARGET},
+	{"cc_bmi_out_fmt", KEY_GLOBAL | KEY_TARGET},
+	{"cc_bmi_in_fmt", KEY_GLOBAL | KEY_TARGET},
+	{"lto", KEY_GLOBAL | KEY_TARGET | KEY_PROFILE},
+	{"cc_lto_fmt", KEY_GLOBAL | KEY_TARGET},
+	{"ld_lto_fmt", KEY_GLOBAL | KEY_TARGET},
+	{"lto_cache_size", KEY_GLOBAL | KEY_TARGET},
+	{"mem_budget", KEY_GLOBAL},
+	{"log_builds", KEY_GLOBAL},
+	{"job_nice", KEY_GLOBAL},
+	{"job_affinity", KEY_GLOBAL},
+	{"pgo_gen_fmt", KEY_GLOBAL},
+	{"pgo_use_fmt", KEY_GLOBAL},
+	{"pgo_train_cmd", KEY_GLOBAL | KEY_PROFILE},
+	{"pgo_merge_cmd", KEY_GLOBAL},
+	{"pgo_exts", KEY_GLOBAL},
+	{"gen_inputs", KEY_GENERATOR},
+	{"gen_outputs", KEY_GENERATOR},
+	{"gen_deps", KEY_GENERATOR},
+	{"gen_cmd_fmt", KEY_GENERATOR},
+	{"gen_success_rc", KEY_GENERATOR},
+	{"test_cmd", KEY_TEST},
+	{"test_deps", KEY_TEST},
+	{"test_timeout", KEY_GLOBAL | KEY_TEST},
+	{"flags_match", KEY_FLAGS},
+	{"flags_targets", KEY_FLAGS},
+	{"flags_set", KEY_FLAGS},
+	{"flags_add", KEY_FLAGS},
+};
+
+static struct conf conf_from_tab(struct tab *tab, size_t sect, char const *lib_dir);
+static struct gen_conf gen_from_tab(struct tab *tab, size_t sect);
+static struct test_conf test_from_tab(struct tab *tab, size_t sect);
+static struct flag_rule rule_from_tab(struct tab *tab, size_t sect);
+static bool ck_targets(struct conf_set const *cs);
+static bool rule_matches(struct flag_rule const *rule, struct conf const *conf, char const *src);
+static void conf_set_add(struct conf_set *cs, struct conf const *conf);
+static bool tab_read(FILE *fp, struct tab *out_tab);
+static bool tab_add_sect(struct tab *tab, char *line, size_t line_num);
+static bool tab_ck_key(struct tab const *tab, char const *key, size_t line_num);
+static size_t tab_find_sect(struct tab const *tab, char const *kind, char const *name);
+static void tab_destroy(struct tab *tab);
+static struct tab_ent const *get_raw(struct tab const *tab, size_t sect, char const *key);
+static struct tab_ent const *get_req(struct tab *tab, size_t sect, char const *key, char const *type);
+static char *get_str(struct tab *tab, size_t sect, char const *key);
+static char *get_opt_str(struct tab const *tab, size_t sect, char const *key);
+static struct str_list get_str_list(struct tab *tab, size_t sect, char const *key);
+static bool get_bool(struct tab *tab, size_t sect, char const *key);
+static int get_int(struct tab *tab, size_t sect, char const *key);
+static struct str_list split_list(char const *val);
+
+bool
+conf_set_from_file(struct conf_set *out_cs, char const *file,
+                   char const *profile)
 {
 	FILE *fp = fopen(file, "rb");
 	if (!fp)
 	{
 		fprintf(stderr, "cannot open file: '%s'!\n", file);
-		exit(1);
+		return false;
 	}
 	
-	struct conf conf;
+	struct tab tab;
+	bool read = tab_read(fp, &tab);
+	fclose(fp);
+	if (!read)
+		return false;
 
-	// first, extract only mandatory information for compilation to objects.
-	conf.cc = get_str(fp, "cc");
-	conf.cflags = get_str(fp, "cflags");
-	conf.cc_cmd_fmt = get_str(fp, "cc_cmd_fmt");
-	conf.cc_inc_fmt = get_str(fp, "cc_inc_fmt");
-	conf.cc_success_rc = get_int(fp, "cc_success_rc");
-	conf.src_dir = get_str(fp, "src_dir");
-	conf.inc_dir = get_str(fp, "inc_dir");
-	conf.lib_dir = get_str(fp, "lib_dir");
-	conf.produce_output = get_bool(fp, "produce_output");
-	conf.src_exts = get_str_list(fp, "src_exts");
-	conf.hdr_exts = get_str_list(fp, "hdr_exts");
-	conf.incs = get_str_list(fp, "incs");
+	if (profile && !(tab.profile = tab_find_sect(&tab, "profile", profile)))
+	{
+		fprintf(stderr, "no such profile in configuration: '%s'!\n", profile);
+		tab_destroy(&tab);
+		return false;
+	}
 
-	// then, if output should be produced, get necessary information for
-	// linker to be run after compilation.
-	if (conf.produce_output)
+	struct conf_set cs =
+	{
+		.data = malloc(sizeof(struct conf)),
+		.size = 0,
+		.cap = 1,
+		.lib_dir = get_str(&tab, 0, "lib_dir"),
+		.mem_budget = mem_available() / 100 * DEFAULT_MEM_BUDGET_PERCENT,
+		.job_nice = 0,
+		.job_affinity = false,
+		.log_builds = DEFAULT_LOG_BUILDS,
+		.gens = NULL,
+		.ngens = 0,
+		.tests = NULL,
+		.ntests = 0,
+		.rules = NULL,
+		.nrules = 0,
+		.pgo_gen_fmt = get_opt_str(&tab, 0, "pgo_gen_fmt"),
+		.pgo_use_fmt = get_opt_str(&tab, 0, "pgo_use_fmt"),
+		.pgo_train_cmd = get_opt_str(&tab, 0, "pgo_train_cmd"),
+		.pgo_merge_cmd = get_opt_str(&tab, 0, "pgo_merge_cmd"),
+	};
+
+	struct tab_ent const *pgo_exts = get_raw(&tab, 0, "pgo_exts");
+	cs.pgo_exts = pgo_exts ? split_list(pgo_exts->val) : str_list_create();
+
+	// the budget is given in MiB, with 0 lifting the limit entirely.
+	if (get_raw(&tab, 0, "mem_budget"))
 	{
-		conf.ld = get_str(fp, "ld");
-		conf.ldflags = get_str(fp, "ldflags");
-		conf.ld_lib_fmt = get_str(fp, "ld_lib_fmt");
-		conf.ld_obj_fmt = get_str(fp, "ld_obj_fmt");
-		conf.ld_cmd_fmt = get_str(fp, "ld_cmd_fmt");
-		conf.ld_success_rc = get_int(fp, "ld_success_rc");
-		conf.output = get_str(fp, "output");
-		conf.libs = get_str_list(fp, "libs");
+		int budget = get_int(&tab, 0, "mem_budget");
+		cs.mem_budget = budget > 0 ? (size_t)budget * 1024 : 0;
 	}
 
-	fclose(fp);
+	if (get_raw(&tab, 0, "job_nice"))
+		cs.job_nice = get_int(&tab, 0, "job_nice");
+	if (get_raw(&tab, 0, "job_affinity"))
+		cs.job_affinity = get_bool(&tab, 0, "job_affinity");
+	if (get_raw(&tab, 0, "log_builds"))
+	{
+		int builds = get_int(&tab, 0, "log_builds");
+		cs.log_builds = builds > 0 ? builds : 0;
+	}
+
+	// every profile builds into its own object directory, so switching back
+	// and forth between profiles does not invalidate each other's objects.
+	char *obj_root = strdup(cs.lib_dir);
+	if (profile)
+	{
+		obj_root = realloc(obj_root, strlen(cs.lib_dir) + strlen(profile) + 2);
+		sprintf(obj_root, "%s/%s", cs.lib_dir, profile);
+	}
+
+	for (size_t i = 1; i < tab.sects_size; ++i)
+	{
+		if (strcmp(tab.sects[i].kind, "target"))
+			continue;
+
+		struct conf conf = conf_from_tab(&tab, i, obj_root);
+		conf_set_add(&cs, &conf);
+	}
+
+	// without any target sections, the global keys describe the one and only
+	// target, as they always have.
+	if (!cs.size)
+	{
+		struct conf conf = conf_from_tab(&tab, 0, obj_root);
+		conf_set_add(&cs, &conf);
+	}
+
+	free(obj_root);
+
+	for (size_t i = 1; i < tab.sects_size; ++i)
+	{
+		if (strcmp(tab.sects[i].kind, "generator"))
+			continue;
+
+		cs.gens = realloc(cs.gens, sizeof(struct gen_conf) * (cs.ngens + 1));
+		cs.gens[cs.ngens++] = gen_from_tab(&tab, i);
+	}
+
+	for (size_t i = 1; i < tab.sects_size; ++i)
+	{
+		if (strcmp(tab.sects[i].kind, "test"))
+			continue;
+
+		cs.tests = realloc(cs.tests, sizeof(struct test_conf) * (cs.ntests + 1));
+		cs.tests[cs.ntests++] = test_from_tab(&tab, i);
+	}
+
+	for (size_t i = 1; i < tab.sects_size; ++i)
+	{
+		if (strcmp(tab.sects[i].kind, "flags"))
+			continue;
+
+		cs.rules = realloc(cs.rules, sizeof(struct flag_rule) * (cs.nrules + 1));
+		cs.rules[cs.nrules++] = rule_from_tab(&tab, i);
+	}
+
+	for (size_t i = 0; i < cs.size; ++i)
+	{
+		cs.data[i].rules = cs.rules;
+		cs.data[i].nrules = cs.nrules;
+	}
 	
-	return conf;
+	bool ok = !tab.err && ck_targets(&cs);
+	tab_destroy(&tab);
+
+	if (!ok)
+	{
+		conf_set_destroy(&cs);
+		return false;
+	}
+
+	*out_cs = cs;
+	return true;
+}
+
+void
+conf_set_destroy(struct conf_set *cs)
+{
+	for (size_t i = 0; i < cs->size; ++i)
+		conf_destroy(&cs->data[i]);
+
+	for (size_t i = 0; i < cs->ngens; ++i)
+	{
+		free(cs->gens[i].name);
+		str_list_destroy(&cs->gens[i].inputs);
+		str_list_destroy(&cs->gens[i].outputs);
+		str_list_destroy(&cs->gens[i].deps);
+		free(cs->gens[i].cmd_fmt);
+	}
+
+	free(cs->gens);
+
+	for (size_t i = 0; i < cs->ntests; ++i)
+	{
+		free(cs->tests[i].name);
+		free(cs->tests[i].cmd);
+		str_list_destroy(&cs->tests[i].deps);
+	}
+
+	free(cs->tests);
+
+	for (size_t i = 0; i < cs->nrules; ++i)
+	{
+		free(cs->rules[i].name);
+		str_list_destroy(&cs->rules[i].match);
+		str_list_destroy(&cs->rules[i].targets);
+		free(cs->rules[i].set);
+		free(cs->rules[i].add);
+	}
+
+	free(cs->rules);
+	free(cs->pgo_gen_fmt);
+	free(cs->pgo_use_fmt);
+	free(cs->pgo_train_cmd);
+	free(cs->pgo_merge_cmd);
+	str_list_destroy(&cs->pgo_exts);
+	free(cs->data);
+	free(cs->lib_dir);
+}
+
+ssize_t
+conf_set_find(struct conf_set const *cs, char const *name)
+{
+	for (size_t i = 0; i < cs->size; ++i)
+	{
+		if (cs->data[i].name && !strcmp(cs->data[i].name, name))
+			return i;
+	}
+
+	return -1;
 }
 
 void
@@ -103,7 +386,7 @@ conf_apply_overrides(struct conf *conf)
 	}
 }
 
-void
+bool
 conf_validate(struct conf const *conf)
 {
 	struct stat s;
@@ -112,7 +395,7 @@ conf_validate(struct conf const *conf)
 	if (stat(conf->src_dir, &s))
 	{
 		fprintf(stderr, "no source directory: '%s'!\n", conf->src_dir);
-		exit(1);
+		return false;
 	}
 
 	if (stat(conf->inc_dir, &s))
@@ -131,19 +414,46 @@ conf_validate(struct conf const *conf)
 	if (stat(conf->cc, &s))
 	{
 		fprintf(stderr, "compiler not present on system: '%s'!\n", conf->cc);
-		exit(1);
+		return false;
 	}
 
 	if (conf->produce_output && stat(conf->ld, &s))
 	{
 		fprintf(stderr, "linker not present on system: '%s'!\n", conf->ld);
-		exit(1);
+		return false;
 	}
+
+	return true;
+}
+
+char *
+conf_src_cflags(struct conf const *conf, char const *src)
+{
+	// NULL if no rule applies, so that most sources keep sharing the flags
+	// of their target.
+	char *cflags = NULL;
+	for (size_t i = 0; i < conf->nrules; ++i)
+	{
+		struct flag_rule const *rule = &conf->rules[i];
+		if (!rule_matches(rule, conf, src))
+			continue;
+
+		char const *base = rule->set ? rule->set : cflags ? cflags : conf->cflags;
+		char const *add = rule->add ? rule->add : "";
+		char *new = malloc(strlen(base) + strlen(add) + 2);
+		sprintf(new, "%s%s%s", base, *add ? " " : "", add);
+		free(cflags);
+		cflags = new;
+	}
+
+	return cflags;
 }
 
 void
 conf_destroy(struct conf *conf)
 {
+	free(conf->name);
+	str_list_destroy(&conf->deps);
 	free(conf->cc);
 	free(conf->cflags);
 	free(conf->cc_cmd_fmt);
@@ -153,6 +463,17 @@ conf_destroy(struct conf *conf)
 	free(conf->lib_dir);
 	str_list_destroy(&conf->src_exts);
 	str_list_destroy(&conf->hdr_exts);
+	str_list_destroy(&conf->incs);
+	free(conf->cc_rsp_fmt);
+	str_list_destroy(&conf->remote);
+	free(conf->cc_pp_fmt);
+	free(conf->cc_remote_fmt);
+	free(conf->remote_secret_file);
+	free(conf->cc_p1689_fmt);
+	free(conf->cc_bmi_out_fmt);
+	free(conf->cc_bmi_in_fmt);
+	free(conf->cc_lto_fmt);
+	free(conf->ld_lto_fmt);
 
 	if (conf->produce_output)
 	{
@@ -162,137 +483,665 @@ conf_destroy(struct conf *conf)
 		free(conf->ld_obj_fmt);
 		free(conf->ld_cmd_fmt);
 		free(conf->output);
-		str_list_destroy(&conf->incs);
 		str_list_destroy(&conf->libs);
+		free(conf->ld_rsp_fmt);
 	}
 }
 
-static ssize_t
-get_raw(FILE *fp, char const *key, char out_vbuf[])
+static struct conf
+conf_from_tab(struct tab *tab, size_t sect, char const *lib_dir)
 {
-	fseek(fp, 0, SEEK_SET);
+	struct conf conf;
 
-	for (size_t line = 1; !feof(fp) && !ferror(fp); ++line)
+	// each target gets its own object directory so that linking a target
+	// only picks up its own objects.
+	if (sect)
 	{
-		int ch;
-		while ((ch = fgetc(fp)) != EOF && isspace(ch));
-		if (ch == '#')
-			while ((ch = fgetc(fp)) != EOF && ch != '\n');
-		if (ch == '\n' || feof(fp))
-			continue;
+		char const *name = tab->sects[sect].name;
+		conf.name = strdup(name);
+		conf.lib_dir = malloc(strlen(lib_dir) + strlen(name) + 2);
+		sprintf(conf.lib_dir, "%s/%s", lib_dir, name);
+		
+		struct tab_ent const *deps = get_raw(tab, sect, "deps");
+		conf.deps = deps ? split_list(deps->val) : str_list_create();
+	}
+	else
+	{
+		conf.name = NULL;
+		conf.lib_dir = strdup(lib_dir);
+		conf.deps = str_list_create();
+	}
+
+	// first, extract only mandatory information for compilation to objects.
+	conf.cc = get_str(tab, sect, "cc");
+	conf.cflags = get_str(tab, sect, "cflags");
+	conf.cc_cmd_fmt = get_str(tab, sect, "cc_cmd_fmt");
+	conf.cc_inc_fmt = get_str(tab, sect, "cc_inc_fmt");
+	conf.cc_success_rc = get_int(tab, sect, "cc_success_rc");
+	conf.src_dir = get_str(tab, sect, "src_dir");
+	conf.inc_dir = get_str(tab, sect, "inc_dir");
+	conf.produce_output = get_bool(tab, sect, "produce_output");
+	conf.src_exts = get_str_list(tab, sect, "src_exts");
+	conf.hdr_exts = get_str_list(tab, sect, "hdr_exts");
+	conf.incs = get_str_list(tab, sect, "incs");
+
+	// response files are optional, and only used by toolchains which are
+	// told how to pass them.
+	conf.cc_rsp_fmt = get_opt_str(tab, sect, "cc_rsp_fmt");
+	conf.ld_rsp_fmt = NULL;
+	if (get_raw(tab, sect, "rsp_threshold"))
+	{
+		int threshold = get_int(tab, sect, "rsp_threshold");
+		conf.rsp_threshold = threshold > 0 ? threshold : 0;
+	}
+	else
+		conf.rsp_threshold = DEFAULT_RSP_THRESHOLD;
 
-		fseek(fp, -1, SEEK_CUR);
-		char kbuf[RAW_KEY_BUF_SIZE];
-		if (fscanf(fp, SCAN_FMT, kbuf, out_vbuf) != 2)
+	// compiles are only sent to workers if the toolchain is told how to split
+	// them into a local preprocess and a remote compile. workers read the
+	// same keys without sending anything themselves.
+	struct tab_ent const *remote = get_raw(tab, sect, "remote");
+	conf.remote = remote ? split_list(remote->val) : str_list_create();
+	conf.cc_pp_fmt = NULL;
+	conf.cc_remote_fmt = get_opt_str(tab, sect, "cc_remote_fmt");
+	conf.remote_secret_file = get_opt_str(tab, sect, "remote_secret_file");
+	if (conf.remote.size)
+	{
+		conf.cc_pp_fmt = get_str(tab, sect, "cc_pp_fmt");
+		if (!conf.cc_remote_fmt || !conf.remote_secret_file)
 		{
-			fprintf(stderr, "error on line %zu of configuration!\n", line);
-			exit(1);
+			fputs("remote compilation needs cc_remote_fmt and remote_secret_file!\n", stderr);
+			tab->err = true;
 		}
+	}
 
-		if (!strcmp(out_vbuf, "NONE"))
-			out_vbuf[0] = 0;
+	// sources are only scanned for modules when asked to, and then by the
+	// compiler if it can tell.
+	conf.modules = get_raw(tab, sect, "modules") && get_bool(tab, sect, "modules");
+	conf.cc_p1689_fmt = get_opt_str(tab, sect, "cc_p1689_fmt");
+	conf.cc_bmi_out_fmt = get_opt_str(tab, sect, "cc_bmi_out_fmt");
+	conf.cc_bmi_in_fmt = get_opt_str(tab, sect, "cc_bmi_in_fmt");
 
-		if (!strncmp(kbuf, key, RAW_KEY_BUF_SIZE))
-			return line;
+	// link-time optimization is switched on like any other option, e.g. by a
+	// release profile, and then needs to know how to tell the toolchain.
+	conf.lto = get_raw(tab, sect, "lto") && get_bool(tab, sect, "lto");
+	conf.cc_lto_fmt = conf.lto ? get_str(tab, sect, "cc_lto_fmt") : NULL;
+	conf.ld_lto_fmt = NULL;
+	if (get_raw(tab, sect, "lto_cache_size"))
+	{
+		int size = get_int(tab, sect, "lto_cache_size");
+		conf.lto_cache_size = size > 0 ? size : 0;
 	}
+	else
+		conf.lto_cache_size = DEFAULT_LTO_CACHE_SIZE;
+	conf.rules = NULL;
+	conf.nrules = 0;
 
-	return -1;
+	// then, if output should be produced, get necessary information for
+	// linker to be run after compilation.
+	if (conf.produce_output)
+	{
+		conf.ld = get_str(tab, sect, "ld");
+		conf.ldflags = get_str(tab, sect, "ldflags");
+		conf.ld_lib_fmt = get_str(tab, sect, "ld_lib_fmt");
+		conf.ld_obj_fmt = get_str(tab, sect, "ld_obj_fmt");
+		conf.ld_cmd_fmt = get_str(tab, sect, "ld_cmd_fmt");
+		conf.ld_success_rc = get_int(tab, sect, "ld_success_rc");
+		conf.output = get_str(tab, sect, "output");
+		conf.libs = get_str_list(tab, sect, "libs");
+		conf.ld_rsp_fmt = get_opt_str(tab, sect, "ld_rsp_fmt");
+		if (conf.lto)
+			conf.ld_lto_fmt = get_str(tab, sect, "ld_lto_fmt");
+	}
+
+	return conf;
 }
 
-static char *
-get_str(FILE *fp, char const *key)
+static struct gen_conf
+gen_from_tab(struct tab *tab, size_t sect)
 {
-	char vbuf[RAW_VAL_BUF_SIZE];
-	if (get_raw(fp, key, vbuf) == -1)
+	struct tab_ent const *deps = get_raw(tab, sect, "gen_deps");
+	
+	struct gen_conf gen =
 	{
-		fprintf(stderr, "missing string key in configuration: '%s'!\n", key);
-		exit(1);
+		.name = strdup(tab->sects[sect].name),
+		.inputs = get_str_list(tab, sect, "gen_inputs"),
+		.outputs = get_str_list(tab, sect, "gen_outputs"),
+		.deps = deps ? split_list(deps->val) : str_list_create(),
+		.cmd_fmt = get_str(tab, sect, "gen_cmd_fmt"),
+		.success_rc = 0,
+	};
+
+	if (get_raw(tab, sect, "gen_success_rc"))
+		gen.success_rc = get_int(tab, sect, "gen_success_rc");
+	
+	// a missing key has been reported already.
+	if (!gen.outputs.size && get_raw(tab, sect, "gen_outputs"))
+	{
+		fprintf(stderr, "generator has no outputs: '%s'!\n", gen.name);
+		tab->err = true;
 	}
 
-	return strndup(vbuf, RAW_VAL_BUF_SIZE);
+	return gen;
 }
 
-static struct str_list
-get_str_list(FILE *fp, char const *key)
+static struct test_conf
+test_from_tab(struct tab *tab, size_t sect)
 {
-	char vbuf[RAW_VAL_BUF_SIZE];
-	if (get_raw(fp, key, vbuf) == -1)
+	struct tab_ent const *deps = get_raw(tab, sect, "test_deps");
+	
+	struct test_conf test =
+	{
+		.name = strdup(tab->sects[sect].name),
+		.cmd = get_str(tab, sect, "test_cmd"),
+		.deps = deps ? split_list(deps->val) : str_list_create(),
+		.timeout = 0,
+	};
+
+	if (get_raw(tab, sect, "test_timeout"))
 	{
-		fprintf(stderr, "missing stringlist key in configuration: '%s'!\n", key);
-		exit(1);
+		int timeout = get_int(tab, sect, "test_timeout");
+		test.timeout = timeout > 0 ? timeout : 0;
 	}
 
-	struct str_list sl = str_list_create();
-	char accum[RAW_VAL_BUF_SIZE];
-	size_t vbuflen = strlen(vbuf), accumlen = 0;
-	for (size_t i = 0; i < vbuflen; ++i)
+	return test;
+}
+
+static struct flag_rule
+rule_from_tab(struct tab *tab, size_t sect)
+{
+	struct tab_ent const *targets = get_raw(tab, sect, "flags_targets");
+	
+	struct flag_rule rule =
+	{
+		.name = strdup(tab->sects[sect].name),
+		.match = get_str_list(tab, sect, "flags_match"),
+		.targets = targets ? split_list(targets->val) : str_list_create(),
+		.set = get_opt_str(tab, sect, "flags_set"),
+		.add = get_opt_str(tab, sect, "flags_add"),
+	};
+
+	if (!rule.set && !rule.add)
+	{
+		fprintf(stderr, "flags change nothing: '%s'!\n", rule.name);
+		tab->err = true;
+	}
+
+	return rule;
+}
+
+static bool
+ck_targets(struct conf_set const *cs)
+{
+	bool ok = true;
+	for (size_t i = 0; i < cs->size; ++i)
+	{
+		struct conf const *conf = &cs->data[i];
+		for (size_t j = 0; j < conf->deps.size; ++j)
+		{
+			if (conf_set_find(cs, conf->deps.data[j]) == -1)
+			{
+				fprintf(stderr, "target '%s' depends on unknown target: '%s'!\n",
+				        conf->name, conf->deps.data[j]);
+				ok = false;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < cs->ntests; ++i)
+	{
+		struct test_conf const *test = &cs->tests[i];
+		for (size_t j = 0; j < test->deps.size; ++j)
+		{
+			if (conf_set_find(cs, test->deps.data[j]) == -1)
+			{
+				fprintf(stderr, "test '%s' depends on unknown target: '%s'!\n",
+				        test->name, test->deps.data[j]);
+				ok = false;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < cs->nrules; ++i)
+	{
+		struct flag_rule const *rule = &cs->rules[i];
+		for (size_t j = 0; j < rule->targets.size; ++j)
+		{
+			if (conf_set_find(cs, rule->targets.data[j]) == -1)
+			{
+				fprintf(stderr, "flags '%s' apply to unknown target: '%s'!\n",
+				        rule->name, rule->targets.data[j]);
+				ok = false;
+			}
+		}
+	}
+
+	return ok;
+}
+
+static bool
+rule_matches(struct flag_rule const *rule, struct conf const *conf,
+             char const *src)
+{
+	if (rule->targets.size
+	    && (!conf->name || !str_list_contains(&rule->targets, conf->name)))
 	{
-		if (vbuf[i] == '\\')
+		return false;
+	}
+
+	for (size_t i = 0; i < rule->match.size; ++i)
+	{
+		char const *pat = rule->match.data[i];
+		size_t len = strlen(pat);
+		if (len && pat[len - 1] == '/' ? !strncmp(src, pat, len)
+		    : !fnmatch(pat, src, 0))
 		{
-			accum[accumlen++] = vbuf[++i];
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void
+conf_set_add(struct conf_set *cs, struct conf const *conf)
+{
+	if (cs->size >= cs->cap)
+	{
+		cs->cap *= 2;
+		cs->data = realloc(cs->data, sizeof(struct conf) * cs->cap);
+	}
+
+	cs->data[cs->size++] = *conf;
+}
+
+static bool
+tab_read(FILE *fp, struct tab *out_tab)
+{
+	struct tab tab =
+	{
+		.data = malloc(sizeof(struct tab_ent)),
+		.size = 0,
+		.cap = 1,
+		.keys = str_map_create(),
+		.sects = malloc(sizeof(struct tab_sect)),
+		.sects_size = 1,
+		.sects_cap = 1,
+		.profile = 0,
+		.err = false,
+	};
+
+	tab.sects[0] = (struct tab_sect)
+	{
+		.kind = strdup(""),
+		.name = strdup(""),
+		.line = 0,
+	};
+
+	char *line = NULL;
+	size_t line_cap = 0;
+	bool ok = true;
+	for (size_t line_num = 1; ok && getline(&line, &line_cap, fp) != -1; ++line_num)
+	{
+		char *c = line;
+		while (isspace(*c))
+			++c;
+		if (!*c || *c == '#')
+			continue;
+
+		if (*c == '[')
+		{
+			ok = tab_add_sect(&tab, c, line_num);
 			continue;
 		}
-		else if (isspace(vbuf[i]) && accumlen > 0)
+
+		char *key = c;
+		while (*c && !isspace(*c) && *c != '=')
+			++c;
+		size_t key_len = c - key;
+		
+		while (isspace(*c))
+			++c;
+		if (*c != '=' || key_len == 0)
 		{
-			accum[accumlen] = 0;
-			accumlen = 0;
-			str_list_add(&sl, accum);
+			fprintf(stderr, "error on line %zu of configuration!\n", line_num);
+			ok = false;
+			continue;
 		}
-		else
-			accum[accumlen++] = vbuf[i];
+		
+		++c;
+		while (isspace(*c))
+			++c;
+		
+		char *val = c;
+		char *val_end = val + strlen(val);
+		while (val_end > val && isspace(val_end[-1]))
+			--val_end;
+
+		key[key_len] = 0;
+		*val_end = 0;
+		if (!strcmp(val, "NONE"))
+			*val = 0;
+
+		if (!tab_ck_key(&tab, key, line_num))
+		{
+			ok = false;
+			continue;
+		}
+
+		size_t sect = tab.sects_size - 1;
+		char *map_key = malloc(strlen(key) + 24);
+		sprintf(map_key, "%zu %s", sect, key);
+
+		size_t prev;
+		if (str_map_get(&tab.keys, map_key, &prev))
+		{
+			fprintf(stderr, "duplicate key on line %zu of configuration: '%s' "
+			        "(first set on line %zu)!\n", line_num, key,
+			        tab.data[prev].line);
+			free(map_key);
+			ok = false;
+			continue;
+		}
+
+		if (tab.size >= tab.cap)
+		{
+			tab.cap *= 2;
+			tab.data = realloc(tab.data, sizeof(struct tab_ent) * tab.cap);
+		}
+
+		str_map_put(&tab.keys, map_key, tab.size);
+		free(map_key);
+		
+		tab.data[tab.size++] = (struct tab_ent)
+		{
+			.key = strdup(key),
+			.val = strdup(val),
+			.line = line_num,
+			.sect = sect,
+		};
 	}
 
-	// last item in strlist won't get pushed unless followed by trailing
-	// whitespace.
-	// fix for this behavior.
-	if (accumlen > 0)
+	free(line);
+	
+	if (ok && ferror(fp))
 	{
-		accum[accumlen] = 0;
-		str_list_add(&sl, accum);
+		fputs("failed to read configuration!\n", stderr);
+		ok = false;
 	}
 
-	return sl;
+	if (!ok)
+	{
+		tab_destroy(&tab);
+		return false;
+	}
+
+	*out_tab = tab;
+	return true;
+}
+
+static bool
+tab_add_sect(struct tab *tab, char *line, size_t line_num)
+{
+	// section headers take the form `[kind name]`.
+	char *end = strchr(line, ']');
+	char *trail = end ? end + 1 : NULL;
+	while (trail && isspace(*trail))
+		++trail;
+	
+	if (!end || (*trail && *trail != '#'))
+	{
+		fprintf(stderr, "error on line %zu of configuration!\n", line_num);
+		return false;
+	}
+	*end = 0;
+
+	char *kind = strtok(line + 1, " \t");
+	char *name = kind ? strtok(NULL, " \t") : NULL;
+	if (!name || strtok(NULL, " \t"))
+	{
+		fprintf(stderr, "error on line %zu of configuration!\n", line_num);
+		return false;
+	}
+
+	if (strcmp(kind, "target") && strcmp(kind, "profile")
+	    && strcmp(kind, "generator") && strcmp(kind, "test")
+	    && strcmp(kind, "flags"))
+	{
+		fprintf(stderr, "unknown section kind on line %zu of configuration: "
+		        "'%s'!\n", line_num, kind);
+		return false;
+	}
+
+	if (strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, ".."))
+	{
+		fprintf(stderr, "invalid %s name on line %zu of configuration: "
+		        "'%s'!\n", kind, line_num, name);
+		return false;
+	}
+
+	size_t prev = tab_find_sect(tab, kind, name);
+	if (prev)
+	{
+		fprintf(stderr, "duplicate section on line %zu of configuration: "
+		        "'%s %s' (first declared on line %zu)!\n", line_num, kind, name,
+		        tab->sects[prev].line);
+		return false;
+	}
+
+	if (tab->sects_size >= tab->sects_cap)
+	{
+		tab->sects_cap *= 2;
+		tab->sects = realloc(tab->sects, sizeof(struct tab_sect) * tab->sects_cap);
+	}
+
+	tab->sects[tab->sects_size++] = (struct tab_sect)
+	{
+		.kind = strdup(kind),
+		.name = strdup(name),
+		.line = line_num,
+	};
+
+	return true;
 }
 
 static bool
-get_bool(FILE *fp, char const *key)
+tab_ck_key(struct tab const *tab, char const *key, size_t line_num)
+{
+	char const *kind = tab->sects[tab->sects_size - 1].kind;
+	unsigned where = !*kind ? KEY_GLOBAL
+	                 : !strcmp(kind, "target") ? KEY_TARGET
+	                 : !strcmp(kind, "generator") ? KEY_GENERATOR
+	                 : !strcmp(kind, "test") ? KEY_TEST
+	                 : !strcmp(kind, "flags") ? KEY_FLAGS
+	                 : KEY_PROFILE;
+	
+	for (size_t i = 0; i < sizeof(known_keys) / sizeof(known_keys[0]); ++i)
+	{
+		if (strcmp(key, known_keys[i].key))
+			continue;
+
+		if (known_keys[i].where & where)
+			return true;
+
+		fprintf(stderr, "key not allowed in this section on line %zu of "
+		        "configuration: '%s'!\n", line_num, key);
+		return false;
+	}
+
+	fprintf(stderr, "unknown key on line %zu of configuration: '%s'!\n",
+	        line_num, key);
+	return false;
+}
+
+static size_t
+tab_find_sect(struct tab const *tab, char const *kind, char const *name)
+{
+	for (size_t i = 1; i < tab->sects_size; ++i)
+	{
+		if (!strcmp(tab->sects[i].kind, kind)
+		    && !strcmp(tab->sects[i].name, name))
+		{
+			return i;
+		}
+	}
+
+	return 0;
+}
+
+static void
+tab_destroy(struct tab *tab)
+{
+	for (size_t i = 0; i < tab->size; ++i)
+	{
+		free(tab->data[i].key);
+		free(tab->data[i].val);
+	}
+
+	for (size_t i = 0; i < tab->sects_size; ++i)
+	{
+		free(tab->sects[i].kind);
+		free(tab->sects[i].name);
+	}
+
+	free(tab->data);
+	free(tab->sects);
+	str_map_destroy(&tab->keys);
+}
+
+static struct tab_ent const *
+get_raw(struct tab const *tab, size_t sect, char const *key)
+{
+	// keys missing from a section fall back to the selected profile, and
+	// then to the global section.
+	size_t const chain[] = {sect, tab->profile, 0};
+	char *map_key = malloc(strlen(key) + 24);
+	
+	size_t ind;
+	bool found = false;
+	for (size_t i = 0; i < sizeof(chain) / sizeof(chain[0]) && !found; ++i)
+	{
+		sprintf(map_key, "%zu %s", chain[i], key);
+		found = str_map_get(&tab->keys, map_key, &ind);
+	}
+
+	free(map_key);
+	return found ? &tab->data[ind] : NULL;
+}
+
+static struct tab_ent const *
+get_req(struct tab *tab, size_t sect, char const *key, char const *type)
 {
-	char vbuf[RAW_VAL_BUF_SIZE];
-	if (get_raw(fp, key, vbuf) == -1)
+	struct tab_ent const *ent = get_raw(tab, sect, key);
+	if (ent)
+		return ent;
+
+	if (sect)
 	{
-		fprintf(stderr, "missing bool key in configuration: '%s'!\n", key);
-		exit(1);
+		fprintf(stderr, "missing %s key in configuration for %s '%s': "
+		        "'%s'!\n", type, tab->sects[sect].kind, tab->sects[sect].name,
+		        key);
 	}
+	else
+		fprintf(stderr, "missing %s key in configuration: '%s'!\n", type, key);
+	
+	tab->err = true;
+	return NULL;
+}
+
+static char *
+get_str(struct tab *tab, size_t sect, char const *key)
+{
+	struct tab_ent const *ent = get_req(tab, sect, key, "string");
+	return strdup(ent ? ent->val : "");
+}
+
+static char *
+get_opt_str(struct tab const *tab, size_t sect, char const *key)
+{
+	struct tab_ent const *ent = get_raw(tab, sect, key);
+	return ent && *ent->val ? strdup(ent->val) : NULL;
+}
+
+static struct str_list
+get_str_list(struct tab *tab, size_t sect, char const *key)
+{
+	struct tab_ent const *ent = get_req(tab, sect, key, "stringlist");
+	return split_list(ent ? ent->val : "");
+}
+
+static bool
+get_bool(struct tab *tab, size_t sect, char const *key)
+{
+	struct tab_ent const *ent = get_req(tab, sect, key, "bool");
 
-	if (!strcmp("true", vbuf))
+	if (!ent)
+		return false;
+	else if (!strcmp("true", ent->val))
 		return true;
-	else if (!strcmp("false", vbuf))
+	else if (!strcmp("false", ent->val))
 		return false;
 	else
 	{
-		fprintf(stderr, "invalid bool value for %s: '%s'!\n", key, vbuf);
-		exit(1);
+		fprintf(stderr, "invalid bool value for %s on line %zu: '%s'!\n", key,
+		        ent->line, ent->val);
+		tab->err = true;
+		return false;
 	}
 }
 
 static int
-get_int(FILE *fp, char const *key)
+get_int(struct tab *tab, size_t sect, char const *key)
 {
-	char vbuf[RAW_VAL_BUF_SIZE];
-	if (get_raw(fp, key, vbuf) == -1)
+	struct tab_ent const *ent = get_req(tab, sect, key, "int");
+	if (!ent)
+		return 0;
+
+	for (char const *c = ent->val; *c; ++c)
 	{
-		fprintf(stderr, "missing int key in configuration: '%s'!\n", key);
-		exit(1);
+		if (!strchr("0123456789-", *c))
+		{
+			fprintf(stderr, "invalid int value for %s on line %zu: '%s'!\n",
+			        key, ent->line, ent->val);
+			tab->err = true;
+			return 0;
+		}
 	}
 
-	for (char const *c = vbuf; *c; ++c)
+	return atoi(ent->val);
+}
+
+static struct str_list
+split_list(char const *val)
+{
+	struct str_list sl = str_list_create();
+	struct string accum = string_create();
+	for (char const *c = val; *c; ++c)
 	{
-		if (!strchr("0123456789-", *c))
+		if (*c == '\\' && c[1])
+			string_push_ch(&accum, *++c);
+		else if (isspace(*c))
 		{
-			fprintf(stderr, "invalid int value for %s: '%s'!\n", key, vbuf);
-			exit(1);
+			if (accum.len > 0)
+			{
+				string_push_ch(&accum, 0);
+				str_list_add(&sl, accum.str);
+				accum.len = 0;
+			}
 		}
+		else
+			string_push_ch(&accum, *c);
+	}
+
+	// last item in strlist won't get pushed unless followed by trailing
+	// whitespace.
+	// fix for this behavior.
+	if (accum.len > 0)
+	{
+		string_push_ch(&accum, 0);
+		str_list_add(&sl, accum.str);
 	}
 
-	return atoi(vbuf);
+	string_destroy(&accum);
+	return sl;
 }
@@ -0,0 +1,112 @@
+#include "flagsig.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+static size_t src_sig(struct conf const *conf, char const *src);
+
+struct str_map
+flagsig_load(char const *file)
+{
+	// the flags each object was last compiled with if flag rules applied to
+	// it, one line per object of the form `<sig> <object>`.
+	struct str_map sigs = str_map_create();
+	FILE *fp = fopen(file, "rb");
+	if (!fp)
+		return sigs;
+
+	char *line = NULL;
+	size_t line_cap = 0;
+	while (getline(&line, &line_cap, fp) > 0)
+	{
+		size_t sig;
+		int obj_off;
+		if (sscanf(line, "%zx %n", &sig, &obj_off) != 1)
+			continue;
+		
+		line[strcspn(line, "\n")] = 0;
+		str_map_put(&sigs, line + obj_off, sig);
+	}
+
+	free(line);
+	fclose(fp);
+	return sigs;
+}
+
+void
+flagsig_invalidate(struct str_map const *sigs, struct conf const *conf,
+                   struct intern const *paths, struct id_list const *srcs,
+                   struct id_list const *objs, struct bitset *up_to_date)
+{
+	// an object is out of date once a rule which applies to it changed, or
+	// once a rule starts or stops applying to it. the rest are left alone.
+	if (!conf->nrules && !sigs->size)
+		return;
+
+	for (size_t i = 0; i < srcs->size; ++i)
+	{
+		if (!bitset_test(up_to_date, srcs->data[i]))
+			continue;
+
+		size_t old_sig;
+		if (!str_map_get(sigs, intern_str(paths, objs->data[i]), &old_sig))
+			old_sig = 0;
+
+		if (src_sig(conf, intern_str(paths, srcs->data[i])) != old_sig)
+			bitset_clr(up_to_date, srcs->data[i]);
+	}
+}
+
+void
+flagsig_put(struct str_map *sigs, struct conf const *conf, char const *src,
+            char const *obj)
+{
+	size_t sig = src_sig(conf, src), old_sig;
+	if (sig || str_map_get(sigs, obj, &old_sig))
+		str_map_put(sigs, obj, sig);
+}
+
+bool
+flagsig_save(struct str_map const *sigs, char const *file)
+{
+	if (!sigs->size)
+	{
+		unlink(file);
+		return true;
+	}
+
+	struct string buf = string_create();
+	char line[24];
+	for (size_t i = 0; i < sigs->cap; ++i)
+	{
+		struct str_map_ent const *ent = &sigs->data[i];
+		if (!ent->key || !ent->val || access(ent->key, F_OK))
+			continue;
+
+		sprintf(line, "%016zx ", ent->val);
+		string_push_str(&buf, line);
+		string_push_str(&buf, ent->key);
+		string_push_ch(&buf, '\n');
+	}
+
+	mkdir_recursive(file);
+	bool ok = write_file(file, buf.str, buf.len);
+	string_destroy(&buf);
+	return ok;
+}
+
+static size_t
+src_sig(struct conf const *conf, char const *src)
+{
+	// 0 for sources compiled with the flags of their target.
+	char *cflags = conf_src_cflags(conf, src);
+	size_t sig = cflags ? str_hash(cflags) : 0;
+	free(cflags);
+
+	return sig;
+}
@@ -0,0 +1,462 @@
+#include "gen.h"
+
+#include <fnmatch.h>
+#include <glob.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "graph.h"
+
+#define SIG_FILE "mincbuild.gen"
+
+struct item
+{
+	char *input, *stem;
+	struct str_list outputs;
+	struct gen_conf const *gen;
+	size_t hash, job;
+	bool stale;
+};
+
+// what the previous build generated, one line per input of the form
+// `<hash> <input>\t<output>\t...`.
+struct sigs
+{
+	struct str_map ids, written;
+	size_t *hashes;
+	struct str_list *outputs;
+	size_t size;
+};
+
+struct items
+{
+	struct item *data;
+	size_t size, cap;
+	struct str_map outputs;
+};
+
+static bool expand(struct items *items, struct gen_conf const *gen, struct sigs const *sigs);
+static bool add_item(struct items *items, struct gen_conf const *gen, char const *input);
+static bool ck_stale(struct items const *items, struct item const *item, struct sigs const *sigs, time_t deps_mt);
+static struct sigs sigs_load(char const *file);
+static bool sigs_save(struct items const *items, struct graph const *graph, char const *file);
+static void sigs_destroy(struct sigs *sigs);
+static char *fmt_cmd(struct item const *item);
+static void fmt_input(struct string *out_cmd, void *vp_item);
+static void fmt_outputs(struct string *out_cmd, void *vp_item);
+static void fmt_stem(struct string *out_cmd, void *vp_item);
+static char *mk_cmd(void *vp_item);
+
+bool
+gen_run(struct conf_set const *cs, bool force, struct graph_opts const *opts)
+{
+	if (!cs->ngens)
+		return true;
+
+	struct items items =
+	{
+		.data = NULL,
+		.size = 0,
+		.cap = 0,
+		.outputs = str_map_create(),
+	};
+
+	char *sig_file = malloc(strlen(cs->lib_dir) + strlen(SIG_FILE) + 2);
+	sprintf(sig_file, "%s/%s", cs->lib_dir, SIG_FILE);
+	struct sigs sigs = sigs_load(sig_file);
+	
+	bool ok = true;
+	for (size_t i = 0; i < cs->ngens && ok; ++i)
+		ok = expand(&items, &cs->gens[i], &sigs);
+
+	// outputs of inputs which are gone would otherwise still be picked up as
+	// sources.
+	for (size_t i = 0; i < sigs.size && ok; ++i)
+	{
+		for (size_t j = 0; j < sigs.outputs[i].size; ++j)
+		{
+			size_t item;
+			if (!str_map_get(&items.outputs, sigs.outputs[i].data[j], &item))
+				unlink(sigs.outputs[i].data[j]);
+		}
+	}
+
+	// generators may take the outputs of earlier ones as inputs, so items are
+	// checked in order and a stale item makes everything fed by it stale.
+	struct graph graph = graph_create(opts);
+	graph.mem_budget = cs->mem_budget;
+	graph.nice = cs->job_nice;
+	graph.affinity = cs->job_affinity;
+
+	struct gen_conf const *gen = NULL;
+	time_t deps_mt = 0;
+	for (size_t i = 0; i < items.size && ok; ++i)
+	{
+		struct item *item = &items.data[i];
+		if (item->gen != gen)
+		{
+			gen = item->gen;
+			deps_mt = 0;
+			for (size_t j = 0; j < gen->deps.size; ++j)
+			{
+				struct stat s;
+				if (stat(gen->deps.data[j], &s))
+				{
+					fprintf(stderr, "generator '%s' depends on missing file: "
+					        "'%s'!\n", gen->name, gen->deps.data[j]);
+					ok = false;
+					break;
+				}
+				if (difftime(s.st_mtime, deps_mt) > 0.0)
+					deps_mt = s.st_mtime;
+			}
+		}
+
+		item->stale = ok && (force || ck_stale(&items, item, &sigs, deps_mt));
+		if (item->stale)
+		{
+			for (size_t j = 0; j < item->outputs.size; ++j)
+				mkdir_recursive(item->outputs.data[j]);
+
+			char *err = malloc(strlen(item->input) + 33);
+			sprintf(err, "generation failed on file: '%s'!", item->input);
+
+			struct job job =
+			{
+				.mk_cmd = mk_cmd,
+				.ctx = item,
+				.name = strdup(item->outputs.data[0]),
+				.err = err,
+				.out = NULL,
+				.out_tmp = NULL,
+				.success_rc = gen->success_rc,
+				.counted = true,
+			};
+			item->job = graph_add(&graph, &job);
+		}
+	}
+
+	// the dependencies only point at jobs added before, so they are wired up
+	// once every item has its job.
+	for (size_t i = 0; i < items.size && ok; ++i)
+	{
+		struct item const *item = &items.data[i];
+		if (item->job == SIZE_MAX)
+			continue;
+
+		size_t producer;
+		if (str_map_get(&items.outputs, item->input, &producer)
+		    && items.data[producer].job != SIZE_MAX)
+		{
+			graph_dep(&graph, item->job, items.data[producer].job);
+		}
+	}
+
+	// generators write their outputs in place, so the signatures of what is
+	// about to run are dropped first, in case the build is killed midway.
+	if (ok)
+	{
+		ok = sigs_save(&items, &graph, sig_file)
+		     && (!graph.size || graph_run(&graph));
+		ok = sigs_save(&items, &graph, sig_file) && ok;
+	}
+
+	graph_destroy(&graph);
+	sigs_destroy(&sigs);
+	free(sig_file);
+
+	for (size_t i = 0; i < items.size; ++i)
+	{
+		free(items.data[i].input);
+		free(items.data[i].stem);
+		str_list_destroy(&items.data[i].outputs);
+	}
+	free(items.data);
+	str_map_destroy(&items.outputs);
+
+	return ok;
+}
+
+static bool
+expand(struct items *items, struct gen_conf const *gen,
+       struct sigs const *sigs)
+{
+	struct str_list inputs = str_list_create();
+	for (size_t i = 0; i < gen->inputs.size; ++i)
+	{
+		// generated files are only ever inputs to generators declared after
+		// the one writing them, which are added below.
+		glob_t g;
+		if (!glob(gen->inputs.data[i], 0, NULL, &g))
+		{
+			for (size_t j = 0; j < g.gl_pathc; ++j)
+			{
+				size_t ind;
+				if (!str_map_get(&sigs->written, g.gl_pathv[j], &ind)
+				    && !str_list_contains(&inputs, g.gl_pathv[j]))
+				{
+					str_list_add(&inputs, g.gl_pathv[j]);
+				}
+			}
+			globfree(&g);
+		}
+
+		// outputs of earlier generators may not have been written yet.
+		for (size_t j = 0; j < items->size; ++j)
+		{
+			struct str_list const *outputs = &items->data[j].outputs;
+			for (size_t k = 0; k < outputs->size; ++k)
+			{
+				if (!fnmatch(gen->inputs.data[i], outputs->data[k], FNM_PATHNAME)
+				    && !str_list_contains(&inputs, outputs->data[k]))
+				{
+					str_list_add(&inputs, outputs->data[k]);
+				}
+			}
+		}
+	}
+
+	bool ok = true;
+	for (size_t i = 0; i < inputs.size && ok; ++i)
+		ok = add_item(items, gen, inputs.data[i]);
+
+	str_list_destroy(&inputs);
+	return ok;
+}
+
+static bool
+add_item(struct items *items, struct gen_conf const *gen, char const *input)
+{
+	// the stem is the input's file name without its extension.
+	char const *name = strrchr(input, '/');
+	name = name ? name + 1 : input;
+	char const *ext = strrchr(name, '.');
+	size_t stem_len = ext && ext != name ? (size_t)(ext - name) : strlen(name);
+
+	struct item item =
+	{
+		.input = strdup(input),
+		.stem = strndup(name, stem_len),
+		.outputs = str_list_create(),
+		.gen = gen,
+		.job = SIZE_MAX,
+		.stale = false,
+	};
+
+	struct fmt_spec spec = fmt_spec_create();
+	fmt_spec_add_ent(&spec, 'n', fmt_stem);
+	for (size_t i = 0; i < gen->outputs.size; ++i)
+	{
+		char *output = fmt_str(&spec, gen->outputs.data[i], &item);
+
+		size_t prev;
+		if (str_map_get(&items->outputs, output, &prev))
+		{
+			fprintf(stderr, "generator '%s' and '%s' both write: '%s'!\n",
+			        items->data[prev].gen->name, gen->name, output);
+			free(output);
+			fmt_spec_destroy(&spec);
+			free(item.input);
+			free(item.stem);
+			str_list_destroy(&item.outputs);
+			return false;
+		}
+
+		str_list_add(&item.outputs, output);
+		str_map_put(&items->outputs, output, items->size);
+		free(output);
+	}
+	fmt_spec_destroy(&spec);
+
+	// the command is what decides the outputs, so any change to it has to
+	// generate them again.
+	char *cmd = fmt_cmd(&item);
+	item.hash = str_hash(cmd);
+	free(cmd);
+
+	if (items->size >= items->cap)
+	{
+		items->cap = items->cap ? items->cap * 2 : 16;
+		items->data = realloc(items->data, sizeof(struct item) * items->cap);
+	}
+	items->data[items->size++] = item;
+	return true;
+}
+
+static bool
+ck_stale(struct items const *items, struct item const *item,
+         struct sigs const *sigs, time_t deps_mt)
+{
+	// an input produced by a generator which runs will change.
+	size_t producer;
+	if (str_map_get(&items->outputs, item->input, &producer)
+	    && items->data[producer].stale)
+	{
+		return true;
+	}
+
+	size_t sig;
+	if (!str_map_get(&sigs->ids, item->input, &sig)
+	    || sigs->hashes[sig] != item->hash)
+	{
+		return true;
+	}
+
+	struct stat s;
+	if (stat(item->input, &s))
+		return true;
+
+	time_t mt = difftime(s.st_mtime, deps_mt) > 0.0 ? s.st_mtime : deps_mt;
+	for (size_t i = 0; i < item->outputs.size; ++i)
+	{
+		if (stat(item->outputs.data[i], &s) || difftime(mt, s.st_mtime) > 0.0)
+			return true;
+	}
+
+	return false;
+}
+
+static struct sigs
+sigs_load(char const *file)
+{
+	struct sigs sigs =
+	{
+		.ids = str_map_create(),
+		.written = str_map_create(),
+		.hashes = NULL,
+		.outputs = NULL,
+		.size = 0,
+	};
+
+	FILE *fp = fopen(file, "rb");
+	if (!fp)
+		return sigs;
+
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t line_len;
+	while ((line_len = getline(&line, &line_cap, fp)) > 0)
+	{
+		if (line[line_len - 1] == '\n')
+			line[--line_len] = 0;
+
+		char *fields = strchr(line, ' ');
+		if (!fields)
+			continue;
+		*fields++ = 0;
+
+		sigs.hashes = realloc(sigs.hashes, sizeof(size_t) * (sigs.size + 1));
+		sigs.outputs = realloc(sigs.outputs, sizeof(struct str_list) * (sigs.size + 1));
+		sigs.hashes[sigs.size] = strtoull(line, NULL, 16);
+		sigs.outputs[sigs.size] = str_list_create();
+
+		char *input = strtok(fields, "\t");
+		for (char *output; (output = strtok(NULL, "\t"));)
+		{
+			str_list_add(&sigs.outputs[sigs.size], output);
+			str_map_put(&sigs.written, output, sigs.size);
+		}
+
+		if (input)
+			str_map_put(&sigs.ids, input, sigs.size);
+		++sigs.size;
+	}
+
+	free(line);
+	fclose(fp);
+	return sigs;
+}
+
+static bool
+sigs_save(struct items const *items, struct graph const *graph, char const *file)
+{
+	// items which did not succeed get a hash of 0, so that they run again
+	// next time while their outputs are still known to be generated.
+	struct string buf = string_create();
+	for (size_t i = 0; i < items->size; ++i)
+	{
+		struct item const *item = &items->data[i];
+		bool done = item->job == SIZE_MAX || graph->data[item->job].measured;
+
+		char hash[24];
+		sprintf(hash, "%016zx ", done ? item->hash : 0);
+		string_push_str(&buf, hash);
+		string_push_str(&buf, item->input);
+		for (size_t j = 0; j < item->outputs.size; ++j)
+		{
+			string_push_ch(&buf, '\t');
+			string_push_str(&buf, item->outputs.data[j]);
+		}
+		string_push_ch(&buf, '\n');
+	}
+
+	mkdir_recursive(file);
+	bool ok = write_file(file, buf.str ? buf.str : "", buf.len);
+	string_destroy(&buf);
+	return ok;
+}
+
+static void
+sigs_destroy(struct sigs *sigs)
+{
+	for (size_t i = 0; i < sigs->size; ++i)
+		str_list_destroy(&sigs->outputs[i]);
+
+	free(sigs->outputs);
+	free(sigs->hashes);
+	str_map_destroy(&sigs->ids);
+	str_map_destroy(&sigs->written);
+}
+
+static char *
+fmt_cmd(struct item const *item)
+{
+	struct fmt_spec spec = fmt_spec_create();
+	fmt_spec_add_ent(&spec, 'i', fmt_input);
+	fmt_spec_add_ent(&spec, 'o', fmt_outputs);
+	fmt_spec_add_ent(&spec, 'n', fmt_stem);
+	char *cmd = fmt_str(&spec, item->gen->cmd_fmt, (void *)item);
+	fmt_spec_destroy(&spec);
+
+	return cmd;
+}
+
+static void
+fmt_input(struct string *out_cmd, void *vp_item)
+{
+	struct item const *item = vp_item;
+	string_push_str(out_cmd, item->input);
+}
+
+static void
+fmt_outputs(struct string *out_cmd, void *vp_item)
+{
+	struct item const *item = vp_item;
+	for (size_t i = 0; i < item->outputs.size; ++i)
+	{
+		if (i)
+			string_push_ch(out_cmd, ' ');
+		string_push_str(out_cmd, item->outputs.data[i]);
+	}
+}
+
+static void
+fmt_stem(struct string *out_cmd, void *vp_item)
+{
+	struct item const *item = vp_item;
+	string_push_str(out_cmd, item->stem);
+}
+
+static char *
+mk_cmd(void *vp_item)
+{
+	return fmt_cmd(vp_item);
+}
@@ -0,0 +1,1075 @@
+#include "graph.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+#include <unistd.h>
+
+#include "proc.h"
+#include "stats.h"
+#include "util.h"
+
+#ifndef COMPILE_SINGLE_THREAD
+#include <pthread.h>
+#endif
+
+// in seconds, which a command is given to exit after SIGTERM before it is
+// sent SIGKILL.
+#define KILL_GRACE 5.0
+
+enum job_status
+{
+	JOB_PENDING = 0,
+	JOB_OK,
+	JOB_FAILED,
+	JOB_SKIPPED,
+	JOB_CANCELLED,
+};
+
+struct run_state
+{
+	struct graph *g;
+	size_t *ready;
+	size_t ready_head, ready_tail;
+	size_t ndone, ncounted;
+	struct timespec start;
+
+	// a job is marked skipped as soon as anything it depends on did not
+	// succeed, and is then never run.
+	unsigned char *status;
+	size_t nfailed, nskipped, ncancelled;
+	bool cancelled;
+
+	// admission, guarded like the ready queue.
+	size_t nslots, nrunning, mem_used, threads_used;
+
+	// CPUs commands may be pinned to, handed out in turn.
+	int *cpus;
+	size_t ncpus, next_cpu;
+
+	// only ever touched atomically, so that reporting never has to wait on
+	// the scheduling lock.
+	size_t progress;
+#ifndef COMPILE_SINGLE_THREAD
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+#endif
+};
+
+// a job whose command is running.
+struct slot
+{
+	size_t ind;
+	struct proc proc;
+	int pidfd;
+	bool exited;
+	int rc;
+	struct rusage ru;
+	char *cmd;
+	struct string output;
+	double start, deadline;
+	bool timed_out;
+
+	// when SIGTERM was sent to the command, or 0.
+	double term_time;
+	bool killed;
+};
+
+// process groups of running jobs indexed by job, read from the interrupt
+// handler, so only ever accessed atomically.
+static pid_t *running;
+static size_t running_size;
+static volatile sig_atomic_t interrupted;
+
+static void *worker(void *vp_arg);
+static enum job_status run_job(struct run_state *state, size_t ind);
+static bool start_job(struct run_state *state, size_t ind, struct slot *out_slot);
+static enum job_status end_job(struct run_state *state, struct slot *slot);
+static void wait_timed(struct run_state *state, struct slot *slot);
+static int next_timeout(struct run_state const *state, struct slot const *slots, size_t nslots);
+static void kill_overdue(struct run_state const *state, struct slot *slots, size_t nslots);
+static void run_loop(struct run_state *state, size_t nslots);
+static void abandon(struct slot *slot);
+static bool have_pidfd(void);
+static bool admit(struct run_state const *state, size_t ind);
+static size_t job_threads(struct job const *job);
+static void get_cpus(struct run_state *state);
+static void finish_job(struct run_state *state, size_t ind, enum job_status status);
+static void cancel_running(void);
+static void on_interrupt(int sig);
+static void print_summary(struct run_state const *state);
+static double elapsed(struct run_state const *state);
+static void emit_event(FILE *fp, struct string *ev);
+static bool ck_acyclic(struct graph const *g);
+
+size_t
+graph_slots(void)
+{
+	// one slot is always there to build with, whatever the system reports.
+	ssize_t cnt = get_nprocs();
+	return cnt < 1 ? 1 : cnt;
+}
+
+struct graph
+graph_create(struct graph_opts const *opts)
+{
+	return (struct graph)
+	{
+		.data = malloc(sizeof(struct job)),
+		.size = 0,
+		.cap = 1,
+		.opts = *opts,
+		.res = malloc(sizeof(struct graph_res)),
+		.res_size = 0,
+		.res_cap = 1,
+		.mem_budget = 0,
+		.nice = 0,
+		.affinity = false,
+		.independent = false,
+	};
+}
+
+void
+graph_destroy(struct graph *g)
+{
+	for (size_t i = 0; i < g->size; ++i)
+	{
+		free(g->data[i].name);
+		free(g->data[i].err);
+		free(g->data[i].out);
+		free(g->data[i].out_tmp);
+		free(g->data[i].log);
+		free(g->data[i].rdeps);
+	}
+
+	for (size_t i = 0; i < g->res_size; ++i)
+		g->res[i].destroy(g->res[i].ptr);
+
+	free(g->data);
+	free(g->res);
+}
+
+size_t
+graph_add(struct graph *g, struct job const *job)
+{
+	if (g->size >= g->cap)
+	{
+		g->cap *= 2;
+		g->data = realloc(g->data, sizeof(struct job) * g->cap);
+	}
+
+	g->data[g->size] = *job;
+	g->data[g->size].rdeps = malloc(sizeof(size_t));
+	g->data[g->size].nrdeps = 0;
+	g->data[g->size].rdeps_cap = 1;
+	g->data[g->size].nwait = 0;
+	g->data[g->size].measured = false;
+	g->data[g->size].peak_rss = 0;
+	g->data[g->size].out_size = 0;
+	g->data[g->size].duration = 0.0;
+	g->data[g->size].cpu_time = 0.0;
+	g->data[g->size].timed_out = false;
+	g->data[g->size].succeeded = false;
+
+	return g->size++;
+}
+
+void
+graph_dep(struct graph *g, size_t job, size_t dep)
+{
+	struct job *d = &g->data[dep];
+	if (d->nrdeps >= d->rdeps_cap)
+	{
+		d->rdeps_cap *= 2;
+		d->rdeps = realloc(d->rdeps, sizeof(size_t) * d->rdeps_cap);
+	}
+
+	d->rdeps[d->nrdeps++] = job;
+	++g->data[job].nwait;
+}
+
+void
+graph_own(struct graph *g, void *ptr, void (*destroy)(void *))
+{
+	if (g->res_size >= g->res_cap)
+	{
+		g->res_cap *= 2;
+		g->res = realloc(g->res, sizeof(struct graph_res) * g->res_cap);
+	}
+
+	g->res[g->res_size++] = (struct graph_res)
+	{
+		.ptr = ptr,
+		.destroy = destroy,
+	};
+}
+
+bool
+graph_run(struct graph *g)
+{
+	if (!g->size)
+		return true;
+
+	if (!ck_acyclic(g))
+		return false;
+
+	struct run_state state =
+	{
+		.g = g,
+		.ready = malloc(sizeof(size_t) * g->size),
+		.ready_head = 0,
+		.ready_tail = 0,
+		.ndone = 0,
+		.ncounted = 0,
+		.status = calloc(g->size, 1),
+		.nfailed = 0,
+		.nskipped = 0,
+		.ncancelled = 0,
+		.cancelled = false,
+		.nslots = 0,
+		.nrunning = 0,
+		.mem_used = 0,
+		.threads_used = 0,
+		.cpus = NULL,
+		.ncpus = 0,
+		.next_cpu = 0,
+		.progress = 0,
+	};
+
+	if (g->affinity)
+		get_cpus(&state);
+
+	for (size_t i = 0; i < g->size; ++i)
+	{
+		state.ncounted += g->data[i].counted;
+		if (!g->data[i].nwait)
+			state.ready[state.ready_tail++] = i;
+	}
+
+	running = calloc(g->size, sizeof(pid_t));
+	running_size = g->size;
+	interrupted = 0;
+
+	// children run in their own process groups and so do not see a terminal
+	// interrupt themselves, it has to be passed on to them.
+	struct sigaction sa = {.sa_handler = on_interrupt}, old_int, old_term;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, &old_int);
+	sigaction(SIGTERM, &sa, &old_term);
+
+	clock_gettime(CLOCK_MONOTONIC, &state.start);
+
+	size_t cnt = graph_slots();
+	cnt = g->size < cnt ? g->size : cnt;
+	state.nslots = cnt;
+
+#ifndef COMPILE_SINGLE_THREAD
+	pthread_mutex_init(&state.mutex, NULL);
+	pthread_cond_init(&state.cond, NULL);
+#endif
+
+	if (!g->opts.threads && have_pidfd())
+	{
+		// one thread starts every command and waits on all of them at once.
+		
+		printf("building project with %zu job slot(s)\n", cnt);
+		fflush(stdout);
+
+		if (g->opts.events_fp)
+		{
+			fprintf(g->opts.events_fp, "{\"event\":\"build_start\",\"jobs\":%zu,"
+			        "\"workers\":%zu}\n", g->size, cnt);
+		}
+
+		run_loop(&state, cnt);
+	}
+	else
+	{
+#ifndef COMPILE_SINGLE_THREAD
+		// multithreaded pthread dependent code.
+
+		printf("building project with %zu worker(s)\n", cnt);
+		fflush(stdout);
+
+		if (g->opts.events_fp)
+		{
+			fprintf(g->opts.events_fp, "{\"event\":\"build_start\",\"jobs\":%zu,"
+			        "\"workers\":%zu}\n", g->size, cnt);
+		}
+
+		// fewer workers than slots only make the build slower, while without
+		// any it cannot run at all.
+		pthread_t *ths = malloc(sizeof(pthread_t) * cnt);
+		size_t nths = 0;
+		while (nths < cnt && !pthread_create(&ths[nths], NULL, worker, &state))
+			++nths;
+		
+		if (nths < cnt)
+			fputs("failed to create worker thread for building!\n", stderr);
+		if (!nths)
+			state.cancelled = true;
+
+		for (size_t i = 0; i < nths; ++i)
+			pthread_join(ths[i], NULL);
+
+		free(ths);
+#else
+		// singlethreaded pthread independent code.
+
+		puts("building project in single thread mode");
+		fflush(stdout);
+
+		if (g->opts.events_fp)
+		{
+			fprintf(g->opts.events_fp, "{\"event\":\"build_start\",\"jobs\":%zu,"
+			        "\"workers\":1}\n", g->size);
+		}
+
+		worker(&state);
+#endif
+	}
+
+#ifndef COMPILE_SINGLE_THREAD
+	pthread_cond_destroy(&state.cond);
+	pthread_mutex_destroy(&state.mutex);
+#endif
+
+	sigaction(SIGINT, &old_int, NULL);
+	sigaction(SIGTERM, &old_term, NULL);
+	
+	bool success = !state.nfailed && !state.cancelled && !interrupted;
+	if (!success && !g->independent)
+		print_summary(&state);
+
+	if (g->opts.events_fp)
+	{
+		fprintf(g->opts.events_fp, "{\"event\":\"build_finish\",\"time\":%.6f,"
+		        "\"success\":%s,\"failed\":%zu,\"skipped\":%zu,"
+		        "\"cancelled\":%zu}\n", elapsed(&state),
+		        success ? "true" : "false", state.nfailed, state.nskipped,
+		        state.ncancelled);
+		fflush(g->opts.events_fp);
+	}
+
+	free(running);
+	running = NULL;
+	running_size = 0;
+	free(state.cpus);
+	free(state.status);
+	free(state.ready);
+
+	return success;
+}
+
+static void *
+worker(void *vp_arg)
+{
+	struct run_state *state = vp_arg;
+
+#ifndef COMPILE_SINGLE_THREAD
+	pthread_mutex_lock(&state->mutex);
+#endif
+
+	for (;;)
+	{
+#ifndef COMPILE_SINGLE_THREAD
+		while ((state->ready_head == state->ready_tail
+		        || !admit(state, state->ready[state->ready_head]))
+		       && state->ndone < state->g->size
+		       && !state->cancelled)
+		{
+			pthread_cond_wait(&state->cond, &state->mutex);
+		}
+#endif
+
+		if (state->cancelled || state->ready_head == state->ready_tail)
+			break;
+
+		size_t ind = state->ready[state->ready_head++];
+		bool skip = state->status[ind] == JOB_SKIPPED;
+		size_t mem_est = state->g->data[ind].mem_est;
+		size_t threads = job_threads(&state->g->data[ind]);
+		++state->nrunning;
+		state->mem_used += mem_est;
+		state->threads_used += threads;
+
+#ifndef COMPILE_SINGLE_THREAD
+		pthread_mutex_unlock(&state->mutex);
+#endif
+
+		enum job_status status = skip ? JOB_SKIPPED : run_job(state, ind);
+
+#ifndef COMPILE_SINGLE_THREAD
+		pthread_mutex_lock(&state->mutex);
+#endif
+
+		--state->nrunning;
+		state->mem_used -= mem_est;
+		state->threads_used -= threads;
+		finish_job(state, ind, status);
+	}
+
+#ifndef COMPILE_SINGLE_THREAD
+	pthread_mutex_unlock(&state->mutex);
+#endif
+
+	return NULL;
+}
+
+static enum job_status
+run_job(struct run_state *state, size_t ind)
+{
+	struct slot slot;
+	if (!start_job(state, ind, &slot))
+		return JOB_OK;
+
+	if (slot.proc.pid != -1)
+		wait_timed(state, &slot);
+	return end_job(state, &slot);
+}
+
+static bool
+start_job(struct run_state *state, size_t ind, struct slot *out_slot)
+{
+	struct job const *job = &state->g->data[ind];
+
+	char *cmd = job->mk_cmd ? job->mk_cmd(job->ctx) : NULL;
+	if (!cmd)
+		return false;
+
+	double start = elapsed(state);
+	if (state->g->opts.events_fp)
+	{
+		char buf[64];
+		struct string ev = string_create();
+		sprintf(buf, "{\"event\":\"start\",\"job\":%zu,\"name\":", ind);
+		string_push_str(&ev, buf);
+		json_str_inplace(&ev, job->name, strlen(job->name));
+		sprintf(buf, ",\"time\":%.6f}\n", start);
+		string_push_str(&ev, buf);
+		emit_event(state->g->opts.events_fp, &ev);
+	}
+
+	// a leftover temporary would otherwise be appended to by some tools.
+	if (job->out_tmp)
+		unlink(job->out_tmp);
+
+	int cpu = -1;
+	if (state->ncpus)
+	{
+		size_t next = __atomic_fetch_add(&state->next_cpu, 1, __ATOMIC_RELAXED);
+		cpu = state->cpus[next % state->ncpus];
+	}
+
+	// a command which cannot be started fails with -1, and has nothing to
+	// wait on.
+	struct proc proc = {.pid = -1, .out_fd = -1};
+	if (proc_spawn(&proc, cmd, state->g->nice, cpu))
+	{
+		stats_add(&stats.jobs_spawned, 1);
+		__atomic_store_n(&running[ind], proc.pid, __ATOMIC_SEQ_CST);
+		
+		// a cancellation may have swept over the running jobs between the
+		// spawn and the job being registered.
+		if (__atomic_load_n(&state->cancelled, __ATOMIC_SEQ_CST) || interrupted)
+			proc_kill(proc.pid, false);
+	}
+
+	*out_slot = (struct slot)
+	{
+		.ind = ind,
+		.proc = proc,
+		.pidfd = -1,
+		.exited = proc.pid == -1,
+		.rc = -1,
+		.cmd = cmd,
+		.output = string_create(),
+		.start = start,
+		.deadline = job->timeout > 0.0 ? start + job->timeout : 0.0,
+		.timed_out = false,
+		.term_time = 0.0,
+		.killed = false,
+	};
+
+	return true;
+}
+
+static enum job_status
+end_job(struct run_state *state, struct slot *slot)
+{
+	size_t ind = slot->ind;
+	struct job *job = &state->g->data[ind];
+	struct string *output = &slot->output;
+	int rc = slot->rc;
+	
+	__atomic_store_n(&running[ind], 0, __ATOMIC_SEQ_CST);
+	double duration = elapsed(state) - slot->start;
+
+	struct rusage const *ru = &slot->ru;
+	stats_add(&stats.child_cpu_ns,
+	          (ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000000ull
+	          + (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1000ull);
+
+	enum job_status status = rc != -1 && rc == job->success_rc
+	                         && !slot->timed_out
+	                         ? JOB_OK
+	                         : JOB_FAILED;
+	if (status == JOB_FAILED && !slot->timed_out
+	    && (__atomic_load_n(&state->cancelled, __ATOMIC_SEQ_CST) || interrupted))
+	{
+		status = JOB_CANCELLED;
+	}
+
+	if (slot->timed_out)
+	{
+		char msg[64];
+		sprintf(msg, "timed out after %.1f s!\n", job->timeout);
+		if (output->len && output->str[output->len - 1] != '\n')
+			string_push_ch(output, '\n');
+		string_push_str(output, msg);
+		job->timed_out = true;
+	}
+
+	if (job->log)
+	{
+		mkdir_recursive(job->log);
+		FILE *fp = fopen(job->log, "wb");
+		if (!fp || fwrite(output->str, 1, output->len, fp) != output->len)
+		{
+			string_push_str(output, "failed to write log: '");
+			string_push_str(output, job->log);
+			string_push_str(output, "'!\n");
+		}
+		if (fp)
+			fclose(fp);
+	}
+
+	if (status == JOB_OK && job->out_tmp && rename(job->out_tmp, job->out))
+	{
+		string_push_str(output, "failed to move output into place: '");
+		string_push_str(output, job->out);
+		string_push_str(output, "'!\n");
+		status = JOB_FAILED;
+	}
+
+	if (status == JOB_OK)
+	{
+		job->measured = true;
+		job->peak_rss = slot->ru.ru_maxrss;
+		job->duration = duration;
+		job->cpu_time = slot->ru.ru_utime.tv_sec + slot->ru.ru_stime.tv_sec
+		                + (slot->ru.ru_utime.tv_usec + slot->ru.ru_stime.tv_usec) / 1e6;
+
+		struct stat s;
+		if (job->out && !stat(job->out, &s))
+			job->out_size = s.st_size;
+	}
+
+	// whatever a failed or interrupted job left behind is incomplete.
+	if (status != JOB_OK && job->out_tmp)
+		unlink(job->out_tmp);
+	else if (status != JOB_OK && job->out)
+		unlink(job->out);
+
+	// everything about a job is written in one go once it finishes, so the
+	// output of concurrently running jobs never interleaves.
+	char buf[128];
+	if (status != JOB_CANCELLED)
+	{
+		struct string block = string_create();
+		if (job->counted)
+		{
+			size_t progress = __atomic_add_fetch(&state->progress, 1, __ATOMIC_RELAXED);
+			sprintf(buf, "(%zu/%zu)\t", progress, state->ncounted);
+			string_push_str(&block, buf);
+		}
+		else
+			string_push_str(&block, "(+)\t");
+
+		string_push_str(&block, job->name);
+		if (state->g->opts.verbose)
+		{
+			string_push_str(&block, "\t<- ");
+			string_push_str(&block, slot->cmd);
+		}
+		string_push_ch(&block, '\n');
+
+		if (!job->quiet || status != JOB_OK)
+		{
+			string_push_buf(&block, output->str, output->len);
+			if (output->len && output->str[output->len - 1] != '\n')
+				string_push_ch(&block, '\n');
+		}
+
+		fwrite(block.str, 1, block.len, stdout);
+		fflush(stdout);
+		string_destroy(&block);
+	}
+
+	if (status == JOB_FAILED)
+		fprintf(stderr, "%s\n", job->err);
+
+	if (state->g->opts.events_fp)
+	{
+		struct string ev = string_create();
+		sprintf(buf, "{\"event\":\"finish\",\"job\":%zu,\"name\":", ind);
+		string_push_str(&ev, buf);
+		json_str_inplace(&ev, job->name, strlen(job->name));
+		sprintf(buf, ",\"time\":%.6f,\"duration\":%.6f,\"rc\":%d,\"status\":\"%s\","
+		        "\"output\":", slot->start + duration, duration, rc,
+		        status == JOB_OK ? "ok"
+		        : status == JOB_FAILED ? "failed"
+		        : "cancelled");
+		string_push_str(&ev, buf);
+		json_str_inplace(&ev, output->str, output->len);
+		string_push_buf(&ev, "}\n", 2);
+		emit_event(state->g->opts.events_fp, &ev);
+	}
+
+	string_destroy(output);
+	free(slot->cmd);
+
+	return status;
+}
+
+static void
+wait_timed(struct run_state *state, struct slot *slot)
+{
+	// like `proc_wait()`, except that the wait for output gives up once the
+	// command is overdue or the run is cancelled, after which it is killed
+	// and drained.
+	struct pollfd pfd = {.fd = slot->proc.out_fd, .events = POLLIN};
+	while (slot->proc.out_fd != -1)
+	{
+		// a cancellation by another worker does not wake this one, so it is
+		// looked for at least every so often.
+		int timeout = next_timeout(state, slot, 1);
+		if (timeout == -1 || timeout > KILL_GRACE * 1000)
+			timeout = KILL_GRACE * 1000;
+
+		int rc = poll(&pfd, 1, timeout);
+		if (rc == -1 && errno != EINTR)
+		{
+			fputs("failed to poll running command!\n", stderr);
+			abandon(slot);
+			return;
+		}
+		else if (rc > 0)
+			proc_read(&slot->proc, &slot->output);
+		
+		kill_overdue(state, slot, 1);
+	}
+
+	slot->rc = proc_reap(&slot->proc, &slot->ru);
+}
+
+static int
+next_timeout(struct run_state const *state, struct slot const *slots,
+             size_t nslots)
+{
+	// in milliseconds until the first running command is overdue or due to
+	// be killed for good, for `poll()`.
+	bool cancelling = __atomic_load_n(&state->cancelled, __ATOMIC_SEQ_CST)
+	                  || interrupted;
+	double next = -1.0, now = elapsed(state);
+	for (size_t i = 0; i < nslots; ++i)
+	{
+		struct slot const *slot = &slots[i];
+		if (slot->killed || (slot->exited && slot->proc.out_fd == -1))
+			continue;
+
+		double at;
+		if (slot->term_time)
+			at = slot->term_time + KILL_GRACE;
+		else if (cancelling)
+			at = now;
+		else if (slot->deadline)
+			at = slot->deadline;
+		else
+			continue;
+
+		double left = at - now;
+		left = left > 0.0 ? left : 0.0;
+		if (next < 0.0 || left < next)
+			next = left;
+	}
+
+	return next < 0.0 ? -1 : (int)(next * 1000.0) + 1;
+}
+
+static void
+kill_overdue(struct run_state const *state, struct slot *slots, size_t nslots)
+{
+	// a command which is still running, or whose descendants still hold its
+	// output open, a while after SIGTERM is sent SIGKILL.
+	bool cancelling = __atomic_load_n(&state->cancelled, __ATOMIC_SEQ_CST)
+	                  || interrupted;
+	double now = elapsed(state);
+	for (size_t i = 0; i < nslots; ++i)
+	{
+		struct slot *slot = &slots[i];
+		if (slot->killed || (slot->exited && slot->proc.out_fd == -1))
+			continue;
+
+		if (!slot->term_time && slot->deadline && now >= slot->deadline)
+		{
+			proc_kill(slot->proc.pid, false);
+			slot->timed_out = true;
+			slot->term_time = now;
+		}
+		else if (!slot->term_time && cancelling)
+		{
+			// already sent SIGTERM by `cancel_running()`.
+			slot->term_time = now;
+		}
+		else if (slot->term_time && now >= slot->term_time + KILL_GRACE)
+		{
+			proc_kill(slot->proc.pid, true);
+			slot->killed = true;
+		}
+	}
+}
+
+static void
+run_loop(struct run_state *state, size_t nslots)
+{
+	struct slot *slots = malloc(sizeof(struct slot) * nslots);
+	struct pollfd *pfds = malloc(sizeof(struct pollfd) * 2 * nslots);
+	size_t nrunning = 0;
+
+	for (;;)
+	{
+		// fill every free slot straight away, jobs which need no command are
+		// finished on the spot, which may make further jobs ready.
+		while (nrunning < nslots && !state->cancelled
+		       && state->ready_head != state->ready_tail)
+		{
+			size_t ind = state->ready[state->ready_head];
+			if (state->status[ind] == JOB_SKIPPED)
+			{
+				++state->ready_head;
+				finish_job(state, ind, JOB_SKIPPED);
+				continue;
+			}
+
+			// jobs are started in order, so one which does not fit holds up
+			// the rest until enough memory or slots are freed.
+			if (!admit(state, ind))
+				break;
+			++state->ready_head;
+
+			struct slot *slot = &slots[nrunning];
+			if (!start_job(state, ind, slot))
+			{
+				finish_job(state, ind, JOB_OK);
+				continue;
+			}
+
+			// a command which could not be started, or cannot be waited on
+			// here, fails straight away.
+			slot->pidfd = slot->proc.pid != -1 ? proc_pidfd(slot->proc.pid) : -1;
+			if (slot->pidfd == -1)
+			{
+				if (slot->proc.pid != -1)
+				{
+					fputs("failed to open pidfd for command!\n", stderr);
+					abandon(slot);
+				}
+				finish_job(state, ind, end_job(state, slot));
+				continue;
+			}
+			++nrunning;
+			++state->nrunning;
+			state->mem_used += state->g->data[ind].mem_est;
+			state->threads_used += job_threads(&state->g->data[ind]);
+		}
+
+		if (!nrunning)
+			break;
+
+		// a job is done once its command has exited and all of its output
+		// has been read.
+		size_t npfds = 0;
+		for (size_t i = 0; i < nrunning; ++i)
+		{
+			if (slots[i].proc.out_fd != -1)
+				pfds[npfds++] = (struct pollfd){.fd = slots[i].proc.out_fd, .events = POLLIN};
+			if (!slots[i].exited)
+				pfds[npfds++] = (struct pollfd){.fd = slots[i].pidfd, .events = POLLIN};
+		}
+
+		// without being able to wait on anything the build stops, and every
+		// running job is ended below.
+		if (poll(pfds, npfds, next_timeout(state, slots, nrunning)) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			
+			fputs("failed to poll running commands!\n", stderr);
+			__atomic_store_n(&state->cancelled, true, __ATOMIC_SEQ_CST);
+			for (size_t i = 0; i < nrunning; ++i)
+				abandon(&slots[i]);
+		}
+
+		kill_overdue(state, slots, nrunning);
+
+		for (size_t i = 0, j = 0; i < nrunning; ++i)
+		{
+			struct slot *slot = &slots[i];
+			if (slot->proc.out_fd != -1 && pfds[j++].revents)
+				proc_read(&slot->proc, &slot->output);
+			if (!slot->exited && pfds[j++].revents)
+			{
+				slot->rc = proc_reap(&slot->proc, &slot->ru);
+				slot->exited = true;
+				close(slot->pidfd);
+			}
+		}
+
+		for (size_t i = 0; i < nrunning;)
+		{
+			if (!slots[i].exited || slots[i].proc.out_fd != -1)
+			{
+				++i;
+				continue;
+			}
+
+			size_t ind = slots[i].ind;
+			enum job_status status = end_job(state, &slots[i]);
+			slots[i] = slots[--nrunning];
+			--state->nrunning;
+			state->mem_used -= state->g->data[ind].mem_est;
+			state->threads_used -= job_threads(&state->g->data[ind]);
+			finish_job(state, ind, status);
+		}
+	}
+
+	free(pfds);
+	free(slots);
+}
+
+static void
+abandon(struct slot *slot)
+{
+	// for a command which can no longer be waited on as usual, which is
+	// killed and reaped on the spot and fails.
+	if (!slot->exited || slot->proc.out_fd != -1)
+		proc_kill(slot->proc.pid, true);
+
+	if (slot->proc.out_fd != -1)
+	{
+		close(slot->proc.out_fd);
+		slot->proc.out_fd = -1;
+	}
+
+	if (!slot->exited)
+	{
+		if (slot->pidfd != -1)
+			close(slot->pidfd);
+		proc_reap(&slot->proc, &slot->ru);
+		slot->exited = true;
+	}
+
+	slot->rc = -1;
+	slot->killed = true;
+}
+
+static void
+finish_job(struct run_state *state, size_t ind, enum job_status status)
+{
+	struct job *job = &state->g->data[ind];
+
+	state->status[ind] = status;
+	job->succeeded = status == JOB_OK;
+	state->nfailed += status == JOB_FAILED;
+	state->nskipped += status == JOB_SKIPPED;
+	state->ncancelled += status == JOB_CANCELLED;
+
+	if (status == JOB_SKIPPED && state->g->opts.events_fp && job->name)
+	{
+		struct string ev = string_create();
+		char buf[64];
+		sprintf(buf, "{\"event\":\"skip\",\"job\":%zu,\"name\":", ind);
+		string_push_str(&ev, buf);
+		json_str_inplace(&ev, job->name, strlen(job->name));
+		string_push_buf(&ev, "}\n", 2);
+		emit_event(state->g->opts.events_fp, &ev);
+	}
+
+	// without `-k`, the first failure stops the build as a whole.
+	if ((status == JOB_FAILED && !state->g->opts.keep_going && !state->g->independent)
+	    || status == JOB_CANCELLED)
+	{
+		__atomic_store_n(&state->cancelled, true, __ATOMIC_SEQ_CST);
+		cancel_running();
+	}
+
+	++state->ndone;
+	for (size_t i = 0; i < job->nrdeps; ++i)
+	{
+		size_t rdep = job->rdeps[i];
+		if (status != JOB_OK)
+			state->status[rdep] = JOB_SKIPPED;
+		
+		if (!--state->g->data[rdep].nwait)
+			state->ready[state->ready_tail++] = rdep;
+	}
+
+#ifndef COMPILE_SINGLE_THREAD
+	pthread_cond_broadcast(&state->cond);
+#endif
+}
+
+static bool
+have_pidfd(void)
+{
+	int fd = proc_pidfd(getpid());
+	if (fd == -1)
+		return false;
+
+	close(fd);
+	return true;
+}
+
+static bool
+admit(struct run_state const *state, size_t ind)
+{
+	// a command running several threads of its own takes up as many slots,
+	// so that it does not compete with the jobs around it.
+	struct job const *job = &state->g->data[ind];
+	if (!state->nrunning)
+		return true;
+	if (state->threads_used + job_threads(job) > state->nslots)
+		return false;
+
+	return !state->g->mem_budget
+	       || state->mem_used + job->mem_est <= state->g->mem_budget;
+}
+
+static size_t
+job_threads(struct job const *job)
+{
+	return job->threads ? job->threads : 1;
+}
+
+static void
+get_cpus(struct run_state *state)
+{
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set))
+		return;
+
+	state->cpus = malloc(sizeof(int) * CPU_SETSIZE);
+	for (int i = 0; i < CPU_SETSIZE; ++i)
+	{
+		if (CPU_ISSET(i, &set))
+			state->cpus[state->ncpus++] = i;
+	}
+}
+
+static void
+cancel_running(void)
+{
+	for (size_t i = 0; i < running_size; ++i)
+	{
+		pid_t pid = __atomic_load_n(&running[i], __ATOMIC_SEQ_CST);
+		if (pid > 0)
+			proc_kill(pid, false);
+	}
+}
+
+static void
+on_interrupt(int sig)
+{
+	(void)sig;
+	interrupted = 1;
+	cancel_running();
+}
+
+static void
+print_summary(struct run_state const *state)
+{
+	if (interrupted)
+		fputs("build interrupted", stderr);
+	else
+		fputs("build failed", stderr);
+
+	fprintf(stderr, ": %zu job(s) failed, %zu skipped, %zu cancelled, %zu not "
+	        "started\n", state->nfailed, state->nskipped, state->ncancelled,
+	        state->g->size - state->ndone);
+
+	// with `-k` there may be many failures, which are listed once more so
+	// they don't get lost in the output.
+	if (!state->g->opts.keep_going)
+		return;
+
+	for (size_t i = 0; i < state->g->size; ++i)
+	{
+		if (state->status[i] == JOB_FAILED)
+			fprintf(stderr, "\t%s\n", state->g->data[i].err);
+	}
+}
+
+static double
+elapsed(struct run_state const *state)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - state->start.tv_sec)
+	       + (now.tv_nsec - state->start.tv_nsec) / 1e9;
+}
+
+static void
+emit_event(FILE *fp, struct string *ev)
+{
+	// one event per write, which the stream lock keeps whole.
+	fwrite(ev->str, 1, ev->len, fp);
+	fflush(fp);
+	string_destroy(ev);
+}
+
+static bool
+ck_acyclic(struct graph const *g)
+{
+	// simulate the run, any job which can never become ready is part of (or
+	// waiting on) a cycle.
+	size_t *nwait = malloc(sizeof(size_t) * g->size);
+	size_t *queue = malloc(sizeof(size_t) * g->size);
+	size_t head = 0, tail = 0;
+
+	for (size_t i = 0; i < g->size; ++i)
+	{
+		nwait[i] = g->data[i].nwait;
+		if (!nwait[i])
+			queue[tail++] = i;
+	}
+
+	while (head < tail)
+	{
+		struct job const *job = &g->data[queue[head++]];
+		for (size_t i = 0; i < job->nrdeps; ++i)
+		{
+			if (!--nwait[job->rdeps[i]])
+				queue[tail++] = job->rdeps[i];
+		}
+	}
+
+	free(nwait);
+	free(queue);
+
+	if (tail < g->size)
+	{
+		fputs("dependency cycle between build jobs!\n", stderr);
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,305 @@
+#include "hdrcost.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "prune.h"
+
+// clang `-ftime-trace` events for the time spent in each included file.
+#define TRACE_SOURCE "\"name\":\"Source\""
+#define TRACE_DUR "\"dur\":"
+#define TRACE_DETAIL "\"detail\":\""
+
+struct row
+{
+	size_t hdr;
+	double score;
+};
+
+static void add_trace(struct hdrcost *hc, char const *conts, size_t *last_seen, size_t trace);
+static char const *event_end(char const *start);
+static double mean_parse(struct hdrcost const *hc, size_t hdr);
+static int row_cmp(void const *lhs, void const *rhs);
+
+struct hdrcost
+hdrcost_create(size_t npaths)
+{
+	return (struct hdrcost)
+	{
+		.direct = calloc(npaths + 1, sizeof(size_t)),
+		.tus = calloc(npaths + 1, sizeof(size_t)),
+		.parse_tus = calloc(npaths + 1, sizeof(size_t)),
+		.rebuild = calloc(npaths + 1, sizeof(double)),
+		.parse = calloc(npaths + 1, sizeof(double)),
+		.is_hdr = bitset_create(npaths),
+		.hdrs = id_list_create(),
+		.size = npaths,
+		.nsrcs = 0,
+		.have_hist = false,
+		.have_traces = false,
+		.real = str_map_create(),
+	};
+}
+
+void
+hdrcost_destroy(struct hdrcost *hc)
+{
+	free(hc->direct);
+	free(hc->tus);
+	free(hc->parse_tus);
+	free(hc->rebuild);
+	free(hc->parse);
+	bitset_destroy(&hc->is_hdr);
+	id_list_destroy(&hc->hdrs);
+	str_map_destroy(&hc->real);
+}
+
+bool
+hdrcost_add_target(struct hdrcost *hc, struct conf const *conf,
+                   struct intern const *paths, struct id_list const *srcs,
+                   struct id_list const *objs, struct id_list const *hdrs,
+                   struct hist const *hist)
+{
+	// the same include graph as pruning walks, but for every source.
+	struct id_list *hdr_incs = malloc(sizeof(struct id_list) * (hdrs->size + 1));
+	struct id_list *src_incs = malloc(sizeof(struct id_list) * (srcs->size + 1));
+	if (!prune_scan(conf, paths, hdrs, hdrs, hdr_incs)
+	    || !prune_scan(conf, paths, hdrs, srcs, src_incs))
+	{
+		free(hdr_incs);
+		free(src_incs);
+		return false;
+	}
+
+	struct id_list const **incs_of = calloc(hc->size + 1, sizeof(struct id_list *));
+	for (size_t i = 0; i < hdrs->size; ++i)
+	{
+		size_t hdr = hdrs->data[i];
+		incs_of[hdr] = &hdr_incs[i];
+		if (bitset_test(&hc->is_hdr, hdr))
+			continue;
+
+		// targets may share headers, which are only counted once.
+		bitset_set(&hc->is_hdr, hdr);
+		id_list_add(&hc->hdrs, hdr);
+		for (size_t j = 0; j < hdr_incs[i].size; ++j)
+			++hc->direct[hdr_incs[i].data[j]];
+
+		char *real = realpath(intern_str(paths, hdr), NULL);
+		if (real)
+		{
+			str_map_put(&hc->real, real, hdr);
+			free(real);
+		}
+	}
+
+	// everything a source pulls in, directly or not, gets rebuilt with it.
+	struct bitset visited = bitset_create(hc->size);
+	struct id_list seen = id_list_create(), stack = id_list_create();
+	for (size_t i = 0; i < srcs->size; ++i)
+	{
+		struct hist_rec const *rec = hist_find(hist, intern_str(paths, objs->data[i]));
+		hc->have_hist = hc->have_hist || rec;
+		++hc->nsrcs;
+
+		stack.size = 0;
+		for (size_t j = 0; j < src_incs[i].size; ++j)
+		{
+			++hc->direct[src_incs[i].data[j]];
+			id_list_add(&stack, src_incs[i].data[j]);
+		}
+
+		while (stack.size > 0)
+		{
+			size_t hdr = stack.data[--stack.size];
+			if (bitset_test(&visited, hdr))
+				continue;
+
+			bitset_set(&visited, hdr);
+			id_list_add(&seen, hdr);
+			++hc->tus[hdr];
+			hc->rebuild[hdr] += rec ? rec->duration : 0.0;
+
+			for (size_t j = 0; incs_of[hdr] && j < incs_of[hdr]->size; ++j)
+				id_list_add(&stack, incs_of[hdr]->data[j]);
+		}
+
+		for (size_t j = 0; j < seen.size; ++j)
+			bitset_clr(&visited, seen.data[j]);
+		seen.size = 0;
+	}
+
+	id_list_destroy(&stack);
+	id_list_destroy(&seen);
+	bitset_destroy(&visited);
+	free(incs_of);
+
+	for (size_t i = 0; i < hdrs->size; ++i)
+		id_list_destroy(&hdr_incs[i]);
+	for (size_t i = 0; i < srcs->size; ++i)
+		id_list_destroy(&src_incs[i]);
+	free(hdr_incs);
+	free(src_incs);
+	return true;
+}
+
+bool
+hdrcost_add_traces(struct hdrcost *hc, char *lib_dir)
+{
+	// traces are written next to the objects, one per translation unit.
+	struct str_list trace_exts = str_list_create();
+	str_list_add(&trace_exts, "json");
+	struct str_list traces;
+	bool found = ext_find(lib_dir, &trace_exts, &traces);
+	str_list_destroy(&trace_exts);
+	if (!found)
+		return false;
+
+	size_t *last_seen = calloc(hc->size + 1, sizeof(size_t));
+	for (size_t i = 0; i < traces.size; ++i)
+	{
+		struct string conts = string_create();
+		if (!read_file(traces.data[i], &conts))
+		{
+			string_destroy(&conts);
+			continue;
+		}
+		string_push_ch(&conts, 0);
+
+		add_trace(hc, conts.str, last_seen, i + 1);
+		string_destroy(&conts);
+	}
+
+	free(last_seen);
+	str_list_destroy(&traces);
+	return true;
+}
+
+void
+hdrcost_print(struct hdrcost const *hc, struct intern const *paths, FILE *fp)
+{
+	// headers are ranked by the parse time they cost over every source which
+	// includes them, or by what changing them costs without traces.
+	struct row *rows = malloc(sizeof(struct row) * (hc->hdrs.size + 1));
+	for (size_t i = 0; i < hc->hdrs.size; ++i)
+	{
+		size_t hdr = hc->hdrs.data[i];
+		rows[i] = (struct row)
+		{
+			.hdr = hdr,
+			.score = hc->have_traces ? hc->tus[hdr] * mean_parse(hc, hdr)
+			         : hc->have_hist ? hc->rebuild[hdr]
+			         : hc->tus[hdr],
+		};
+	}
+
+	qsort(rows, hc->hdrs.size, sizeof(struct row), row_cmp);
+
+	fprintf(fp, "header costs over %zu source(s), ranked by %s:\n", hc->nsrcs,
+	        hc->have_traces ? "fan-in times parse time"
+	        : hc->have_hist ? "rebuild time" : "fan-in");
+	fprintf(fp, "\t%6s %6s %10s %10s %10s  %s\n", "fan-in", "direct",
+	        "rebuild s", "parse ms", "score ms", "header");
+	
+	for (size_t i = 0; i < hc->hdrs.size; ++i)
+	{
+		size_t hdr = rows[i].hdr;
+		fprintf(fp, "\t%6zu %6zu %10.3f %10.3f %10.3f  %s\n", hc->tus[hdr],
+		        hc->direct[hdr], hc->rebuild[hdr], 1e3 * hc->parse[hdr],
+		        1e3 * hc->tus[hdr] * mean_parse(hc, hdr),
+		        intern_str(paths, hdr));
+	}
+
+	if (!hc->have_traces)
+	{
+		fputs("no compiler time traces found, add -ftime-trace to the flags of "
+		      "a compiler which supports it and rebuild for parse times.\n", fp);
+	}
+
+	free(rows);
+}
+
+static void
+add_trace(struct hdrcost *hc, char const *conts, size_t *last_seen,
+          size_t trace)
+{
+	// the events are flat objects, with the file in their `args`, so each
+	// one is found from its name without parsing the whole trace.
+	char const *c = conts;
+	while ((c = strstr(c, TRACE_SOURCE)))
+	{
+		char const *start = c;
+		while (start > conts && *start != '{')
+			--start;
+		char const *end = event_end(start);
+		c += strlen(TRACE_SOURCE);
+
+		char const *dur = strstr(start, TRACE_DUR);
+		char const *detail = strstr(start, TRACE_DETAIL);
+		if (!dur || !detail || dur > end || detail > end)
+			continue;
+
+		detail += strlen(TRACE_DETAIL);
+		char const *detail_end = strchr(detail, '"');
+		char *path = strndup(detail, detail_end - detail);
+		char *real = realpath(path, NULL);
+		free(path);
+
+		size_t hdr;
+		if (real && str_map_get(&hc->real, real, &hdr))
+		{
+			hc->have_traces = true;
+			hc->parse[hdr] += strtod(dur + strlen(TRACE_DUR), NULL) / 1e6;
+			if (last_seen[hdr] != trace)
+			{
+				last_seen[hdr] = trace;
+				++hc->parse_tus[hdr];
+			}
+		}
+
+		free(real);
+	}
+}
+
+static char const *
+event_end(char const *start)
+{
+	int depth = 0;
+	bool in_str = false;
+	for (char const *c = start; *c; ++c)
+	{
+		if (in_str)
+		{
+			if (*c == '\\' && c[1])
+				++c;
+			else if (*c == '"')
+				in_str = false;
+		}
+		else if (*c == '"')
+			in_str = true;
+		else if (*c == '{')
+			++depth;
+		else if (*c == '}' && !--depth)
+			return c;
+	}
+
+	return start + strlen(start);
+}
+
+static double
+mean_parse(struct hdrcost const *hc, size_t hdr)
+{
+	return hc->parse_tus[hdr] ? hc->parse[hdr] / hc->parse_tus[hdr] : 0.0;
+}
+
+static int
+row_cmp(void const *lhs, void const *rhs)
+{
+	struct row const *l = lhs, *r = rhs;
+	if (l->score != r->score)
+		return l->score < r->score ? 1 : -1;
+	return l->hdr < r->hdr ? -1 : l->hdr > r->hdr;
+}
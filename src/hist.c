@@ -0,0 +1,491 @@
+#include "hist.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HIST_MAGIC "mincbuild-hist 2"
+
+// changes in compile time smaller than this are noise, whatever the ratio.
+#define COMPARE_MIN_DELTA 0.01
+
+// the build log starts with the number of builds it holds, of a fixed width
+// so that it can be updated in place.
+#define LOG_COUNT_FMT "n %010zu\n"
+#define LOG_COUNT_LEN 13
+
+struct log_build
+{
+	char *id;
+	size_t first_rec, nrecs;
+};
+
+struct log
+{
+	struct log_build *builds;
+	size_t nbuilds, builds_cap;
+	struct hist_rec *recs;
+	size_t nrecs, recs_cap;
+	struct arena arena;
+};
+
+static struct log log_read(FILE *fp);
+static void log_destroy(struct log *log);
+static size_t log_cut(FILE *fp, size_t keep, struct string *out_kept);
+static bool log_count(FILE *fp, size_t *out_nbuilds);
+static bool ck_build_line(struct string const *buf, size_t off);
+static bool ck_regress(double old, double new, double threshold, double min_delta);
+
+struct hist
+hist_load(char const *file)
+{
+	struct hist h =
+	{
+		.data = malloc(sizeof(struct hist_rec)),
+		.size = 0,
+		.cap = 1,
+		.ids = str_map_create(),
+	};
+
+	FILE *fp = fopen(file, "rb");
+	if (!fp)
+		return h;
+
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t line_len = getline(&line, &line_cap, fp);
+	if (line_len <= 0 || strncmp(line, HIST_MAGIC "\n", line_len))
+	{
+		free(line);
+		fclose(fp);
+		return h;
+	}
+
+	// like the directory snapshot, a damaged history only costs accuracy, so
+	// anything unreadable is skipped.
+	while ((line_len = getline(&line, &line_cap, fp)) > 0)
+	{
+		if (line[line_len - 1] == '\n')
+			line[--line_len] = 0;
+
+		struct hist_rec rec;
+		int name_off;
+		if (sscanf(line, "%zu %zu %lf %lf %n", &rec.peak_rss, &rec.size,
+		           &rec.duration, &rec.cpu_time, &name_off) != 4
+		    || !line[name_off])
+		{
+			continue;
+		}
+
+		rec.name = line + name_off;
+		hist_put(&h, &rec);
+	}
+
+	free(line);
+	fclose(fp);
+	return h;
+}
+
+void
+hist_save(struct hist const *h, char const *file)
+{
+	char *tmp_file = malloc(strlen(file) + 5);
+	sprintf(tmp_file, "%s.tmp", file);
+	mkdir_recursive(tmp_file);
+
+	FILE *fp = fopen(tmp_file, "wb");
+	if (!fp)
+	{
+		fprintf(stderr, "cannot write job history: '%s'\n", tmp_file);
+		free(tmp_file);
+		return;
+	}
+
+	fputs(HIST_MAGIC "\n", fp);
+	for (size_t i = 0; i < h->size; ++i)
+	{
+		fprintf(fp, "%zu %zu %.6f %.6f %s\n", h->data[i].peak_rss,
+		        h->data[i].size, h->data[i].duration, h->data[i].cpu_time,
+		        h->data[i].name);
+	}
+
+	if (fclose(fp) || rename(tmp_file, file))
+	{
+		fprintf(stderr, "cannot write job history: '%s'\n", file);
+		remove(tmp_file);
+	}
+
+	free(tmp_file);
+}
+
+void
+hist_destroy(struct hist *h)
+{
+	free(h->data);
+	str_map_destroy(&h->ids);
+}
+
+struct hist_rec const *
+hist_find(struct hist const *h, char const *name)
+{
+	size_t ind;
+	return str_map_get(&h->ids, name, &ind) ? &h->data[ind] : NULL;
+}
+
+void
+hist_put(struct hist *h, struct hist_rec const *rec)
+{
+	size_t ind;
+	if (str_map_get(&h->ids, rec->name, &ind))
+	{
+		char const *name = h->data[ind].name;
+		h->data[ind] = *rec;
+		h->data[ind].name = name;
+		return;
+	}
+
+	if (h->size >= h->cap)
+	{
+		h->cap *= 2;
+		h->data = realloc(h->data, sizeof(struct hist_rec) * h->cap);
+	}
+
+	// names are owned by the map.
+	h->data[h->size] = *rec;
+	h->data[h->size].name = str_map_put(&h->ids, rec->name, h->size);
+	++h->size;
+}
+
+size_t
+hist_mean_rss(struct hist const *h)
+{
+	if (!h->size)
+		return 0;
+
+	size_t total = 0;
+	for (size_t i = 0; i < h->size; ++i)
+		total += h->data[i].peak_rss;
+
+	return total / h->size;
+}
+
+void
+hist_log_append(char const *file, size_t keep, struct timespec const *when,
+                double wall, bool success, struct hist_rec const *recs,
+                size_t nrecs)
+{
+	// a build is appended as one block in a single write, so that the log
+	// stays readable even if a build is killed while writing it. builds are
+	// identified by their start time.
+	struct string block = string_create();
+	char buf[128];
+	sprintf(buf, "b %lld.%06ld %.6f %zu %d\n", (long long)when->tv_sec,
+	        when->tv_nsec / 1000, wall, nrecs, success);
+	string_push_str(&block, buf);
+
+	for (size_t i = 0; i < nrecs; ++i)
+	{
+		sprintf(buf, "j %.6f %.6f %zu %zu ", recs[i].duration,
+		        recs[i].cpu_time, recs[i].peak_rss, recs[i].size);
+		string_push_str(&block, buf);
+		string_push_str(&block, recs[i].name);
+		string_push_ch(&block, '\n');
+	}
+
+	// the log is appended to without reading it, until it holds a quarter
+	// more than `keep` builds. the oldest ones are then dropped all at once
+	// by writing the others and the new one to a new log in its place, as
+	// are logs which lack their count.
+	mkdir_recursive(file);
+	FILE *fp = fopen(file, "r+b");
+	size_t nbuilds;
+	if (fp && log_count(fp, &nbuilds) && (!keep || nbuilds <= keep + keep / 4))
+	{
+		char head[LOG_COUNT_LEN + 1];
+		sprintf(head, LOG_COUNT_FMT, nbuilds + 1);
+		if (fseek(fp, 0, SEEK_END)
+		    || fwrite(block.str, 1, block.len, fp) != block.len
+		    || fseek(fp, 0, SEEK_SET)
+		    || fwrite(head, 1, LOG_COUNT_LEN, fp) != LOG_COUNT_LEN)
+		{
+			fprintf(stderr, "cannot append to build log: '%s'\n", file);
+		}
+		fclose(fp);
+	}
+	else
+	{
+		struct string kept = string_create();
+		nbuilds = 0;
+		if (fp)
+		{
+			nbuilds = log_cut(fp, keep ? keep - 1 : SIZE_MAX, &kept);
+			fclose(fp);
+		}
+
+		char *tmp_file = malloc(strlen(file) + 5);
+		sprintf(tmp_file, "%s.tmp", file);
+
+		fp = fopen(tmp_file, "wb");
+		if (!fp || fprintf(fp, LOG_COUNT_FMT, nbuilds + 1) != LOG_COUNT_LEN
+		    || fwrite(kept.str, 1, kept.len, fp) != kept.len
+		    || fwrite(block.str, 1, block.len, fp) != block.len || fclose(fp)
+		    || rename(tmp_file, file))
+		{
+			fprintf(stderr, "cannot write build log: '%s'\n", file);
+			remove(tmp_file);
+		}
+
+		free(tmp_file);
+		string_destroy(&kept);
+	}
+
+	string_destroy(&block);
+}
+
+bool
+hist_log_compare(char const *file, char const *base, double threshold,
+                 FILE *out_fp, bool *out_regressed)
+{
+	FILE *fp = fopen(file, "rb");
+	if (!fp)
+	{
+		fprintf(stderr, "no build log to compare: '%s'!\n", file);
+		return false;
+	}
+
+	struct log log = log_read(fp);
+	fclose(fp);
+
+	// builds which had nothing to do are not worth comparing.
+	size_t latest = log.nbuilds;
+	while (latest > 0 && !log.builds[latest - 1].nrecs)
+		--latest;
+	
+	if (latest < 2)
+	{
+		fputs("build log holds fewer than two builds to compare!\n", stderr);
+		log_destroy(&log);
+		return false;
+	}
+	--latest;
+
+	// by default the latest build is compared against everything before it,
+	// otherwise only against the builds up to and including `base`.
+	size_t base_end = latest;
+	if (base)
+	{
+		for (base_end = 0; base_end < latest; ++base_end)
+		{
+			if (!strcmp(log.builds[base_end].id, base))
+				break;
+		}
+
+		if (base_end == latest)
+		{
+			fprintf(stderr, "no such earlier build in log: '%s'!\n", base);
+			log_destroy(&log);
+			return false;
+		}
+		++base_end;
+	}
+
+	// incremental builds only compile part of the project, so every object's
+	// baseline is the last time it was built at all.
+	struct str_map last = str_map_create();
+	for (size_t i = 0; i < base_end; ++i)
+	{
+		struct log_build const *b = &log.builds[i];
+		for (size_t j = b->first_rec; j < b->first_rec + b->nrecs; ++j)
+			str_map_put(&last, log.recs[j].name, j);
+	}
+
+	fprintf(out_fp, "comparing build %s against %s\n", log.builds[latest].id,
+	        base ? base : "all earlier builds");
+
+	size_t nregress = 0;
+	struct log_build const *b = &log.builds[latest];
+	for (size_t i = b->first_rec; i < b->first_rec + b->nrecs; ++i)
+	{
+		struct hist_rec const *cur = &log.recs[i];
+		size_t old_ind;
+		if (!str_map_get(&last, cur->name, &old_ind))
+			continue;
+		struct hist_rec const *old = &log.recs[old_ind];
+
+		bool time_regress = ck_regress(old->duration, cur->duration, threshold,
+		                               COMPARE_MIN_DELTA);
+		bool size_regress = ck_regress(old->size, cur->size, threshold, 0.0);
+		
+		if (time_regress)
+		{
+			fprintf(out_fp, "\t%+7.1f%% time  %.3fs -> %.3fs\t%s\n",
+			        100.0 * (cur->duration - old->duration) / old->duration,
+			        old->duration, cur->duration, cur->name);
+		}
+
+		if (size_regress)
+		{
+			fprintf(out_fp, "\t%+7.1f%% size  %zu -> %zu\t%s\n",
+			        100.0 * ((double)cur->size - old->size) / old->size,
+			        old->size, cur->size, cur->name);
+		}
+
+		nregress += time_regress || size_regress;
+	}
+
+	fprintf(out_fp, "%zu job(s) regressed by more than %.1f%%\n", nregress,
+	        threshold);
+
+	str_map_destroy(&last);
+	log_destroy(&log);
+	*out_regressed = nregress > 0;
+	return true;
+}
+
+static struct log
+log_read(FILE *fp)
+{
+	struct log log =
+	{
+		.builds = malloc(sizeof(struct log_build)),
+		.nbuilds = 0,
+		.builds_cap = 1,
+		.recs = malloc(sizeof(struct hist_rec)),
+		.nrecs = 0,
+		.recs_cap = 1,
+		.arena = arena_create(),
+	};
+
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t line_len;
+	size_t expect = 0;
+	while ((line_len = getline(&line, &line_cap, fp)) > 0)
+	{
+		if (line[line_len - 1] == '\n')
+			line[--line_len] = 0;
+
+		int id_end = 0;
+		if (line[0] == 'b' && (sscanf(line, "b %*s%n", &id_end), id_end))
+		{
+			// a build whose block was cut short is dropped entirely.
+			if (expect && log.nbuilds)
+			{
+				log.nrecs = log.builds[--log.nbuilds].first_rec;
+			}
+			
+			double wall;
+			int success;
+			if (sscanf(line + id_end, " %lf %zu %d", &wall, &expect, &success) != 3)
+			{
+				expect = 0;
+				continue;
+			}
+
+			if (log.nbuilds >= log.builds_cap)
+			{
+				log.builds_cap *= 2;
+				log.builds = realloc(log.builds, sizeof(struct log_build) * log.builds_cap);
+			}
+
+			log.builds[log.nbuilds++] = (struct log_build)
+			{
+				.id = arena_strndup(&log.arena, line + 2, id_end - 2),
+				.first_rec = log.nrecs,
+				.nrecs = 0,
+			};
+			continue;
+		}
+
+		struct hist_rec rec;
+		int name_off;
+		if (!expect
+		    || sscanf(line, "j %lf %lf %zu %zu %n", &rec.duration, &rec.cpu_time,
+		              &rec.peak_rss, &rec.size, &name_off) != 4
+		    || !line[name_off])
+		{
+			continue;
+		}
+
+		rec.name = arena_strdup(&log.arena, line + name_off);
+		if (log.nrecs >= log.recs_cap)
+		{
+			log.recs_cap *= 2;
+			log.recs = realloc(log.recs, sizeof(struct hist_rec) * log.recs_cap);
+		}
+		log.recs[log.nrecs++] = rec;
+		++log.builds[log.nbuilds - 1].nrecs;
+		--expect;
+	}
+
+	if (expect && log.nbuilds)
+		log.nrecs = log.builds[--log.nbuilds].first_rec;
+
+	free(line);
+	return log;
+}
+
+static void
+log_destroy(struct log *log)
+{
+	free(log->builds);
+	free(log->recs);
+	arena_destroy(&log->arena);
+}
+
+static size_t
+log_cut(FILE *fp, size_t keep, struct string *out_kept)
+{
+	// only the lines starting builds are looked at, and everything from the
+	// `keep`-th build before the end on is kept, without the count heading
+	// the log. returns how many builds were kept.
+	struct string buf = string_create();
+	char chunk[65536];
+	size_t len;
+	rewind(fp);
+	while ((len = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+		string_push_buf(&buf, chunk, len);
+
+	size_t nbuilds = 0;
+	for (size_t i = 0; i < buf.len; ++i)
+		nbuilds += ck_build_line(&buf, i);
+
+	size_t ncut = nbuilds > keep ? nbuilds - keep : 0;
+	size_t start = buf.len, nseen = 0;
+	for (size_t i = 0; i < buf.len; ++i)
+	{
+		if (ck_build_line(&buf, i) && nseen++ == ncut)
+		{
+			start = i;
+			break;
+		}
+	}
+
+	string_push_buf(out_kept, buf.str + start, buf.len - start);
+	string_destroy(&buf);
+	return nbuilds - ncut;
+}
+
+static bool
+log_count(FILE *fp, size_t *out_nbuilds)
+{
+	char head[LOG_COUNT_LEN + 1] = {0};
+	return fread(head, 1, LOG_COUNT_LEN, fp) == LOG_COUNT_LEN
+	       && head[LOG_COUNT_LEN - 1] == '\n'
+	       && sscanf(head, "n %zu", out_nbuilds) == 1;
+}
+
+static bool
+ck_build_line(struct string const *buf, size_t off)
+{
+	return (!off || buf->str[off - 1] == '\n') && off + 1 < buf->len
+	       && buf->str[off] == 'b' && buf->str[off + 1] == ' ';
+}
+
+static bool
+ck_regress(double old, double new, double threshold, double min_delta)
+{
+	return old > 0.0 && new - old > min_delta
+	       && 100.0 * (new - old) / old > threshold;
+}
@@ -4,38 +4,170 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include <fts.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-#include "util.h"
+#define LTO_CACHE_DIR "lto-cache"
 
 struct fmt_data
 {
 	struct conf const *conf;
 	struct str_list const *objs;
+	char const *out, *rsp;
 };
 
-extern bool flag_v;
+struct link_ctx
+{
+	struct conf const *conf;
+	struct str_list objs;
+	char const *out_tmp;
+};
 
+struct cache_ent
+{
+	char *path;
+	off_t size;
+	time_t used;
+};
+
+static char *lto_cache_dir(struct conf const *conf);
+static int cache_ent_cmp(void const *lhs, void const *rhs);
+static char *mk_cmd(void *vp_ctx);
+static void ctx_destroy(void *vp_ctx);
 static void fmt_command(struct string *out_cmd, void *vp_data);
 static void fmt_ldflags(struct string *out_cmd, void *vp_data);
+static void lto_fmt_jobs(struct string *out_cmd, void *vp_conf);
+static void lto_fmt_cache(struct string *out_cmd, void *vp_conf);
 static void obj_fmt_object(struct string *out_cmd, void *vp_data);
 static void fmt_objects(struct string *out_cmd, void *vp_data);
+static void rsp_fmt_file(struct string *out_cmd, void *vp_data);
 static void fmt_output(struct string *out_cmd, void *vp_data);
 static void lib_fmt_library(struct string *out_cmd, void *vp_data);
 static void fmt_libraries(struct string *out_cmd, void *vp_data);
 
+size_t
+link_schedule(struct graph *graph, struct conf const *conf,
+              struct str_list const *objs, struct str_list const *dep_outs)
+{
+	// the objects of the target's own sources, including those omitted
+	// during compilation, followed by the outputs of targets it depends on.
+	// other objects under `lib_dir`, e.g. of other profiles, are not part of
+	// the target.
+	struct link_ctx *ctx = malloc(sizeof(struct link_ctx));
+	ctx->conf = conf;
+	ctx->objs = str_list_copy(objs);
+	for (size_t i = 0; i < dep_outs->size; ++i)
+		str_list_add(&ctx->objs, dep_outs->data[i]);
+	graph_own(graph, ctx, ctx_destroy);
+
+	char *err = malloc(strlen(conf->output) + 21);
+	sprintf(err, "linking failed: '%s'!", conf->output);
+
+	// like objects, the output only replaces the previous one once it has
+	// been written completely.
+	char *out_tmp = malloc(strlen(conf->output) + 5);
+	sprintf(out_tmp, "%s.tmp", conf->output);
+	ctx->out_tmp = out_tmp;
+
+	struct job job =
+	{
+		.mk_cmd = mk_cmd,
+		.ctx = ctx,
+		.name = strdup(conf->output),
+		.err = err,
+		.out = strdup(conf->output),
+		.out_tmp = out_tmp,
+		.success_rc = conf->ld_success_rc,
+		.counted = false,
+		.threads = conf->lto ? graph_slots() : 0,
+	};
+
+	return graph_add(graph, &job);
+}
+
 void
-link_objs(struct conf const *conf)
+link_prune_cache(struct conf const *conf)
 {
-	puts("linking project");
-	
-	// get all project object files, including those omitted during
-	// compilation.
-	struct str_list obj_exts = str_list_create();
-	str_list_add(&obj_exts, "o");
-	struct str_list objs = ext_find(conf->lib_dir, &obj_exts);
-	str_list_destroy(&obj_exts);
+	if (!conf->lto || !conf->lto_cache_size)
+		return;
+
+	char *dir = lto_cache_dir(conf);
+	char *const fts_dirs[] = {dir, NULL};
+	FTS *fts_p = fts_open(fts_dirs, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+	if (!fts_p)
+	{
+		free(dir);
+		return;
+	}
+
+	struct cache_ent *ents = malloc(sizeof(struct cache_ent));
+	size_t nents = 0, ents_cap = 1;
+	off_t total = 0;
+
+	FTSENT *fts_ent;
+	while ((fts_ent = fts_read(fts_p)))
+	{
+		if (fts_ent->fts_info != FTS_F)
+			continue;
+
+		if (nents >= ents_cap)
+		{
+			ents_cap *= 2;
+			ents = realloc(ents, sizeof(struct cache_ent) * ents_cap);
+		}
+
+		struct stat const *s = fts_ent->fts_statp;
+		ents[nents++] = (struct cache_ent)
+		{
+			.path = strdup(fts_ent->fts_path),
+			.size = s->st_size,
+			.used = s->st_atime > s->st_mtime ? s->st_atime : s->st_mtime,
+		};
+		total += s->st_size;
+	}
+	fts_close(fts_p);
+
+	// the entries used longest ago go first, until the cache fits again.
+	qsort(ents, nents, sizeof(struct cache_ent), cache_ent_cmp);
+	off_t limit = (off_t)conf->lto_cache_size * 1024 * 1024;
+	for (size_t i = 0; i < nents && total > limit; ++i)
+	{
+		if (!unlink(ents[i].path))
+			total -= ents[i].size;
+	}
+
+	for (size_t i = 0; i < nents; ++i)
+		free(ents[i].path);
+	free(ents);
+	free(dir);
+}
+
+static char *
+lto_cache_dir(struct conf const *conf)
+{
+	// the cache is kept per target, as it is only of use to the same link.
+	char *dir = malloc(strlen(conf->lib_dir) + strlen(LTO_CACHE_DIR) + 2);
+	sprintf(dir, "%s/%s", conf->lib_dir, LTO_CACHE_DIR);
+	return dir;
+}
+
+static int
+cache_ent_cmp(void const *lhs, void const *rhs)
+{
+	time_t lused = ((struct cache_ent const *)lhs)->used;
+	time_t rused = ((struct cache_ent const *)rhs)->used;
+	return lused < rused ? -1 : lused > rused ? 1 : 0;
+}
+
+static char *
+mk_cmd(void *vp_ctx)
+{
+	struct link_ctx const *ctx = vp_ctx;
+	struct conf const *conf = ctx->conf;
 	
 	struct fmt_spec spec = fmt_spec_create();
 	fmt_spec_add_ent(&spec, 'c', fmt_command);
@@ -47,38 +179,64 @@ link_objs(struct conf const *conf)
 	struct fmt_data data =
 	{
 		.conf = conf,
-		.objs = &objs,
+		.objs = &ctx->objs,
+		.out = ctx->out_tmp,
+		.rsp = NULL,
 	};
 
 	mkdir_recursive(conf->output);
 	rmdir(conf->output);
 
+	if (conf->lto)
+	{
+		char *cache_dir = lto_cache_dir(conf);
+		mkdir_recursive(cache_dir);
+		mkdir(cache_dir, S_IRWXU | S_IRWXG | S_IRWXO);
+		free(cache_dir);
+	}
+
 	char *cmd = fmt_str(&spec, conf->ld_cmd_fmt, &data);
-	fmt_spec_destroy(&spec);
-	str_list_destroy(&objs);
 
-	if (flag_v)
-		printf("(+)\t%s\t<- %s\n", conf->output, cmd);
-	else
-		printf("(+)\t%s\n", conf->output);
-	
-	int rc = system(cmd);
-	free(cmd);
-	
-	if (rc != conf->ld_success_rc)
+	// with too many objects for one command line, they are handed to the
+	// linker through a response file instead.
+	char *rsp = NULL;
+	if (conf->ld_rsp_fmt && strlen(cmd) > conf->rsp_threshold)
 	{
-		fputs("linking failed!\n", stderr);
-		exit(1);
+		struct string rsp_conts = string_create();
+		fmt_objects(&rsp_conts, &data);
+		string_push_ch(&rsp_conts, '\n');
+
+		// if it cannot be written, the objects are still passed directly.
+		rsp = malloc(strlen(conf->lib_dir) + 10);
+		sprintf(rsp, "%s/link.rsp", conf->lib_dir);
+		if (write_file(rsp, rsp_conts.str, rsp_conts.len))
+		{
+			data.rsp = rsp;
+			free(cmd);
+			cmd = fmt_str(&spec, conf->ld_cmd_fmt, &data);
+		}
+		string_destroy(&rsp_conts);
 	}
+	
+	fmt_spec_destroy(&spec);
+	free(rsp);
+
+	return cmd;
+}
+
+static void
+ctx_destroy(void *vp_ctx)
+{
+	struct link_ctx *ctx = vp_ctx;
+	str_list_destroy(&ctx->objs);
+	free(ctx);
 }
 
 static void
 fmt_command(struct string *out_cmd, void *vp_data)
 {
 	struct fmt_data const *data = vp_data;
-	char *ld = sanitize_path(data->conf->ld);
-	string_push_str(out_cmd, ld);
-	free(ld);
+	sanitize_path_inplace(out_cmd, data->conf->ld);
 }
 
 static void
@@ -86,14 +244,40 @@ fmt_ldflags(struct string *out_cmd, void *vp_data)
 {
 	struct fmt_data const *data = vp_data;
 	string_push_str(out_cmd, data->conf->ldflags);
+	if (!data->conf->lto)
+		return;
+
+	struct fmt_spec spec = fmt_spec_create();
+	fmt_spec_add_ent(&spec, 'j', lto_fmt_jobs);
+	fmt_spec_add_ent(&spec, 'd', lto_fmt_cache);
+	string_push_ch(out_cmd, ' ');
+	fmt_inplace(out_cmd, &spec, data->conf->ld_lto_fmt, (void *)data->conf);
+	fmt_spec_destroy(&spec);
+}
+
+static void
+lto_fmt_jobs(struct string *out_cmd, void *vp_conf)
+{
+	// the link is scheduled as taking up this many slots, see
+	// `link_schedule()`.
+	(void)vp_conf;
+	char buf[24];
+	sprintf(buf, "%zu", graph_slots());
+	string_push_str(out_cmd, buf);
+}
+
+static void
+lto_fmt_cache(struct string *out_cmd, void *vp_conf)
+{
+	char *dir = lto_cache_dir(vp_conf);
+	sanitize_path_inplace(out_cmd, dir);
+	free(dir);
 }
 
 static void
 obj_fmt_object(struct string *out_cmd, void *vp_data)
 {
-	char *obj = sanitize_path(vp_data);
-	string_push_str(out_cmd, obj);
-	free(obj);
+	sanitize_path_inplace(out_cmd, vp_data);
 }
 
 static void
@@ -102,6 +286,14 @@ fmt_objects(struct string *out_cmd, void *vp_data)
 	struct fmt_data const *data = vp_data;
 
 	struct fmt_spec spec = fmt_spec_create();
+	if (data->rsp)
+	{
+		fmt_spec_add_ent(&spec, 'r', rsp_fmt_file);
+		fmt_inplace(out_cmd, &spec, data->conf->ld_rsp_fmt, (void *)data->rsp);
+		fmt_spec_destroy(&spec);
+		return;
+	}
+	
 	fmt_spec_add_ent(&spec, 'o', obj_fmt_object);
 	
 	for (size_t i = 0; i < data->objs->size; ++i)
@@ -116,13 +308,17 @@ fmt_objects(struct string *out_cmd, void *vp_data)
 	fmt_spec_destroy(&spec);
 }
 
+static void
+rsp_fmt_file(struct string *out_cmd, void *vp_data)
+{
+	sanitize_path_inplace(out_cmd, vp_data);
+}
+
 static void
 fmt_output(struct string *out_cmd, void *vp_data)
 {
 	struct fmt_data const *data = vp_data;
-	char *output = sanitize_path(data->conf->output);
-	string_push_str(out_cmd, output);
-	free(output);
+	sanitize_path_inplace(out_cmd, data->out);
 }
 
 static void
@@ -2,47 +2,175 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <getopt.h>
 #include <unistd.h>
 
-#include "compile.h"
+#include "build.h"
 #include "conf.h"
-#include "link.h"
-#include "prune.h"
+#include "hist.h"
+#include "rexec.h"
+#include "serve.h"
 
 #define DEFAULT_CONF "mincbuild.conf"
+#define LOG_FILE "mincbuild.log"
+#define DEFAULT_COMPARE_THRESHOLD 10.0
 
-bool flag_r = false, flag_v = false;
+enum long_opt
+{
+	LONG_OPT_JSON_EVENTS = 256,
+	LONG_OPT_THREADS,
+	LONG_OPT_STATS,
+	LONG_OPT_STATS_JSON,
+	LONG_OPT_COMPARE,
+	LONG_OPT_THRESHOLD,
+	LONG_OPT_WORKER,
+	LONG_OPT_SHARD,
+	LONG_OPT_LINK_ONLY,
+	LONG_OPT_SERVE,
+	LONG_OPT_HEADER_REPORT,
+	LONG_OPT_TEST,
+	LONG_OPT_SKIP_PASSED,
+	LONG_OPT_PGO,
+};
 
 static void usage(char const *name);
 
 int
 main(int argc, char const *argv[])
 {
+	struct option const long_opts[] =
+	{
+		{"json-events", required_argument, NULL, LONG_OPT_JSON_EVENTS},
+		{"threads", no_argument, NULL, LONG_OPT_THREADS},
+		{"stats", no_argument, NULL, LONG_OPT_STATS},
+		{"stats-json", required_argument, NULL, LONG_OPT_STATS_JSON},
+		{"compare", optional_argument, NULL, LONG_OPT_COMPARE},
+		{"threshold", required_argument, NULL, LONG_OPT_THRESHOLD},
+		{"worker", required_argument, NULL, LONG_OPT_WORKER},
+		{"shard", required_argument, NULL, LONG_OPT_SHARD},
+		{"link-only", no_argument, NULL, LONG_OPT_LINK_ONLY},
+		{"serve", required_argument, NULL, LONG_OPT_SERVE},
+		{"header-report", no_argument, NULL, LONG_OPT_HEADER_REPORT},
+		{"test", no_argument, NULL, LONG_OPT_TEST},
+		{"skip-passed", no_argument, NULL, LONG_OPT_SKIP_PASSED},
+		{"pgo", no_argument, NULL, LONG_OPT_PGO},
+		{NULL, 0, NULL, 0},
+	};
+
+	struct build_opts opts = {0};
+	bool flag_compare = false, flag_header_report = false;
+	char const *flag_p = NULL, *flag_compare_base = NULL, *flag_serve = NULL;
+	char const *flag_worker = NULL;
+	double flag_threshold = DEFAULT_COMPARE_THRESHOLD;
+
+	// remotely compiled jobs run this program again as their client, which
+	// is not meant to be invoked by hand.
+	if (argc == 10 && !strcmp(argv[1], "--rexec"))
+	{
+		return rexec_client(argv[2], argv[3], argv[4], argv[5], argv[6], argv[7],
+		                    argv[8], argv[9]);
+	}
+
+	// everything after the socket is handed to the build server as is.
+	if (argc >= 3 && !strcmp(argv[1], "--client"))
+		return serve_client(argv[2], argc - 3, argv + 3);
+	
 	int ch;
-	while ((ch = getopt(argc, (char *const *)argv, "hrv")) != -1)
+	while ((ch = getopt_long(argc, (char *const *)argv, "hkp:rv", long_opts, NULL)) != -1)
 	{
 		switch (ch)
 		{
 		case 'h':
 			usage(argv[0]);
 			return 0;
+		case 'k':
+			opts.graph.keep_going = true;
+			break;
+		case 'p':
+			flag_p = optarg;
+			break;
 		case 'r':
-			flag_r = true;
+			opts.force = true;
 			break;
 		case 'v':
-			flag_v = true;
+			opts.graph.verbose = true;
+			break;
+		case LONG_OPT_THREADS:
+			opts.graph.threads = true;
+			break;
+		case LONG_OPT_STATS:
+			opts.stats = true;
+			break;
+		case LONG_OPT_STATS_JSON:
+			opts.stats_json = optarg;
+			break;
+		case LONG_OPT_COMPARE:
+			flag_compare = true;
+			flag_compare_base = optarg;
+			break;
+		case LONG_OPT_THRESHOLD:
+			flag_threshold = atof(optarg);
+			break;
+		case LONG_OPT_WORKER:
+			flag_worker = optarg;
+			break;
+		case LONG_OPT_SHARD:
+		{
+			char trail;
+			if (sscanf(optarg, "%zu/%zu%c", &opts.shard, &opts.nshards, &trail) != 2
+			    || opts.shard < 1 || opts.shard > opts.nshards)
+			{
+				fprintf(stderr, "invalid shard, expected i/N: '%s'!\n", optarg);
+				return 1;
+			}
+			--opts.shard;
+			break;
+		}
+		case LONG_OPT_LINK_ONLY:
+			opts.link_only = true;
+			break;
+		case LONG_OPT_SERVE:
+			flag_serve = optarg;
+			break;
+		case LONG_OPT_HEADER_REPORT:
+			flag_header_report = true;
+			break;
+		case LONG_OPT_TEST:
+			opts.test = true;
+			break;
+		case LONG_OPT_SKIP_PASSED:
+			opts.test = opts.skip_passed = true;
+			break;
+		case LONG_OPT_PGO:
+			opts.pgo = true;
+			break;
+		case LONG_OPT_JSON_EVENTS:
+			if (opts.graph.events_fp && opts.graph.events_fp != stdout)
+				fclose(opts.graph.events_fp);
+			opts.graph.events_fp = strcmp(optarg, "-") ? fopen(optarg, "w") : stdout;
+			if (!opts.graph.events_fp)
+			{
+				fprintf(stderr, "failed to open event stream: '%s'!\n", optarg);
+				return 1;
+			}
 			break;
 		default:
 			return 1;
 		}
 	}
 
-	int first_arg = 1;
-	while (first_arg < argc
-	       && *argv[first_arg] == '-'
-	       && strcmp(argv[first_arg - 1], "--"))
+	int first_arg = optind;
+
+	if (opts.nshards && opts.link_only)
 	{
-		++first_arg;
+		fputs("--shard and --link-only cannot be combined!\n", stderr);
+		return 1;
+	}
+
+	if (opts.pgo && (opts.nshards || opts.link_only || flag_header_report))
+	{
+		fputs("--pgo cannot be combined with --shard, --link-only or --header-report!\n", stderr);
+		return 1;
 	}
 	
 	if (argc > first_arg + 1)
@@ -51,46 +179,42 @@ main(int argc, char const *argv[])
 		return 1;
 	}
 	
-	struct conf conf = conf_from_file(argc == first_arg + 1 ? argv[first_arg] : DEFAULT_CONF);
-	conf_apply_overrides(&conf);
-	conf_validate(&conf);
-	
-	struct str_list srcs = ext_find(conf.src_dir, &conf.src_exts);
+	char const *conf_file = argc == first_arg + 1 ? argv[first_arg] : DEFAULT_CONF;
 	
-	struct str_list hdrs;
-	if (!flag_r)
-		hdrs = ext_find(conf.inc_dir, &conf.hdr_exts);
-
-	struct str_list objs = str_list_create();
-	size_t src_dir_len = strlen(conf.src_dir);
-	size_t lib_dir_len = strlen(conf.lib_dir);
-	for (size_t i = 0; i < srcs.size; ++i)
+	if (flag_compare)
 	{
-		char const *src = srcs.data[i] + src_dir_len;
-		src += *src == '/';
-
-		char *obj = malloc(lib_dir_len + strlen(src) + 4);
-		sprintf(obj, "%s/%s.o", conf.lib_dir, src);
-		str_list_add(&objs, obj);
-		free(obj);
+		struct conf_set cs;
+		if (!conf_set_from_file(&cs, conf_file, flag_p))
+			return 1;
+		
+		char *log_file = malloc(strlen(cs.lib_dir) + strlen(LOG_FILE) + 2);
+		sprintf(log_file, "%s/%s", cs.lib_dir, LOG_FILE);
+		
+		bool regressed = false;
+		bool compared = hist_log_compare(log_file, flag_compare_base, flag_threshold, stdout, &regressed);
+		free(log_file);
+		conf_set_destroy(&cs);
+		return !compared || regressed;
 	}
 
-	if (!flag_r)
-	{
-		prune(&conf, &srcs, &objs, &hdrs);
-		str_list_destroy(&hdrs);
-	}
+	if (flag_worker)
+		return rexec_worker(flag_worker, conf_file, flag_p);
 	
-	compile(&conf, &srcs, &objs);
-	str_list_destroy(&srcs);
-	str_list_destroy(&objs);
+	if (flag_serve)
+		return serve(flag_serve, conf_file, flag_p, &opts);
 
-	if (conf.produce_output)
-		link_objs(&conf);
+	struct build b;
+	int err = build_create(&b, conf_file, flag_p, false);
+	if (!err)
+	{
+		err = flag_header_report ? build_header_report(&b, stdout) : build_run(&b, &opts);
+		build_destroy(&b);
+	}
 
-	conf_destroy(&conf);
+	if (opts.graph.events_fp && opts.graph.events_fp != stdout)
+		fclose(opts.graph.events_fp);
 	
-	return 0;
+	return err;
 }
 
 static void
@@ -99,7 +223,47 @@ usage(char const *name)
 	printf("usage:\n"
 	       "\t%s [options] [build config]\n"
 	       "options:\n"
-	       "\t-h  display this menu\n"
-	       "\t-r  force rebuild by skipping pruning phase of build\n"
-	       "\t-v  write verbose build information\n", name);
+	       "\t-h       display this menu\n"
+	       "\t-k       keep building what does not depend on a failed job\n"
+	       "\t-p name  build using the named profile from the config\n"
+	       "\t-r       force rebuild by skipping pruning phase of build\n"
+	       "\t-v       write verbose build information\n"
+	       "\t--json-events file\n"
+	       "\t         write job events as JSON lines to file (- for stdout)\n"
+	       "\t--compare[=build]\n"
+	       "\t         list jobs of the latest build which got slower or larger\n"
+	       "\t         than in earlier builds, or than in the given build\n"
+	       "\t--threshold percent\n"
+	       "\t         regression threshold for --compare (default 10)\n"
+	       "\t--header-report\n"
+	       "\t         rank headers by how many sources include them and what\n"
+	       "\t         they cost to parse and to change, instead of building\n"
+	       "\t--test   run the tests from the config once the build succeeded\n"
+	       "\t--skip-passed\n"
+	       "\t         run the tests, except those which passed before and\n"
+	       "\t         whose programs and commands did not change since\n"
+	       "\t--pgo    build instrumented, run the training command from the\n"
+	       "\t         config and build again using the profiles it wrote\n"
+	       "\t--stats  print counters and timings for each phase of the build\n"
+	       "\t--stats-json file\n"
+	       "\t         write the same statistics as JSON to file (- for stdout)\n"
+	       "\t--worker [host:]port\n"
+	       "\t         serve remote compiles for builds knowing the secret from\n"
+	       "\t         the config, on localhost unless a host is given\n"
+	       "\t--shard i/N\n"
+	       "\t         only compile the i-th of N balanced parts of what is out of\n"
+	       "\t         date, without linking\n"
+	       "\t--link-only\n"
+	       "\t         link the objects gathered from all shards without compiling\n"
+	       "\t--serve socket\n"
+	       "\t         keep the build loaded and run builds requested through the\n"
+	       "\t         unix socket\n"
+	       "\t--client socket [options]\n"
+	       "\t         run a build on the server at the unix socket, with -k, -r,\n"
+	       "\t         -v, --stats, --test, --skip-passed and --threads passed\n"
+	       "\t         along\n"
+	       "\t--threads\n"
+	       "\t         wait on jobs from a pool of threads instead of one event\n"
+	       "\t         loop\n",
+	       name);
 }
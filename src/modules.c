@@ -0,0 +1,581 @@
+#include "modules.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compile.h"
+
+#define MAP_FILE "modules.map"
+
+enum mark
+{
+	MARK_NONE = 0,
+	MARK_ACTIVE,
+	MARK_DONE,
+};
+
+struct scan_ctx
+{
+	struct conf const *conf;
+	char const *src, *ddi_tmp;
+};
+
+static bool scan_all(struct conf_set const *cs, struct intern const *paths, struct id_list const *srcs, struct id_list const *objs, struct bitset const *up_to_date, struct graph_opts const *opts, struct str_list *out_ddis);
+static char *scan_mk_cmd(void *vp_ctx);
+static bool read_p1689(char const *ddi, char const *src, struct mod_src *out_ms);
+static void scan_light(char const *src, struct mod_src *out_ms);
+static struct str_list json_names(char const *conts, char const *key);
+static char const *parse_name(char const *c, struct string *out_name);
+static bool visit(struct modules *m, struct id_list const *srcs, struct bitset *up_to_date, size_t prov);
+static void collect(struct modules const *m, size_t prov, bool *seen, struct id_list *out_provs);
+static char *mk_flags(struct modules const *m, struct conf const *conf, struct mod_src const *ms);
+static void fmt_module(struct string *out_str, void *vp_prov);
+static void fmt_bmi(struct string *out_str, void *vp_prov);
+
+bool
+modules_create(struct modules *out_m, struct conf_set const *cs,
+               struct intern const *paths, struct id_list const *srcs,
+               struct id_list const *objs, struct bitset const *up_to_date,
+               struct graph_opts const *opts)
+{
+	*out_m = (struct modules)
+	{
+		.srcs = calloc(cs->size, sizeof(struct mod_src *)),
+		.flags = calloc(cs->size, sizeof(char **)),
+		.nsrcs = calloc(cs->size, sizeof(size_t)),
+		.ntargets = cs->size,
+		.provs = NULL,
+		.nprovs = 0,
+		.provs_cap = 0,
+		.names = str_map_create(),
+	};
+
+	// the compiler's dependency output of every source is brought up to date
+	// first, by scans running in parallel.
+	struct str_list *ddis = calloc(cs->size, sizeof(struct str_list));
+	bool ok = scan_all(cs, paths, srcs, objs, up_to_date, opts, ddis);
+
+	for (size_t i = 0; i < cs->size && ok; ++i)
+	{
+		struct conf const *conf = &cs->data[i];
+		if (!conf->modules)
+			continue;
+
+		out_m->srcs[i] = calloc(srcs[i].size + 1, sizeof(struct mod_src));
+		out_m->flags[i] = calloc(srcs[i].size + 1, sizeof(char *));
+		for (size_t j = 0; j < srcs[i].size && ok; ++j)
+		{
+			struct mod_src *ms = &out_m->srcs[i][j];
+			char const *src = intern_str(paths, srcs[i].data[j]);
+			ms->requires = str_list_create();
+			++out_m->nsrcs[i];
+			
+			if (conf->cc_p1689_fmt)
+				ok = read_p1689(ddis[i].data[j], src, ms);
+			else
+				scan_light(src, ms);
+
+			if (!ok || !ms->provides)
+				continue;
+
+			size_t prev;
+			if (str_map_get(&out_m->names, ms->provides, &prev))
+			{
+				struct mod_prov const *p = &out_m->provs[prev];
+				fprintf(stderr, "module '%s' provided by both '%s' and '%s'!\n",
+				        ms->provides, intern_str(paths, srcs[p->target].data[p->src]),
+				        src);
+				ok = false;
+				continue;
+			}
+
+			if (out_m->nprovs >= out_m->provs_cap)
+			{
+				out_m->provs_cap = out_m->provs_cap ? 2 * out_m->provs_cap : 8;
+				out_m->provs = realloc(out_m->provs, sizeof(struct mod_prov) * out_m->provs_cap);
+			}
+
+			// interfaces are compiled into the target's own object directory,
+			// where nothing else is looking for them.
+			char *bmi = malloc(strlen(conf->lib_dir) + strlen(ms->provides) + 6);
+			sprintf(bmi, "%s/%s.bmi", conf->lib_dir, ms->provides);
+			for (char *c = bmi + strlen(conf->lib_dir); *c; ++c)
+				*c = *c == ':' ? '-' : *c;
+
+			out_m->provs[out_m->nprovs] = (struct mod_prov)
+			{
+				.target = i,
+				.src = j,
+				.name = ms->provides,
+				.bmi = bmi,
+				.mark = MARK_NONE,
+				.dirty = false,
+			};
+			str_map_put(&out_m->names, ms->provides, out_m->nprovs++);
+		}
+	}
+
+	for (size_t i = 0; i < cs->size; ++i)
+		str_list_destroy(&ddis[i]);
+	free(ddis);
+
+	return ok;
+}
+
+void
+modules_destroy(struct modules *m)
+{
+	for (size_t i = 0; i < m->ntargets; ++i)
+	{
+		for (size_t j = 0; j < m->nsrcs[i]; ++j)
+		{
+			free(m->srcs[i][j].provides);
+			str_list_destroy(&m->srcs[i][j].requires);
+			free(m->flags[i][j]);
+		}
+		
+		free(m->srcs[i]);
+		free(m->flags[i]);
+	}
+
+	for (size_t i = 0; i < m->nprovs; ++i)
+		free(m->provs[i].bmi);
+
+	free(m->srcs);
+	free(m->flags);
+	free(m->nsrcs);
+	free(m->provs);
+	str_map_destroy(&m->names);
+}
+
+bool
+modules_plan(struct modules *m, struct conf_set const *cs,
+             struct id_list const *srcs, struct bitset *up_to_date)
+{
+	// an interface has to be compiled again when it or anything it imports
+	// changed, and so does everything importing it.
+	for (size_t i = 0; i < m->nprovs; ++i)
+	{
+		if (!visit(m, srcs, up_to_date, i))
+			return false;
+	}
+
+	struct string map = string_create();
+	for (size_t i = 0; i < m->nprovs; ++i)
+	{
+		string_push_str(&map, m->provs[i].name);
+		string_push_ch(&map, ' ');
+		string_push_str(&map, m->provs[i].bmi);
+		string_push_ch(&map, '\n');
+	}
+
+	for (size_t i = 0; i < m->ntargets; ++i)
+	{
+		for (size_t j = 0; j < m->nsrcs[i]; ++j)
+		{
+			struct mod_src const *ms = &m->srcs[i][j];
+			for (size_t k = 0; k < ms->requires.size; ++k)
+			{
+				size_t prov;
+				if (str_map_get(&m->names, ms->requires.data[k], &prov)
+				    && m->provs[prov].dirty)
+				{
+					bitset_clr(&up_to_date[i], srcs[i].data[j]);
+				}
+			}
+
+			m->flags[i][j] = mk_flags(m, &cs->data[i], ms);
+		}
+	}
+
+	// toolchains which look up interfaces through a mapper, like GCC with
+	// `-fmodule-mapper`, find every one of them in one file.
+	bool ok = true;
+	if (m->nprovs)
+	{
+		char *map_file = malloc(strlen(cs->lib_dir) + strlen(MAP_FILE) + 2);
+		sprintf(map_file, "%s/%s", cs->lib_dir, MAP_FILE);
+		ok = write_file(map_file, map.str, map.len);
+		free(map_file);
+	}
+
+	string_destroy(&map);
+	return ok;
+}
+
+void
+modules_deps(struct modules const *m, struct graph *graph,
+             size_t *const *jobs)
+{
+	// importers wait on the interfaces they import, everything else runs as
+	// it always does.
+	for (size_t i = 0; i < m->ntargets; ++i)
+	{
+		for (size_t j = 0; j < m->nsrcs[i]; ++j)
+		{
+			struct mod_src const *ms = &m->srcs[i][j];
+			for (size_t k = 0; k < ms->requires.size && jobs[i][j] != SIZE_MAX; ++k)
+			{
+				size_t prov;
+				if (!str_map_get(&m->names, ms->requires.data[k], &prov))
+					continue;
+
+				size_t dep = jobs[m->provs[prov].target][m->provs[prov].src];
+				if (dep != SIZE_MAX)
+					graph_dep(graph, jobs[i][j], dep);
+			}
+		}
+	}
+}
+
+static bool
+scan_all(struct conf_set const *cs, struct intern const *paths,
+         struct id_list const *srcs, struct id_list const *objs,
+         struct bitset const *up_to_date, struct graph_opts const *opts,
+         struct str_list *out_ddis)
+{
+	// the dependency output of a source is kept next to its object, and only
+	// produced again along with the object, which is also the case when only
+	// a header it includes or its flags changed.
+	struct graph graph = graph_create(opts);
+	graph.mem_budget = cs->mem_budget;
+	graph.nice = cs->job_nice;
+	graph.affinity = cs->job_affinity;
+
+	struct string ddi = string_create();
+	for (size_t i = 0; i < cs->size; ++i)
+	{
+		struct conf const *conf = &cs->data[i];
+		if (!conf->modules || !conf->cc_p1689_fmt)
+			continue;
+
+		out_ddis[i] = str_list_create();
+		for (size_t j = 0; j < srcs[i].size; ++j)
+		{
+			char const *src = intern_str(paths, srcs[i].data[j]);
+			ddi.len = 0;
+			string_push_str(&ddi, intern_str(paths, objs[i].data[j]));
+			string_push_buf(&ddi, ".ddi", 5);
+			str_list_add(&out_ddis[i], ddi.str);
+
+			struct stat s_src, s_ddi;
+			if (bitset_test(&up_to_date[i], srcs[i].data[j])
+			    && !stat(ddi.str, &s_ddi) && !stat(src, &s_src)
+			    && difftime(s_src.st_mtime, s_ddi.st_mtime) <= 0.0)
+			{
+				continue;
+			}
+
+			mkdir_recursive(ddi.str);
+
+			char *ddi_tmp = malloc(ddi.len + 5);
+			sprintf(ddi_tmp, "%s.tmp", ddi.str);
+
+			struct scan_ctx *ctx = malloc(sizeof(struct scan_ctx));
+			*ctx = (struct scan_ctx)
+			{
+				.conf = conf,
+				.src = src,
+				.ddi_tmp = ddi_tmp,
+			};
+			graph_own(&graph, ctx, free);
+
+			char *err = malloc(strlen(src) + 37);
+			sprintf(err, "failed to scan file for modules: '%s'!", src);
+
+			graph_add(&graph, &(struct job)
+			{
+				.mk_cmd = scan_mk_cmd,
+				.ctx = ctx,
+				.name = strdup(ddi.str),
+				.err = err,
+				.out = strdup(ddi.str),
+				.out_tmp = ddi_tmp,
+				.success_rc = conf->cc_success_rc,
+				.counted = true,
+			});
+		}
+	}
+	string_destroy(&ddi);
+
+	bool ok = !graph.size || graph_run(&graph);
+	graph_destroy(&graph);
+	return ok;
+}
+
+static char *
+scan_mk_cmd(void *vp_ctx)
+{
+	struct scan_ctx const *ctx = vp_ctx;
+	return compile_fmt(ctx->conf, ctx->conf->cc_p1689_fmt, ctx->src, ctx->ddi_tmp);
+}
+
+static bool
+read_p1689(char const *ddi, char const *src, struct mod_src *out_ms)
+{
+	struct string conts = string_create();
+	if (!read_file(ddi, &conts))
+	{
+		fprintf(stderr, "no module dependencies written for file: '%s'!\n", src);
+		string_destroy(&conts);
+		return false;
+	}
+	string_push_ch(&conts, 0);
+
+	struct str_list provides = json_names(conts.str, "\"provides\"");
+	str_list_destroy(&out_ms->requires);
+	out_ms->requires = json_names(conts.str, "\"requires\"");
+	out_ms->provides = provides.size ? strdup(provides.data[0]) : NULL;
+	
+	str_list_destroy(&provides);
+	string_destroy(&conts);
+	return true;
+}
+
+static void
+scan_light(char const *src, struct mod_src *out_ms)
+{
+	// without help from the compiler, module declarations and imports are
+	// picked up from the start of each line, ignoring the preprocessor.
+	FILE *fp = fopen(src, "rb");
+	if (!fp)
+		return;
+
+	struct string name = string_create();
+	char *cur = NULL;
+	char *line = NULL;
+	size_t line_cap = 0;
+	while (getline(&line, &line_cap, fp) != -1)
+	{
+		char const *c = line;
+		while (isspace(*c))
+			++c;
+
+		bool exported = !strncmp(c, "export", 6) && isspace(c[6]);
+		if (exported)
+		{
+			c += 6;
+			while (isspace(*c))
+				++c;
+		}
+
+		if (!strncmp(c, "module", 6) && (isspace(c[6]) || c[6] == ';'))
+		{
+			// the global module fragment and the private one declare nothing.
+			parse_name(c + 6, &name);
+			if (!name.len || *name.str == ':')
+				continue;
+
+			// implementation units import their interface, partitions of
+			// either kind can be imported themselves.
+			free(cur);
+			cur = strndup(name.str, strcspn(name.str, ":"));
+			if (exported || strchr(name.str, ':'))
+				out_ms->provides = strdup(name.str);
+			else
+				str_list_add(&out_ms->requires, name.str);
+		}
+		else if (!strncmp(c, "import", 6) && isspace(c[6]))
+		{
+			c = parse_name(c + 6, &name);
+			if (*c == '<' || *c == '"' || !name.len)
+				continue;
+
+			if (*name.str == ':' && cur)
+			{
+				struct string full = string_create();
+				string_push_str(&full, cur);
+				string_push_buf(&full, name.str, name.len + 1);
+				str_list_add(&out_ms->requires, full.str);
+				string_destroy(&full);
+			}
+			else if (*name.str != ':')
+				str_list_add(&out_ms->requires, name.str);
+		}
+	}
+
+	free(line);
+	free(cur);
+	string_destroy(&name);
+	fclose(fp);
+}
+
+static struct str_list
+json_names(char const *conts, char const *key)
+{
+	// only the logical names within the array under `key` are of interest.
+	struct str_list names = str_list_create();
+	char const *c = strstr(conts, key);
+	if (!c || !(c = strchr(c, '[')))
+		return names;
+
+	int depth = 0;
+	char const *end = c;
+	for (; *end; ++end)
+	{
+		if (*end == '[')
+			++depth;
+		else if (*end == ']' && !--depth)
+			break;
+	}
+
+	while ((c = strstr(c, "\"logical-name\"")) && c < end)
+	{
+		c += strlen("\"logical-name\"");
+		c = strchr(c, '"');
+		if (!c || c > end)
+			break;
+
+		char const *name_end = strchr(++c, '"');
+		if (!name_end)
+			break;
+		
+		char *name = strndup(c, name_end - c);
+		str_list_add(&names, name);
+		free(name);
+		c = name_end + 1;
+	}
+
+	return names;
+}
+
+static char const *
+parse_name(char const *c, struct string *out_name)
+{
+	while (isspace(*c))
+		++c;
+
+	out_name->len = 0;
+	while (isalnum(*c) || *c == '_' || *c == '.' || *c == ':')
+		string_push_ch(out_name, *c++);
+	string_push_ch(out_name, 0);
+	--out_name->len;
+
+	return c;
+}
+
+static bool
+visit(struct modules *m, struct id_list const *srcs,
+      struct bitset *up_to_date, size_t prov)
+{
+	struct mod_prov *p = &m->provs[prov];
+	if (p->mark == MARK_DONE)
+		return true;
+	if (p->mark == MARK_ACTIVE)
+	{
+		fprintf(stderr, "module imports itself through a cycle: '%s'!\n", p->name);
+		return false;
+	}
+
+	p->mark = MARK_ACTIVE;
+	struct stat s;
+	p->dirty = !bitset_test(&up_to_date[p->target], srcs[p->target].data[p->src])
+	           || stat(p->bmi, &s);
+
+	struct mod_src const *ms = &m->srcs[p->target][p->src];
+	for (size_t i = 0; i < ms->requires.size; ++i)
+	{
+		size_t dep;
+		if (!str_map_get(&m->names, ms->requires.data[i], &dep))
+			continue;
+
+		if (!visit(m, srcs, up_to_date, dep))
+			return false;
+		
+		p->dirty = p->dirty || m->provs[dep].dirty;
+	}
+
+	if (p->dirty)
+		bitset_clr(&up_to_date[p->target], srcs[p->target].data[p->src]);
+	
+	p->mark = MARK_DONE;
+	return true;
+}
+
+static void
+collect(struct modules const *m, size_t prov, bool *seen,
+        struct id_list *out_provs)
+{
+	if (seen[prov])
+		return;
+	
+	seen[prov] = true;
+	id_list_add(out_provs, prov);
+
+	struct mod_prov const *p = &m->provs[prov];
+	struct mod_src const *ms = &m->srcs[p->target][p->src];
+	for (size_t i = 0; i < ms->requires.size; ++i)
+	{
+		size_t dep;
+		if (str_map_get(&m->names, ms->requires.data[i], &dep))
+			collect(m, dep, seen, out_provs);
+	}
+}
+
+static char *
+mk_flags(struct modules const *m, struct conf const *conf,
+         struct mod_src const *ms)
+{
+	// compilers reading interfaces directly need every one which is
+	// imported, even indirectly.
+	bool *seen = calloc(m->nprovs + 1, sizeof(bool));
+	struct id_list provs = id_list_create();
+	for (size_t i = 0; i < ms->requires.size; ++i)
+	{
+		size_t prov;
+		if (str_map_get(&m->names, ms->requires.data[i], &prov))
+			collect(m, prov, seen, &provs);
+	}
+	free(seen);
+
+	size_t own;
+	bool provides = ms->provides && str_map_get(&m->names, ms->provides, &own);
+	if (!provides && !provs.size)
+	{
+		id_list_destroy(&provs);
+		return NULL;
+	}
+
+	struct fmt_spec spec = fmt_spec_create();
+	fmt_spec_add_ent(&spec, 'm', fmt_module);
+	fmt_spec_add_ent(&spec, 'b', fmt_bmi);
+
+	struct string flags = string_create();
+	if (provides && conf->cc_bmi_out_fmt)
+		fmt_inplace(&flags, &spec, conf->cc_bmi_out_fmt, (void *)&m->provs[own]);
+	
+	for (size_t i = 0; i < provs.size && conf->cc_bmi_in_fmt; ++i)
+	{
+		if (flags.len)
+			string_push_ch(&flags, ' ');
+		fmt_inplace(&flags, &spec, conf->cc_bmi_in_fmt, (void *)&m->provs[provs.data[i]]);
+	}
+	string_push_ch(&flags, 0);
+
+	fmt_spec_destroy(&spec);
+	id_list_destroy(&provs);
+	return flags.str;
+}
+
+static void
+fmt_module(struct string *out_str, void *vp_prov)
+{
+	struct mod_prov const *p = vp_prov;
+	string_push_str(out_str, p->name);
+}
+
+static void
+fmt_bmi(struct string *out_str, void *vp_prov)
+{
+	struct mod_prov const *p = vp_prov;
+	sanitize_path_inplace(out_str, p->bmi);
+}
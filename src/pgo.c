@@ -0,0 +1,432 @@
+#include "pgo.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "graph.h"
+
+#define GEN_DIR "pgo-gen"
+#define USE_DIR "pgo-use"
+#define DATA_DIR "pgo-data"
+#define SIG_FILE "mincbuild.pgo"
+
+// the instrumented build, the optimized build and the profiles merged by
+// the toolchain each get a tree of their own under the build directory.
+struct dirs
+{
+	char *gen, *use, *data;
+};
+
+static struct dirs dirs_create(struct conf_set const *cs);
+static void dirs_destroy(struct dirs *dirs);
+static char *expand(char const *fmt, struct dirs const *dirs);
+static void fmt_gen(struct string *out_str, void *vp_dirs);
+static void fmt_data(struct string *out_str, void *vp_dirs);
+static void append_flags(char **flags, char const *new);
+static size_t mk_sig(struct conf_set const *cs, char const *train, char const *merge);
+static bool sig_ck(char const *file, size_t sig);
+static bool rm_profiles(char *dir, struct str_list const *exts);
+static bool sync_profiles(struct dirs const *dirs, struct str_list const *exts);
+static void rm_obj(char const *profile);
+static time_t profile_mt(char const *obj, struct str_list const *exts);
+static char *mk_cmd(void *vp_cmd);
+
+bool
+pgo_variant(struct conf_set *cs, enum pgo_phase phase)
+{
+	char const *fmt = phase == PGO_GEN ? cs->pgo_gen_fmt : cs->pgo_use_fmt;
+	if (!cs->pgo_gen_fmt || !cs->pgo_use_fmt || !cs->pgo_train_cmd)
+	{
+		fputs("profile-guided builds need pgo_gen_fmt, pgo_use_fmt and pgo_train_cmd!\n", stderr);
+		return false;
+	}
+
+	struct dirs dirs = dirs_create(cs);
+	char *flags = expand(fmt, &dirs);
+	char const *root = phase == PGO_GEN ? dirs.gen : dirs.use;
+	size_t lib_dir_len = strlen(cs->lib_dir);
+
+	// the flags are added after the environment had its say, as a build
+	// without them would be no use for either phase.
+	bool ok = true;
+	for (size_t i = 0; i < cs->size && ok; ++i)
+	{
+		struct conf *conf = &cs->data[i];
+		conf_apply_overrides(conf);
+
+		char *lib_dir = malloc(strlen(root) + strlen(conf->lib_dir) + 1);
+		sprintf(lib_dir, "%s%s", root, conf->lib_dir + lib_dir_len);
+		free(conf->lib_dir);
+		conf->lib_dir = lib_dir;
+
+		append_flags(&conf->cflags, flags);
+		if (conf->produce_output)
+		{
+			append_flags(&conf->ldflags, flags);
+
+			// only the optimized outputs end up where they are expected.
+			if (phase == PGO_GEN)
+			{
+				char *output = malloc(strlen(dirs.gen) + strlen(conf->output) + 2);
+				sprintf(output, "%s/%s", dirs.gen, conf->output);
+				free(conf->output);
+				conf->output = output;
+			}
+		}
+
+		ok = conf_validate(conf);
+	}
+
+	// rules replacing the flags of some sources must not drop these.
+	for (size_t i = 0; i < cs->nrules; ++i)
+	{
+		if (cs->rules[i].set)
+			append_flags(&cs->rules[i].set, flags);
+	}
+
+	free(flags);
+	dirs_destroy(&dirs);
+	return ok;
+}
+
+bool
+pgo_train(struct conf_set const *cs, struct graph_opts const *opts)
+{
+	struct dirs dirs = dirs_create(cs);
+	char *train = expand(cs->pgo_train_cmd, &dirs);
+	char *merge = cs->pgo_merge_cmd ? expand(cs->pgo_merge_cmd, &dirs) : NULL;
+
+	// training is only repeated once the instrumented programs or the way
+	// they are trained changed.
+	char *sig_file = malloc(strlen(cs->lib_dir) + strlen(SIG_FILE) + 2);
+	sprintf(sig_file, "%s/%s", cs->lib_dir, SIG_FILE);
+	size_t sig = mk_sig(cs, train, merge);
+
+	bool success = true;
+	if (!sig_ck(sig_file, sig))
+	{
+		// profiles accumulate over runs, so what an earlier training left
+		// behind would be counted again.
+		unlink(sig_file);
+		success = rm_profiles(dirs.gen, &cs->pgo_exts)
+		          && rm_profiles(dirs.data, &cs->pgo_exts);
+
+		char *data_dir = malloc(strlen(dirs.data) + 2);
+		sprintf(data_dir, "%s/", dirs.data);
+		mkdir_recursive(data_dir);
+		free(data_dir);
+
+		struct graph graph = graph_create(opts);
+		graph.mem_budget = cs->mem_budget;
+		graph.nice = cs->job_nice;
+		graph.affinity = cs->job_affinity;
+
+		size_t train_job = graph_add(&graph, &(struct job)
+		{
+			.mk_cmd = mk_cmd,
+			.ctx = train,
+			.name = strdup("pgo:train"),
+			.err = strdup("profile training failed!"),
+			.success_rc = 0,
+			.counted = true,
+		});
+
+		if (merge)
+		{
+			size_t merge_job = graph_add(&graph, &(struct job)
+			{
+				.mk_cmd = mk_cmd,
+				.ctx = merge,
+				.name = strdup("pgo:merge"),
+				.err = strdup("failed to merge profiles!"),
+				.success_rc = 0,
+				.counted = true,
+			});
+			graph_dep(&graph, merge_job, train_job);
+		}
+
+		success = success && graph_run(&graph)
+		          && sync_profiles(&dirs, &cs->pgo_exts);
+		graph_destroy(&graph);
+
+		if (success)
+		{
+			char line[24];
+			int len = sprintf(line, "%016zx\n", sig);
+			mkdir_recursive(sig_file);
+			success = write_file(sig_file, line, len);
+		}
+	}
+
+	free(sig_file);
+	free(train);
+	free(merge);
+	dirs_destroy(&dirs);
+	return success;
+}
+
+bool
+pgo_invalidate(struct conf_set const *cs, struct intern const *paths,
+               struct id_list const *srcs, struct id_list const *objs,
+               struct bitset *up_to_date)
+{
+	// a merged profile is read by every compile, while a profile written
+	// beside an object only concerns that object.
+	struct dirs dirs = dirs_create(cs);
+	struct str_list merged;
+	bool found = ext_find(dirs.data, &cs->pgo_exts, &merged);
+	dirs_destroy(&dirs);
+	if (!found)
+		return false;
+
+	time_t merged_mt = 0;
+	struct stat s;
+	for (size_t i = 0; i < merged.size; ++i)
+	{
+		if (!stat(merged.data[i], &s) && s.st_mtime > merged_mt)
+			merged_mt = s.st_mtime;
+	}
+	str_list_destroy(&merged);
+
+	for (size_t i = 0; i < srcs->size; ++i)
+	{
+		if (!bitset_test(up_to_date, srcs->data[i]))
+			continue;
+
+		char const *obj = intern_str(paths, objs->data[i]);
+		if (stat(obj, &s)
+		    || difftime(merged_mt, s.st_mtime) > 0.0
+		    || difftime(profile_mt(obj, &cs->pgo_exts), s.st_mtime) > 0.0)
+		{
+			bitset_clr(up_to_date, srcs->data[i]);
+		}
+	}
+
+	return true;
+}
+
+static struct dirs
+dirs_create(struct conf_set const *cs)
+{
+	struct dirs dirs =
+	{
+		.gen = malloc(strlen(cs->lib_dir) + strlen(GEN_DIR) + 2),
+		.use = malloc(strlen(cs->lib_dir) + strlen(USE_DIR) + 2),
+		.data = malloc(strlen(cs->lib_dir) + strlen(DATA_DIR) + 2),
+	};
+	sprintf(dirs.gen, "%s/%s", cs->lib_dir, GEN_DIR);
+	sprintf(dirs.use, "%s/%s", cs->lib_dir, USE_DIR);
+	sprintf(dirs.data, "%s/%s", cs->lib_dir, DATA_DIR);
+
+	return dirs;
+}
+
+static void
+dirs_destroy(struct dirs *dirs)
+{
+	free(dirs->gen);
+	free(dirs->use);
+	free(dirs->data);
+}
+
+static char *
+expand(char const *fmt, struct dirs const *dirs)
+{
+	struct fmt_spec spec = fmt_spec_create();
+	fmt_spec_add_ent(&spec, 'g', fmt_gen);
+	fmt_spec_add_ent(&spec, 'd', fmt_data);
+	char *str = fmt_str(&spec, fmt, (void *)dirs);
+	fmt_spec_destroy(&spec);
+
+	return str;
+}
+
+static void
+fmt_gen(struct string *out_str, void *vp_dirs)
+{
+	struct dirs const *dirs = vp_dirs;
+	string_push_str(out_str, dirs->gen);
+}
+
+static void
+fmt_data(struct string *out_str, void *vp_dirs)
+{
+	struct dirs const *dirs = vp_dirs;
+	string_push_str(out_str, dirs->data);
+}
+
+static void
+append_flags(char **flags, char const *new)
+{
+	char *cat = malloc(strlen(*flags) + strlen(new) + 2);
+	sprintf(cat, "%s %s", *flags, new);
+	free(*flags);
+	*flags = cat;
+}
+
+static size_t
+mk_sig(struct conf_set const *cs, char const *train, char const *merge)
+{
+	// the instrumented programs are what the training runs, whatever their
+	// time says.
+	size_t sig = str_hash(train) ^ (merge ? str_hash(merge) : 0);
+	for (size_t i = 0; i < cs->size; ++i)
+	{
+		if (cs->data[i].produce_output)
+			sig = file_hash(cs->data[i].output, sig);
+	}
+
+	return sig;
+}
+
+static bool
+sig_ck(char const *file, size_t sig)
+{
+	FILE *fp = fopen(file, "rb");
+	if (!fp)
+		return false;
+
+	size_t old_sig;
+	bool same = fscanf(fp, "%zx", &old_sig) == 1 && old_sig == sig;
+	fclose(fp);
+
+	return same;
+}
+
+static bool
+rm_profiles(char *dir, struct str_list const *exts)
+{
+	struct str_list profiles;
+	if (!ext_find(dir, exts, &profiles))
+		return false;
+
+	for (size_t i = 0; i < profiles.size; ++i)
+		unlink(profiles.data[i]);
+	str_list_destroy(&profiles);
+	return true;
+}
+
+static bool
+sync_profiles(struct dirs const *dirs, struct str_list const *exts)
+{
+	// profiles written beside the instrumented objects are used beside the
+	// optimized ones. copies which are already current keep their time, so
+	// only the objects whose profiles changed are compiled again.
+	size_t gen_len = strlen(dirs->gen), use_len = strlen(dirs->use);
+	struct string dst = string_create();
+
+	struct str_list gen_profiles, use_profiles;
+	if (!ext_find(dirs->gen, exts, &gen_profiles))
+		return false;
+
+	bool ok = true;
+	for (size_t i = 0; i < gen_profiles.size && ok; ++i)
+	{
+		dst.len = 0;
+		string_push_str(&dst, dirs->use);
+		string_push_buf(&dst, gen_profiles.data[i] + gen_len,
+		                strlen(gen_profiles.data[i] + gen_len) + 1);
+
+		struct string buf = string_create(), old_buf = string_create();
+		bool have_old = read_file(dst.str, &old_buf);
+		if (read_file(gen_profiles.data[i], &buf)
+		    && (!have_old || buf.len != old_buf.len
+		        || memcmp(buf.str, old_buf.str, buf.len)))
+		{
+			mkdir_recursive(dst.str);
+			ok = write_file(dst.str, buf.str, buf.len);
+		}
+
+		string_destroy(&buf);
+		string_destroy(&old_buf);
+	}
+	str_list_destroy(&gen_profiles);
+
+	// code the training no longer reaches has to be compiled without the
+	// profile it had before.
+	if (!ok || !ext_find(dirs->use, exts, &use_profiles))
+	{
+		string_destroy(&dst);
+		return false;
+	}
+
+	for (size_t i = 0; i < use_profiles.size; ++i)
+	{
+		dst.len = 0;
+		string_push_str(&dst, dirs->gen);
+		string_push_buf(&dst, use_profiles.data[i] + use_len,
+		                strlen(use_profiles.data[i] + use_len) + 1);
+
+		if (access(dst.str, F_OK))
+		{
+			unlink(use_profiles.data[i]);
+			rm_obj(use_profiles.data[i]);
+		}
+	}
+	str_list_destroy(&use_profiles);
+
+	string_destroy(&dst);
+	return true;
+}
+
+static void
+rm_obj(char const *profile)
+{
+	// toolchains either name a profile after the whole object or after the
+	// object without its extension.
+	char *obj = strdup(profile);
+	char *ext = strrchr(obj, '.');
+	*ext = 0;
+
+	size_t len = strlen(obj);
+	if (len > 2 && !strcmp(obj + len - 2, ".o"))
+		unlink(obj);
+	else
+	{
+		obj = realloc(obj, len + 3);
+		strcat(obj, ".o");
+		unlink(obj);
+	}
+
+	free(obj);
+}
+
+static time_t
+profile_mt(char const *obj, struct str_list const *exts)
+{
+	// the counterpart of `rm_obj()`, for objects named `<src>.o`.
+	size_t obj_len = strlen(obj);
+	char *profile = malloc(obj_len + 64);
+	time_t mt = 0;
+	struct stat s;
+
+	for (size_t i = 0; i < exts->size; ++i)
+	{
+		if (strlen(exts->data[i]) > 60)
+			continue;
+
+		sprintf(profile, "%s.%s", obj, exts->data[i]);
+		if (!stat(profile, &s) && s.st_mtime > mt)
+			mt = s.st_mtime;
+
+		sprintf(profile, "%.*s.%s", (int)obj_len - 2, obj, exts->data[i]);
+		if (!stat(profile, &s) && s.st_mtime > mt)
+			mt = s.st_mtime;
+	}
+
+	free(profile);
+	return mt;
+}
+
+static char *
+mk_cmd(void *vp_cmd)
+{
+	return strdup(vp_cmd);
+}
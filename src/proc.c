@@ -0,0 +1,140 @@
+#include "proc.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+bool
+proc_spawn(struct proc *out_p, char const *cmd, int nice_inc, int cpu)
+{
+	// the pipe is close-on-exec so that commands started concurrently by other
+	// workers never hold its write end open.
+	int fds[2];
+	if (pipe2(fds, O_CLOEXEC))
+	{
+		fputs("failed to create pipe for command output!\n", stderr);
+		return false;
+	}
+
+	pid_t pid = fork();
+	if (pid == -1)
+	{
+		fputs("failed to fork for command execution!\n", stderr);
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+
+	if (!pid)
+	{
+		setpgid(0, 0);
+
+		// both are inherited by everything the command starts.
+		if (nice_inc)
+			nice(nice_inc);
+		if (cpu >= 0)
+		{
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			sched_setaffinity(0, sizeof(set), &set);
+		}
+		
+		dup2(fds[1], STDOUT_FILENO);
+		dup2(fds[1], STDERR_FILENO);
+		execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+		_exit(127);
+	}
+
+	// also done here so the group exists by the time anyone signals it,
+	// regardless of which process gets to run first.
+	setpgid(pid, pid);
+	close(fds[1]);
+
+	*out_p = (struct proc)
+	{
+		.pid = pid,
+		.out_fd = fds[0],
+	};
+	return true;
+}
+
+int
+proc_wait(struct proc *p, struct string *out_output, struct rusage *out_ru)
+{
+	while (proc_read(p, out_output))
+		;
+
+	return proc_reap(p, out_ru);
+}
+
+bool
+proc_read(struct proc *p, struct string *out_output)
+{
+	// both stdout and stderr are collected in the order they were written.
+	// returns false once the output is exhausted, after which the pipe is
+	// closed.
+	char buf[4096];
+	ssize_t n;
+	while ((n = read(p->out_fd, buf, sizeof(buf))) == -1 && errno == EINTR)
+		;
+
+	if (n > 0)
+	{
+		string_push_buf(out_output, buf, n);
+		return true;
+	}
+
+	close(p->out_fd);
+	p->out_fd = -1;
+	return false;
+}
+
+int
+proc_reap(struct proc *p, struct rusage *out_ru)
+{
+	// the peak RSS reported covers the largest of the command and everything
+	// it waited for, e.g. the compiler proper under a driver. returns -1 if
+	// the command could not be waited for.
+	int status;
+	while (wait4(p->pid, &status, 0, out_ru) == -1)
+	{
+		if (errno != EINTR)
+		{
+			fputs("failed to wait for command!\n", stderr);
+			return -1;
+		}
+	}
+
+	// report the exit code the way a shell would.
+	if (WIFEXITED(status))
+		return WEXITSTATUS(status);
+	return 128 + WTERMSIG(status);
+}
+
+int
+proc_pidfd(pid_t pid)
+{
+	// returns -1 where the kernel (or the headers built against) lack
+	// pidfd support.
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	return -1;
+#endif
+}
+
+void
+proc_kill(pid_t pid, bool force)
+{
+	// async-signal-safe, as it is also used from signal handlers. `force` is
+	// for commands which did not exit when asked to.
+	kill(-pid, force ? SIGKILL : SIGTERM);
+}
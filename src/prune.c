@@ -7,11 +7,14 @@
 #include <string.h>
 #include <time.h>
 
+#include <fcntl.h>
 #include <regex.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "stats.h"
+
 #ifndef PRUNE_SINGLE_THREAD
 #include <pthread.h>
 #include <sys/sysinfo.h>
@@ -24,193 +27,386 @@
 #define INCLUDE_REGEX "#\\s*include\\s*[<\"].+[>\"]"
 #endif
 
-struct thread_arg
+struct prune_state
 {
-	size_t start, cnt;
 	struct conf const *conf;
-	struct str_list *srcs, *objs;
-	struct str_list const *hdrs;
-	regex_t const *re;
+	struct intern const *paths;
+	struct id_list const *srcs, *objs, *hdrs;
+	struct bitset is_hdr;
+	regex_t re;
+
+	// indexed by path id, only filled in for headers.
+	time_t *hdr_mt;
+	struct id_list *hdr_incs;
+
+	struct prune_cache *cache;
+	struct bitset *out_up_to_date;
+
+	// only used when scanning arbitrary files, parallel to each other.
+	struct id_list const *files;
+	struct id_list *out_incs;
 };
 
-struct rebuild_ck_info
+struct thread_arg
 {
-	struct str_list const *hdrs;
-	struct conf const *conf;
-	regex_t const *re;
-	time_t mt;
+	size_t start, cnt;
+	struct prune_state *state;
 };
 
-static void *worker(void *vp_arg);
-static bool ck_rebuild(char const *path, struct str_list *ckd_incs, struct rebuild_ck_info const *info);
+static bool run_workers(struct prune_state *state, size_t cnt, void *(*worker)(void *));
+static void *hdr_worker(void *vp_arg);
+static void *src_worker(void *vp_arg);
+static void *scan_worker(void *vp_arg);
+static bool ck_rebuild(struct prune_state const *state, size_t src, time_t mt, struct bitset *visited, struct id_list *stack);
+static bool scan_incs(struct prune_state const *state, size_t file, struct stat const *s, struct id_list *out_incs);
+static void resolve_incs(struct prune_state const *state, char const *names, size_t nnames, struct id_list *out_incs);
+
+struct prune_cache
+prune_cache_create(void)
+{
+	return (struct prune_cache)
+	{
+		.data = NULL,
+		.size = 0,
+	};
+}
 
 void
-prune(struct conf const *conf, struct str_list *srcs, struct str_list *objs,
-      struct str_list const *hdrs)
+prune_cache_destroy(struct prune_cache *pc)
 {
-	regex_t re;
-	if (regcomp(&re, INCLUDE_REGEX, REG_EXTENDED | REG_NEWLINE))
+	for (size_t i = 0; i < pc->size; ++i)
+		free(pc->data[i].names);
+	free(pc->data);
+}
+
+bool
+prune(struct conf const *conf, struct intern const *paths,
+      struct id_list const *srcs, struct id_list const *objs,
+      struct id_list const *hdrs, struct prune_cache *cache,
+      struct bitset *out_up_to_date)
+{
+	struct prune_state state =
+	{
+		.conf = conf,
+		.paths = paths,
+		.srcs = srcs,
+		.objs = objs,
+		.hdrs = hdrs,
+		.is_hdr = bitset_create(paths->size),
+		.hdr_mt = calloc(paths->size + 1, sizeof(time_t)),
+		.hdr_incs = calloc(paths->size + 1, sizeof(struct id_list)),
+		.cache = cache,
+		.out_up_to_date = out_up_to_date,
+	};
+
+	if (regcomp(&state.re, INCLUDE_REGEX, REG_EXTENDED | REG_NEWLINE))
 	{
 		fputs("failed to compile regex: '" INCLUDE_REGEX "'!\n", stderr);
-		exit(1);
+		bitset_destroy(&state.is_hdr);
+		free(state.hdr_mt);
+		free(state.hdr_incs);
+		return false;
 	}
-	
+
+	// the cache is grown up front, since workers only ever touch the entries
+	// of their own files.
+	if (cache && cache->size < paths->size)
+	{
+		cache->data = realloc(cache->data, sizeof(struct prune_cache_ent) * paths->size);
+		memset(&cache->data[cache->size], 0, sizeof(struct prune_cache_ent) * (paths->size - cache->size));
+		cache->size = paths->size;
+	}
+
+	for (size_t i = 0; i < hdrs->size; ++i)
+	{
+		bitset_set(&state.is_hdr, hdrs->data[i]);
+		state.hdr_incs[hdrs->data[i]] = id_list_create();
+	}
+
+	// every header is read exactly once to build the include graph, which
+	// the sources are then checked against.
+	bool ok = run_workers(&state, hdrs->size, hdr_worker)
+	          && run_workers(&state, srcs->size, src_worker);
+
+	for (size_t i = 0; i < hdrs->size; ++i)
+		id_list_destroy(&state.hdr_incs[hdrs->data[i]]);
+
+	regfree(&state.re);
+	bitset_destroy(&state.is_hdr);
+	free(state.hdr_mt);
+	free(state.hdr_incs);
+	return ok;
+}
+
+bool
+prune_scan(struct conf const *conf, struct intern const *paths,
+           struct id_list const *hdrs, struct id_list const *files,
+           struct id_list *out_incs)
+{
+	struct prune_state state =
+	{
+		.conf = conf,
+		.paths = paths,
+		.hdrs = hdrs,
+		.is_hdr = bitset_create(paths->size),
+		.files = files,
+		.out_incs = out_incs,
+	};
+
+	if (regcomp(&state.re, INCLUDE_REGEX, REG_EXTENDED | REG_NEWLINE))
+	{
+		fputs("failed to compile regex: '" INCLUDE_REGEX "'!\n", stderr);
+		bitset_destroy(&state.is_hdr);
+		return false;
+	}
+
+	for (size_t i = 0; i < hdrs->size; ++i)
+		bitset_set(&state.is_hdr, hdrs->data[i]);
+	for (size_t i = 0; i < files->size; ++i)
+		out_incs[i] = id_list_create();
+
+	bool ok = run_workers(&state, files->size, scan_worker);
+
+	regfree(&state.re);
+	bitset_destroy(&state.is_hdr);
+	return ok;
+}
+
+static bool
+run_workers(struct prune_state *state, size_t cnt, void *(*worker)(void *))
+{
+	if (!cnt)
+		return true;
+
 #ifndef PRUNE_SINGLE_THREAD
 	// multithreaded pthread dependent code.
-	
-	ssize_t cnt = get_nprocs();
-	if (cnt < 1)
+
+	int nprocs = get_nprocs();
+	if (nprocs < 1)
 	{
 		fputs("no CPU threads available for pruning!\n", stderr);
-		exit(1);
+		return false;
 	}
-	cnt = srcs->size < cnt ? srcs->size : cnt;
-	
-	printf("pruning compilation with %zu worker(s)\n", cnt);
-	
-	struct thread_arg *th_args = malloc(sizeof(struct thread_arg) * cnt);
-	for (size_t i = 0; i < cnt; ++i)
+	size_t nths = cnt < (size_t)nprocs ? cnt : (size_t)nprocs;
+
+	struct thread_arg *th_args = malloc(sizeof(struct thread_arg) * nths);
+	for (size_t i = 0; i < nths; ++i)
 	{
 		th_args[i] = (struct thread_arg)
 		{
-			.conf = conf,
-			.srcs = srcs,
-			.objs = objs,
-			.hdrs = hdrs,
-			.re = &re,
+			.cnt = 0,
+			.state = state,
 		};
 	}
 
-	for (size_t i = 0; i < srcs->size; ++i)
-		++th_args[i % cnt].cnt;
-
-	// create threads to mark sources / objects for removal in pruning.
-	pthread_t *ths = malloc(sizeof(pthread_t) * cnt);
 	for (size_t i = 0; i < cnt; ++i)
+		++th_args[i % nths].cnt;
+
+	// the threads which were started are always joined, even if starting
+	// another one failed.
+	pthread_t *ths = malloc(sizeof(pthread_t) * nths);
+	size_t nstarted = 0;
+	for (size_t i = 0; i < nths; ++i)
 	{
 		struct thread_arg const *prev = i == 0 ? NULL : &th_args[i - 1];
 		th_args[i].start = i == 0 ? 0 : prev->start + prev->cnt;
 		if (pthread_create(&ths[i], NULL, worker, &th_args[i]))
 		{
 			fputs("failed to create worker thread for pruning!\n", stderr);
-			exit(1);
+			break;
 		}
+		++nstarted;
 	}
 
-	for (size_t i = 0; i < cnt; ++i)
+	for (size_t i = 0; i < nstarted; ++i)
 		pthread_join(ths[i], NULL);
 
 	free(ths);
 	free(th_args);
+	return nstarted == nths;
 #else
 	// singlethreaded pthread independent code.
-	
-	puts("pruning compilation in single thread mode");
-	
+
 	struct thread_arg th_arg =
 	{
-		.conf = conf,
-		.srcs = srcs,
-		.objs = objs,
-		.hdrs = hdrs,
-		.re = &re,
 		.start = 0,
-		.cnt = srcs->size,
+		.cnt = cnt,
+		.state = state,
 	};
-	
+
 	worker(&th_arg);
+	return true;
 #endif
-	
-	regfree(&re);
+}
+
+static void *
+hdr_worker(void *vp_arg)
+{
+	struct thread_arg *arg = vp_arg;
+	struct prune_state *state = arg->state;
 
-	// remove marked sources / objects.
-	for (size_t i = 0; i < srcs->size; ++i)
+	for (size_t i = arg->start; i < arg->start + arg->cnt; ++i)
 	{
-		if (!srcs->data[i])
-		{
-			str_list_rm_no_free(srcs, i);
-			str_list_rm_no_free(objs, i);
-			--i;
-		}
+		size_t hdr = state->hdrs->data[i];
+		char const *path = intern_str(state->paths, hdr);
+
+		struct stat s;
+		stats_add(&stats.stat_calls, 1);
+		if (stat(path, &s))
+			continue;
+
+		state->hdr_mt[hdr] = s.st_mtime;
+		scan_incs(state, hdr, &s, &state->hdr_incs[hdr]);
 	}
+
+	return NULL;
 }
 
 static void *
-worker(void *vp_arg)
+src_worker(void *vp_arg)
 {
 	struct thread_arg *arg = vp_arg;
+	struct prune_state *state = arg->state;
+
+	// the headers visited while checking a source are remembered both as a
+	// bitset for lookups and as a list for cheaply clearing that bitset.
+	struct bitset visited = bitset_create(state->paths->size);
+	struct id_list stack = id_list_create();
 
 	for (size_t i = arg->start; i < arg->start + arg->cnt; ++i)
 	{
-		struct stat s_src;
-		stat(arg->srcs->data[i], &s_src);
-
 		struct stat s_obj;
-		if (stat(arg->objs->data[i], &s_obj))
+		stats_add(&stats.stat_calls, 1);
+		if (stat(intern_str(state->paths, state->objs->data[i]), &s_obj))
 			continue;
 
-		time_t mt = s_obj.st_mtime;
-		struct str_list ckd_incs = str_list_create();
-		
-		struct rebuild_ck_info info =
+		size_t src = state->srcs->data[i];
+		if (!ck_rebuild(state, src, s_obj.st_mtime, &visited, &stack))
 		{
-			.hdrs = arg->hdrs,
-			.conf = arg->conf,
-			.re = arg->re,
-			.mt = mt,
-		};
-		
-		if (ck_rebuild(arg->srcs->data[i], &ckd_incs, &info))
-			goto cleanup;
+			printf("\t%s\n", intern_str(state->paths, src));
+			bitset_set_atomic(state->out_up_to_date, src);
+		}
+	}
 
-		printf("\t%s\n", arg->srcs->data[i]);
+	id_list_destroy(&stack);
+	bitset_destroy(&visited);
+	return NULL;
+}
 
-		// mark source/object for removal in pruning.
-		free(arg->srcs->data[i]);
-		free(arg->objs->data[i]);
-		arg->srcs->data[i] = arg->objs->data[i] = NULL;
+static void *
+scan_worker(void *vp_arg)
+{
+	struct thread_arg *arg = vp_arg;
+	struct prune_state *state = arg->state;
 
-	cleanup:
-		str_list_destroy(&ckd_incs);
+	for (size_t i = arg->start; i < arg->start + arg->cnt; ++i)
+	{
+		size_t file = state->files->data[i];
+		
+		struct stat s;
+		stats_add(&stats.stat_calls, 1);
+		if (!stat(intern_str(state->paths, file), &s))
+			scan_incs(state, file, &s, &state->out_incs[i]);
 	}
 
 	return NULL;
 }
 
 static bool
-ck_rebuild(char const *path, struct str_list *ckd_incs,
-           struct rebuild_ck_info const *info)
+ck_rebuild(struct prune_state const *state, size_t src, time_t mt,
+           struct bitset *visited, struct id_list *stack)
 {
 	// check whether anything even needs to be done.
+	char const *path = intern_str(state->paths, src);
 	struct stat s;
-	stat(path, &s);
-	bool rebuild = difftime(s.st_mtime, info->mt) > 0.0;
-	if (rebuild)
+	stats_add(&stats.stat_calls, 1);
+	if (stat(path, &s) || difftime(s.st_mtime, mt) > 0.0)
 		return true;
+
+	// walk everything the source transitively includes, visiting each header
+	// only once to prevent excess resource usage and hanging with coupled
+	// inclusions. a source which cannot be read is left to the compiler.
+	struct id_list incs = id_list_create();
+	if (!scan_incs(state, src, &s, &incs))
+	{
+		id_list_destroy(&incs);
+		return true;
+	}
+
+	struct id_list seen = id_list_create();
+	bool rebuild = false;
+
+	stack->size = 0;
+	for (size_t i = 0; i < incs.size; ++i)
+		id_list_add(stack, incs.data[i]);
+
+	while (stack->size > 0 && !rebuild)
+	{
+		size_t hdr = stack->data[--stack->size];
+		if (bitset_test(visited, hdr))
+			continue;
+
+		bitset_set(visited, hdr);
+		id_list_add(&seen, hdr);
+
+		rebuild = difftime(state->hdr_mt[hdr], mt) > 0.0;
+
+		struct id_list const *hdr_incs = &state->hdr_incs[hdr];
+		for (size_t i = 0; i < hdr_incs->size; ++i)
+			id_list_add(stack, hdr_incs->data[i]);
+	}
+
+	for (size_t i = 0; i < seen.size; ++i)
+		bitset_clr(visited, seen.data[i]);
+
+	id_list_destroy(&seen);
+	id_list_destroy(&incs);
+	return rebuild;
+}
+
+static bool
+scan_incs(struct prune_state const *state, size_t file, struct stat const *s,
+          struct id_list *out_incs)
+{
+	// files unchanged since they were last scanned are not read again.
+	struct prune_cache_ent *ent = state->cache ? &state->cache->data[file] : NULL;
+	if (ent && ent->names
+	    && ent->mt.tv_sec == s->st_mtim.tv_sec
+	    && ent->mt.tv_nsec == s->st_mtim.tv_nsec
+	    && ent->size == s->st_size)
+	{
+		stats_add(&stats.cache_hits, 1);
+		resolve_incs(state, ent->names, ent->nnames, out_incs);
+		return true;
+	}
 	
-	// find included headers in the file.
-	struct str_list incs = str_list_create();
-	
-	FILE *fp = fopen(path, "rb");
-	if (!fp)
+	// the size is already known from `stat()`, so read the file directly
+	// rather than going through a buffered stream.
+	char const *path = intern_str(state->paths, file);
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
 	{
 		fprintf(stderr, "cannot open file for inclusion checks: '%s'!\n", path);
-		exit(1);
+		return false;
 	}
 
-	fseek(fp, 0, SEEK_END);
-	size_t fsize = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
+	char *fconts = malloc(s->st_size + 1);
+	ssize_t fsize = read(fd, fconts, s->st_size);
+	fconts[fsize > 0 ? fsize : 0] = 0;
 
-	char *fconts = malloc(fsize + 1);
-	fread(fconts, 1, fsize, fp);
-	fconts[fsize] = 0;
+	close(fd);
+	stats_add(&stats.files_read, 1);
+	stats_add(&stats.bytes_read, fsize > 0 ? fsize : 0);
 
-	fclose(fp);
+	// the names are kept as written, since which of them are project headers
+	// can change without the file itself changing.
+	uint64_t scan_start = stats_now();
+	struct string names = string_create();
+	size_t nnames = 0;
 
 	regoff_t start = 0;
 	regmatch_t match;
-	while (!regexec(info->re, fconts + start, 1, &match, 0))
+	while (!regexec(&state->re, fconts + start, 1, &match, 0))
 	{
 		fconts[start + match.rm_eo - 1] = 0;
 
@@ -219,39 +415,54 @@ ck_rebuild(char const *path, struct str_list *ckd_incs,
 			++inc;
 		++inc;
 
-		char *inc_path = malloc(strlen(info->conf->inc_dir) + strlen(inc) + 2);
-		sprintf(inc_path, "%s/%s", info->conf->inc_dir, inc);
-		str_list_add(&incs, inc_path);
-		free(inc_path);
-		
+		string_push_buf(&names, inc, strlen(inc) + 1);
+		++nnames;
+
 		start += match.rm_eo;
 	}
 
-	free(fconts);
+	resolve_incs(state, names.str, nnames, out_incs);
 
-	// remove non-project includes from `incs`, and also includes for headers
-	// which have already been checked, preventing excess resource usage and
-	// hanging with coupled inclusions.
-	for (size_t i = 0; i < incs.size; ++i)
+	if (ent)
 	{
-		if (!str_list_contains(info->hdrs, incs.data[i])
-		    || str_list_contains(ckd_incs, incs.data[i]))
-		{
-			str_list_rm(&incs, i);
-			--i;
-		}
+		free(ent->names);
+		ent->names = names.str;
+		ent->nnames = nnames;
+		ent->mt = s->st_mtim;
+		ent->size = s->st_size;
 	}
+	else
+		string_destroy(&names);
 	
-	for (size_t i = 0; i < incs.size && !rebuild; ++i)
+	free(fconts);
+	stats_add(&stats.scan_ns, stats_now() - scan_start);
+	return true;
+}
+
+static void
+resolve_incs(struct prune_state const *state, char const *names, size_t nnames,
+             struct id_list *out_incs)
+{
+	struct string inc_path = string_create();
+	string_push_str(&inc_path, state->conf->inc_dir);
+	string_push_ch(&inc_path, '/');
+	size_t inc_dir_len = inc_path.len;
+
+	// only project headers are of interest, anything else is ignored.
+	for (size_t i = 0; i < nnames; ++i)
 	{
-		str_list_add(ckd_incs, incs.data[i]);
-		if (ck_rebuild(incs.data[i], ckd_incs, info))
+		size_t len = strlen(names) + 1;
+		inc_path.len = inc_dir_len;
+		string_push_buf(&inc_path, names, len);
+		names += len;
+
+		size_t id;
+		if (intern_find(state->paths, inc_path.str, &id)
+		    && bitset_test(&state->is_hdr, id))
 		{
-			str_list_destroy(&incs);
-			return true;
+			id_list_add(out_incs, id);
 		}
 	}
 
-	str_list_destroy(&incs);
-	return false;
+	string_destroy(&inc_path);
 }
@@ -0,0 +1,587 @@
+#include "rexec.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <wordexp.h>
+
+#include "compile.h"
+#include "conf.h"
+#include "proc.h"
+
+#define REXEC_MAGIC "mincbuild-rexec 2\n"
+
+// in seconds, after which the other end of a connection which stopped
+// sending or receiving is given up on.
+#define REXEC_IO_TIMEOUT 60
+
+// in seconds, after which a client skips a worker which does not accept its
+// connection, or compiles locally when the worker sends no response.
+#define REXEC_CONNECT_TIMEOUT 5
+#define REXEC_COMPILE_TIMEOUT 600
+
+// bounds the secret, target name and flags of a request, which are read
+// before the client is known to be allowed anything.
+#define REXEC_ARG_MAX 1048576
+
+static int connect_any(char const *hosts, char const *key);
+static int connect_host(char const *host);
+static bool connect_timed(int fd, struct sockaddr const *addr, socklen_t addr_len);
+static int listen_addr(char const *addr);
+static void serve(int fd, struct conf_set const *cs, struct string const *secrets);
+static void run_compile(int fd, struct conf const *conf, char const *flags, size_t flags_len, char const *in, size_t in_len);
+static bool remote_compile(int fd, struct string const *secret, char const *target, struct string const *flags, struct string const *in, char const *obj, int *out_rc);
+static bool read_secret(char const *file, struct string *out_secret);
+static bool split_flags(char const *cflags, struct string *out_flags);
+static char *quote_flags(char const *flags, size_t len);
+static bool secret_eq(struct string const *secret, char const *buf, size_t len);
+static ssize_t find_target(struct conf_set const *cs, char const *name);
+static bool write_all(int fd, char const *buf, size_t len);
+static bool read_all(int fd, char *buf, size_t len);
+static bool read_line(int fd, char *buf, size_t cap);
+static bool split_addr(char const *addr, char **out_host, char **out_port);
+
+int
+rexec_client(char const *hosts, char const *secret_file, char const *target,
+             char const *cflags, char const *pp_cmd, char const *pp_file,
+             char const *local_cmd, char const *obj)
+{
+	// preprocessing happens locally so that the worker needs nothing but the
+	// compiler, and anything going wrong before the remote compile finishes
+	// falls back to compiling locally, which also gives proper diagnostics.
+	struct string secret = string_create();
+	struct string flags = string_create();
+	struct string in = string_create();
+	int fd = -1;
+	int rc = 0;
+	bool remote = read_secret(secret_file, &secret)
+	              && split_flags(cflags, &flags)
+	              && !system(pp_cmd)
+	              && read_file(pp_file, &in)
+	              && (fd = connect_any(hosts, obj)) != -1
+	              && remote_compile(fd, &secret, target, &flags, &in, obj, &rc);
+
+	if (fd != -1)
+		close(fd);
+	unlink(pp_file);
+	string_destroy(&in);
+	string_destroy(&flags);
+	string_destroy(&secret);
+
+	if (remote)
+		return rc;
+
+	fflush(stdout);
+	execl("/bin/sh", "sh", "-c", local_cmd, (char *)NULL);
+	fprintf(stderr, "failed to fall back to local compilation: '%s'!\n", obj);
+	return 1;
+}
+
+int
+rexec_worker(char const *addr, char const *conf_file, char const *profile)
+{
+	// workers only compile for the targets of their own configuration which
+	// have a compile command, and a secret for clients to prove they know.
+	struct conf_set cs;
+	if (!conf_set_from_file(&cs, conf_file, profile))
+		return 1;
+
+	struct string *secrets = malloc(sizeof(struct string) * cs.size);
+	for (size_t i = 0; i < cs.size; ++i)
+		secrets[i] = string_create();
+
+	size_t nserved = 0;
+	bool ok = true;
+	for (size_t i = 0; i < cs.size && ok; ++i)
+	{
+		struct conf *conf = &cs.data[i];
+		conf_apply_overrides(conf);
+		if (!conf->cc_remote_fmt || !conf->remote_secret_file)
+			continue;
+
+		ok = read_secret(conf->remote_secret_file, &secrets[i]);
+		if (!ok)
+			fprintf(stderr, "cannot read remote secret: '%s'!\n", conf->remote_secret_file);
+		nserved += ok;
+	}
+
+	if (ok && !nserved)
+		fputs("workers need cc_remote_fmt and remote_secret_file in the configuration!\n", stderr);
+
+	int lfd = ok && nserved ? listen_addr(addr) : -1;
+	if (lfd != -1)
+	{
+		// every connection is served by its own process, which reaps itself.
+		signal(SIGCHLD, SIG_IGN);
+		printf("worker listening on %s\n", addr);
+		fflush(stdout);
+	}
+
+	while (lfd != -1)
+	{
+		int fd = accept(lfd, NULL, NULL);
+		if (fd == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			
+			fputs("failed to accept connection!\n", stderr);
+			close(lfd);
+			lfd = -1;
+			break;
+		}
+
+		pid_t pid = fork();
+		if (!pid)
+		{
+			close(lfd);
+			signal(SIGCHLD, SIG_DFL);
+			serve(fd, &cs, secrets);
+			_exit(0);
+		}
+
+		close(fd);
+	}
+
+	for (size_t i = 0; i < cs.size; ++i)
+		string_destroy(&secrets[i]);
+	free(secrets);
+	conf_set_destroy(&cs);
+	return 1;
+}
+
+static int
+connect_any(char const *hosts, char const *key)
+{
+	struct str_list list = str_list_create();
+	char *hosts_dup = strdup(hosts);
+	for (char *tok = strtok(hosts_dup, ","); tok; tok = strtok(NULL, ","))
+		str_list_add(&list, tok);
+	free(hosts_dup);
+
+	// objects are spread over the workers by name, starting from the next one
+	// whenever a worker cannot be reached.
+	size_t hash = 5381;
+	for (char const *c = key; *c; ++c)
+		hash = hash * 33 + (unsigned char)*c;
+
+	int fd = -1;
+	for (size_t i = 0; i < list.size && fd == -1; ++i)
+		fd = connect_host(list.data[(hash + i) % list.size]);
+
+	str_list_destroy(&list);
+	return fd;
+}
+
+static int
+connect_host(char const *host)
+{
+	char *name, *port;
+	if (!split_addr(host, &name, &port))
+		return -1;
+
+	struct addrinfo hints =
+	{
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res;
+	int err = getaddrinfo(name, port, &hints, &res);
+	free(name);
+	free(port);
+	if (err)
+		return -1;
+
+	int fd = -1;
+	for (struct addrinfo *ai = res; ai && fd == -1; ai = ai->ai_next)
+	{
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd != -1 && !connect_timed(fd, ai->ai_addr, ai->ai_addrlen))
+		{
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+
+	// a worker which stalls is given up on like one which cannot be reached,
+	// while the compile itself may take its time.
+	struct timeval snd_timeout = {.tv_sec = REXEC_IO_TIMEOUT, .tv_usec = 0};
+	struct timeval rcv_timeout = {.tv_sec = REXEC_COMPILE_TIMEOUT, .tv_usec = 0};
+	if (fd != -1
+	    && (setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &snd_timeout, sizeof(snd_timeout))
+	        || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &rcv_timeout, sizeof(rcv_timeout))))
+	{
+		close(fd);
+		fd = -1;
+	}
+
+	return fd;
+}
+
+static bool
+connect_timed(int fd, struct sockaddr const *addr, socklen_t addr_len)
+{
+	// the connection is made without blocking, so that a host which drops
+	// it is given up on well before the system would.
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK)
+	    || (connect(fd, addr, addr_len) && errno != EINPROGRESS))
+	{
+		return false;
+	}
+
+	struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+	int rc;
+	while ((rc = poll(&pfd, 1, REXEC_CONNECT_TIMEOUT * 1000)) == -1 && errno == EINTR)
+		;
+
+	int err;
+	socklen_t err_len = sizeof(err);
+	return rc == 1
+	       && !getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) && !err
+	       && !fcntl(fd, F_SETFL, flags);
+}
+
+static int
+listen_addr(char const *addr)
+{
+	char *host, *port;
+	if (!split_addr(addr, &host, &port))
+	{
+		fprintf(stderr, "invalid worker address: '%s'!\n", addr);
+		return -1;
+	}
+
+	struct addrinfo hints =
+	{
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+	struct addrinfo *res;
+	int err = getaddrinfo(host, port, &hints, &res);
+	free(host);
+	free(port);
+	if (err)
+	{
+		fprintf(stderr, "cannot resolve worker address: '%s'!\n", addr);
+		return -1;
+	}
+
+	int lfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	int one = 1;
+	if (lfd != -1
+	    && (setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))
+	        || bind(lfd, res->ai_addr, res->ai_addrlen)
+	        || listen(lfd, 64)))
+	{
+		close(lfd);
+		lfd = -1;
+	}
+
+	freeaddrinfo(res);
+	if (lfd == -1)
+		fprintf(stderr, "cannot listen on worker address: '%s'!\n", addr);
+	return lfd;
+}
+
+static bool
+remote_compile(int fd, struct string const *secret, char const *target,
+               struct string const *flags, struct string const *in,
+               char const *obj, int *out_rc)
+{
+	// request: magic, then the lengths of the secret, target, flags and
+	// input followed by all four, the flags as NUL-terminated words.
+	// response: exit code and the lengths of the output and object, followed
+	// by both.
+	char hdr[128];
+	sprintf(hdr, REXEC_MAGIC "%zu %zu %zu %zu\n", secret->len, strlen(target),
+	        flags->len, in->len);
+	if (!write_all(fd, hdr, strlen(hdr))
+	    || !write_all(fd, secret->str, secret->len)
+	    || !write_all(fd, target, strlen(target))
+	    || !write_all(fd, flags->str, flags->len)
+	    || !write_all(fd, in->str, in->len))
+	{
+		return false;
+	}
+
+	int rc;
+	size_t out_len, obj_len;
+	if (!read_line(fd, hdr, sizeof(hdr))
+	    || sscanf(hdr, "%d %zu %zu", &rc, &out_len, &obj_len) != 3)
+	{
+		return false;
+	}
+
+	char *output = malloc(out_len + 1);
+	char *obj_conts = malloc(obj_len + 1);
+	bool ok = read_all(fd, output, out_len) && read_all(fd, obj_conts, obj_len);
+
+	// the compiler's own diagnostics are passed on as if it ran here, once
+	// its object is in place.
+	if (ok && !rc)
+		ok = write_file(obj, obj_conts, obj_len);
+	if (ok)
+	{
+		fwrite(output, 1, out_len, stdout);
+		*out_rc = rc;
+	}
+
+	free(output);
+	free(obj_conts);
+	return ok;
+}
+
+static void
+serve(int fd, struct conf_set const *cs, struct string const *secrets)
+{
+	// a client which stalls would otherwise keep this process forever.
+	struct timeval timeout = {.tv_sec = REXEC_IO_TIMEOUT, .tv_usec = 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	char hdr[128];
+	size_t secret_len, target_len, flags_len, in_len;
+	if (!read_all(fd, hdr, strlen(REXEC_MAGIC))
+	    || strncmp(hdr, REXEC_MAGIC, strlen(REXEC_MAGIC))
+	    || !read_line(fd, hdr, sizeof(hdr))
+	    || sscanf(hdr, "%zu %zu %zu %zu", &secret_len, &target_len, &flags_len,
+	              &in_len) != 4
+	    || secret_len > REXEC_ARG_MAX
+	    || target_len > REXEC_ARG_MAX
+	    || flags_len > REXEC_ARG_MAX)
+	{
+		return;
+	}
+
+	// nothing is read of the flags and input until the client proved it knows
+	// the secret of the target it compiles for.
+	char *secret = malloc(secret_len + 1);
+	char *target = malloc(target_len + 1);
+	bool ok = read_all(fd, secret, secret_len) && read_all(fd, target, target_len);
+	target[target_len] = 0;
+
+	ssize_t ind = ok ? find_target(cs, target) : -1;
+	if (ind == -1 || !secrets[ind].len
+	    || !secret_eq(&secrets[ind], secret, secret_len))
+	{
+		if (ok)
+			fputs("rejected remote compile request!\n", stderr);
+		free(secret);
+		free(target);
+		return;
+	}
+
+	char *flags = malloc(flags_len + 1);
+	char *in = malloc(in_len + 1);
+	if (in && read_all(fd, flags, flags_len) && read_all(fd, in, in_len)
+	    && (!flags_len || !flags[flags_len - 1]))
+	{
+		run_compile(fd, &cs->data[ind], flags, flags_len, in, in_len);
+	}
+
+	free(in);
+	free(flags);
+	free(target);
+	free(secret);
+	close(fd);
+}
+
+static void
+run_compile(int fd, struct conf const *conf, char const *flags,
+            size_t flags_len, char const *in, size_t in_len)
+{
+	// every job gets a fresh directory, so concurrent jobs never clash.
+	char dir[] = "/tmp/mincbuild-worker-XXXXXX";
+	if (!mkdtemp(dir) || chdir(dir))
+		return;
+
+	// only the target's own compile command is ever run, with the flags the
+	// client sent as its arguments. a compile which cannot be run here gets
+	// no response, so that the client compiles locally instead.
+	char *cflags = quote_flags(flags, flags_len);
+	char *cmd = compile_remote_cmd(conf, cflags);
+	
+	struct string output = string_create();
+	struct proc proc;
+	int rc = write_file(REXEC_IN_NAME, in, in_len)
+	         && proc_spawn(&proc, cmd, 0, -1)
+	         ? proc_wait(&proc, &output, NULL)
+	         : -1;
+
+	struct string obj = string_create();
+	if (!rc && !read_file(REXEC_OUT_NAME, &obj))
+	{
+		string_push_str(&output, "remote compile produced no object!\n");
+		rc = 1;
+	}
+
+	char hdr[128];
+	sprintf(hdr, "%d %zu %zu\n", rc, output.len, obj.len);
+	if (rc != -1 && write_all(fd, hdr, strlen(hdr))
+	    && write_all(fd, output.str, output.len))
+	{
+		write_all(fd, obj.str, obj.len);
+	}
+
+	unlink(REXEC_IN_NAME);
+	unlink(REXEC_OUT_NAME);
+	chdir("/");
+	rmdir(dir);
+
+	string_destroy(&obj);
+	string_destroy(&output);
+	free(cmd);
+	free(cflags);
+}
+
+static bool
+read_secret(char const *file, struct string *out_secret)
+{
+	// a trailing newline, as most editors leave one, is not part of it.
+	if (!read_file(file, out_secret))
+		return false;
+
+	while (out_secret->len && isspace((unsigned char)out_secret->str[out_secret->len - 1]))
+		--out_secret->len;
+
+	return out_secret->len && out_secret->len <= REXEC_ARG_MAX;
+}
+
+static bool
+split_flags(char const *cflags, struct string *out_flags)
+{
+	// the flags are split into words like the shell would, so that the worker
+	// can quote every one of them again.
+	wordexp_t we;
+	if (wordexp(cflags, &we, WRDE_NOCMD))
+		return false;
+
+	for (size_t i = 0; i < we.we_wordc; ++i)
+		string_push_buf(out_flags, we.we_wordv[i], strlen(we.we_wordv[i]) + 1);
+
+	wordfree(&we);
+	return out_flags->len <= REXEC_ARG_MAX;
+}
+
+static char *
+quote_flags(char const *flags, size_t len)
+{
+	struct string quoted = string_create();
+	for (char const *word = flags; word < flags + len; word += strlen(word) + 1)
+	{
+		if (quoted.len)
+			string_push_ch(&quoted, ' ');
+		shell_quote_inplace(&quoted, word);
+	}
+
+	string_push_ch(&quoted, 0);
+	return quoted.str;
+}
+
+static bool
+secret_eq(struct string const *secret, char const *buf, size_t len)
+{
+	// every byte is compared, so that the time taken tells nothing about how
+	// much of a guess was right.
+	unsigned char diff = secret->len != len;
+	for (size_t i = 0; i < secret->len; ++i)
+		diff |= secret->str[i] ^ (i < len ? buf[i] : 0);
+
+	return !diff;
+}
+
+static ssize_t
+find_target(struct conf_set const *cs, char const *name)
+{
+	// the implicit target of a configuration without target sections goes
+	// by the empty name.
+	if (!*name)
+		return cs->size == 1 && !cs->data[0].name ? 0 : -1;
+
+	return conf_set_find(cs, name);
+}
+
+static bool
+write_all(int fd, char const *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = write(fd, buf, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+
+		buf += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static bool
+read_all(int fd, char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = read(fd, buf, len);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+
+		buf += n;
+		len -= n;
+	}
+
+	return true;
+}
+
+static bool
+read_line(int fd, char *buf, size_t cap)
+{
+	for (size_t i = 0; i < cap - 1; ++i)
+	{
+		if (!read_all(fd, &buf[i], 1))
+			return false;
+
+		if (buf[i] == '\n')
+		{
+			buf[i + 1] = 0;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool
+split_addr(char const *addr, char **out_host, char **out_port)
+{
+	// `host:port`, or just `port` for the loopback interface.
+	char const *colon = strrchr(addr, ':');
+	if (colon == addr || (colon && !colon[1]) || (!colon && !*addr))
+		return false;
+
+	*out_host = colon ? strndup(addr, colon - addr) : strdup("127.0.0.1");
+	*out_port = strdup(colon ? colon + 1 : addr);
+	return true;
+}
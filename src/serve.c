@@ -0,0 +1,244 @@
+#include "serve.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "build.h"
+
+#define REQ_MAX 4096
+
+static int listen_unix(char const *sock_path);
+static void handle(struct build *b, struct build_opts const *defaults, int fd);
+static bool read_req(int fd, char *out_req);
+
+int
+serve(char const *sock_path, char const *conf_file, char const *profile,
+      struct build_opts const *opts)
+{
+	struct build b;
+	int err = build_create(&b, conf_file, profile, true);
+	if (err)
+	{
+		fprintf(stderr, "cannot load build for serving: %s!\n", build_strerror(err));
+		return err;
+	}
+
+	int lfd = listen_unix(sock_path);
+	if (lfd == -1)
+	{
+		fprintf(stderr, "cannot listen on socket: '%s'!\n", sock_path);
+		build_destroy(&b);
+		return 1;
+	}
+
+	// a client going away mid-build must not take the server with it.
+	signal(SIGPIPE, SIG_IGN);
+	printf("serving builds on %s\n", sock_path);
+	fflush(stdout);
+
+	for (;;)
+	{
+		int fd = accept(lfd, NULL, NULL);
+		if (fd == -1)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			
+			fputs("failed to accept connection!\n", stderr);
+			build_destroy(&b);
+			return 1;
+		}
+
+		handle(&b, opts, fd);
+		close(fd);
+	}
+}
+
+int
+serve_client(char const *sock_path, int argc, char const *argv[])
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (strlen(sock_path) >= sizeof(addr.sun_path)
+	    || fd == -1
+	    || (strcpy(addr.sun_path, sock_path),
+	        connect(fd, (struct sockaddr *)&addr, sizeof(addr))))
+	{
+		fprintf(stderr, "cannot connect to build server: '%s'!\n", sock_path);
+		return 1;
+	}
+
+	// a request is a line of options, answered by the output of the build,
+	// a NUL and the result of the build.
+	struct string req = string_create();
+	for (int i = 0; i < argc; ++i)
+	{
+		if (i)
+			string_push_ch(&req, ' ');
+		string_push_str(&req, argv[i]);
+	}
+	string_push_ch(&req, '\n');
+
+	ssize_t nwritten = write(fd, req.str, req.len);
+	bool sent = nwritten >= 0 && (size_t)nwritten == req.len;
+	string_destroy(&req);
+	if (!sent)
+	{
+		fputs("failed to send build request!\n", stderr);
+		close(fd);
+		return 1;
+	}
+
+	struct string result = string_create();
+	bool done = false;
+	char buf[4096];
+	ssize_t n;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+	{
+		char *end = done ? buf : memchr(buf, 0, n);
+		if (!end)
+		{
+			fwrite(buf, 1, n, stdout);
+			fflush(stdout);
+			continue;
+		}
+
+		if (!done)
+		{
+			fwrite(buf, 1, end - buf, stdout);
+			++end;
+			done = true;
+		}
+		
+		string_push_buf(&result, end, buf + n - end);
+	}
+
+	close(fd);
+	string_push_ch(&result, 0);
+	int err = done ? atoi(result.str) : BUILD_ERR_PROC;
+	string_destroy(&result);
+
+	if (!done)
+		fputs("build server closed connection early!\n", stderr);
+	return err;
+}
+
+static int
+listen_unix(char const *sock_path)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(sock_path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, sock_path);
+
+	// a socket left behind by a server which was killed is replaced, while
+	// anything else at the path is left alone and makes binding fail.
+	struct stat s;
+	if (!lstat(sock_path, &s) && S_ISSOCK(s.st_mode))
+		unlink(sock_path);
+	
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+	
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 8))
+	{
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void
+handle(struct build *b, struct build_opts const *defaults, int fd)
+{
+	char req[REQ_MAX];
+	if (!read_req(fd, req))
+		return;
+
+	// only options which do not change what is loaded can be requested, the
+	// rest stay as the server was started.
+	struct build_opts opts = *defaults;
+	opts.force = opts.stats = opts.test = opts.skip_passed = false;
+	opts.graph.keep_going = opts.graph.verbose = opts.graph.threads = false;
+	char const *bad = NULL;
+	for (char *tok = strtok(req, " \t"); tok && !bad; tok = strtok(NULL, " \t"))
+	{
+		if (!strcmp(tok, "-k"))
+			opts.graph.keep_going = true;
+		else if (!strcmp(tok, "-r"))
+			opts.force = true;
+		else if (!strcmp(tok, "-v"))
+			opts.graph.verbose = true;
+		else if (!strcmp(tok, "--stats"))
+			opts.stats = true;
+		else if (!strcmp(tok, "--threads"))
+			opts.graph.threads = true;
+		else if (!strcmp(tok, "--test"))
+			opts.test = true;
+		else if (!strcmp(tok, "--skip-passed"))
+			opts.test = opts.skip_passed = true;
+		else
+			bad = tok;
+	}
+
+	// the build writes to the client as if it was run from there.
+	fflush(stdout);
+	fflush(stderr);
+	int saved_out = dup(STDOUT_FILENO), saved_err = dup(STDERR_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	dup2(fd, STDERR_FILENO);
+
+	int err = BUILD_ERR_USAGE;
+	if (bad)
+		fprintf(stderr, "option not allowed in build request: '%s'!\n", bad);
+	else
+		err = build_run(b, &opts);
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(saved_out, STDOUT_FILENO);
+	dup2(saved_err, STDERR_FILENO);
+	close(saved_out);
+	close(saved_err);
+
+	char result[32];
+	int len = sprintf(result, "%c%d\n", 0, err);
+	if (write(fd, result, len) != len)
+		fputs("failed to send build result!\n", stderr);
+	
+	printf("build finished: %s\n", build_strerror(err));
+	fflush(stdout);
+}
+
+static bool
+read_req(int fd, char *out_req)
+{
+	size_t len = 0;
+	while (len < REQ_MAX - 1)
+	{
+		ssize_t n = read(fd, &out_req[len], 1);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n != 1)
+			return false;
+
+		if (out_req[len++] == '\n')
+		{
+			out_req[len - 1] = 0;
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -0,0 +1,109 @@
+#include "shard.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+struct item
+{
+	char const *path;
+	double cost;
+	size_t target, src;
+};
+
+static int item_cmp(void const *lhs, void const *rhs);
+
+void
+shard_select(struct intern const *paths, struct id_list const *srcs,
+             struct id_list const *objs, struct bitset *up_to_date,
+             size_t ntargets, struct hist const *hist, size_t shard,
+             size_t nshards)
+{
+	// collect everything that still needs compiling, across all targets.
+	struct item *items = NULL;
+	size_t nitems = 0, cap = 0;
+	bool have_hist = true;
+	for (size_t i = 0; i < ntargets; ++i)
+	{
+		for (size_t j = 0; j < srcs[i].size; ++j)
+		{
+			if (bitset_test(&up_to_date[i], srcs[i].data[j]))
+				continue;
+
+			if (nitems >= cap)
+			{
+				cap = cap ? cap * 2 : 64;
+				items = realloc(items, sizeof(struct item) * cap);
+			}
+
+			items[nitems++] = (struct item)
+			{
+				.path = intern_str(paths, srcs[i].data[j]),
+				.target = i,
+				.src = srcs[i].data[j],
+			};
+
+			struct hist_rec const *rec = hist_find(hist, intern_str(paths, objs[i].data[j]));
+			have_hist = have_hist && rec;
+			if (rec)
+				items[nitems - 1].cost = rec->duration;
+		}
+	}
+
+	// compile times are only comparable with each other, so file sizes are
+	// used for all sources unless every one of them has been timed before.
+	if (!have_hist)
+	{
+		for (size_t i = 0; i < nitems; ++i)
+		{
+			struct stat s;
+			items[i].cost = stat(items[i].path, &s) ? 0.0 : s.st_size;
+		}
+	}
+
+	// longest processing time first: the most expensive remaining source
+	// goes to the least loaded shard. ties are broken by path and by shard
+	// index, so that every runner arrives at the same partition.
+	qsort(items, nitems, sizeof(struct item), item_cmp);
+
+	double *loads = calloc(nshards, sizeof(double));
+	size_t nmine = 0;
+	double mine = 0.0, total = 0.0;
+	for (size_t i = 0; i < nitems; ++i)
+	{
+		size_t min = 0;
+		for (size_t j = 1; j < nshards; ++j)
+			min = loads[j] < loads[min] ? j : min;
+
+		loads[min] += items[i].cost;
+		total += items[i].cost;
+		if (min == shard)
+		{
+			++nmine;
+			mine += items[i].cost;
+		}
+		else
+			bitset_set(&up_to_date[items[i].target], items[i].src);
+	}
+
+	printf("shard %zu/%zu: compiling %zu of %zu source(s), %.0f%% of the %s\n",
+	       shard + 1, nshards, nmine, nitems,
+	       total > 0.0 ? 100.0 * mine / total : 0.0,
+	       have_hist ? "recorded compile time" : "source size");
+
+	free(loads);
+	free(items);
+}
+
+static int
+item_cmp(void const *lhs, void const *rhs)
+{
+	struct item const *l = lhs, *r = rhs;
+	if (l->cost != r->cost)
+		return l->cost < r->cost ? 1 : -1;
+	return strcmp(l->path, r->path);
+}
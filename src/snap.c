@@ -0,0 +1,417 @@
+#include "snap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define SNAP_MAGIC "mincbuild-snap 1"
+
+struct walk_anc
+{
+	dev_t dev;
+	ino_t ino;
+	struct walk_anc const *up;
+};
+
+static void walk(struct snap *snap, char const *path, struct str_list const *exts, struct str_list *out_files, struct walk_anc const *up);
+static void list_dir(struct snap *snap, char const *path, struct snap_dir *out_dir);
+static bool ck_fresh(struct snap_dir const *dir, struct stat const *s, struct timespec const *taken);
+static struct snap_dir const *find_old(struct snap const *snap, char const *path);
+static void cur_add(struct snap *snap, struct snap_dir const *dir);
+static bool read_names(struct snap *snap, FILE *fp, size_t cnt, struct str_list *out_names);
+static bool ck_savable(struct snap_dir const *dir);
+static int dir_cmp(void const *lhs, void const *rhs);
+static void dir_destroy(struct snap_dir *dir);
+
+struct snap
+snap_load(char const *file)
+{
+	struct snap snap =
+	{
+		.old = NULL,
+		.cur = malloc(sizeof(struct snap_dir)),
+		.old_size = 0,
+		.cur_size = 0,
+		.cur_cap = 1,
+		.hits = 0,
+		.misses = 0,
+		.arena = arena_create(),
+	};
+
+	// directories modified after this point must not be trusted by the next
+	// run, so the new snapshot is stamped before anything is listed.
+	clock_gettime(CLOCK_REALTIME, &snap.cur_taken);
+
+	FILE *fp = fopen(file, "rb");
+	if (!fp)
+		return snap;
+
+	long long sec;
+	long nsec;
+	if (fscanf(fp, SNAP_MAGIC " %lld %ld\n", &sec, &nsec) != 2)
+	{
+		fclose(fp);
+		return snap;
+	}
+	snap.old_taken = (struct timespec){.tv_sec = sec, .tv_nsec = nsec};
+
+	size_t old_cap = 1;
+	snap.old = malloc(sizeof(struct snap_dir));
+
+	// a damaged snapshot is not an error, it just means everything gets
+	// listed again.
+	for (;;)
+	{
+		unsigned long long dev, ino;
+		size_t nfiles, ndirs;
+		int path_off;
+		char *line = NULL;
+		size_t line_cap = 0;
+		ssize_t line_len = getline(&line, &line_cap, fp);
+		if (line_len <= 0)
+		{
+			free(line);
+			break;
+		}
+
+		if (line[line_len - 1] == '\n')
+			line[--line_len] = 0;
+
+		if (sscanf(line, "d %llu %llu %lld %ld %zu %zu %n", &dev, &ino, &sec,
+		           &nsec, &nfiles, &ndirs, &path_off) != 6)
+		{
+			free(line);
+			goto corrupt;
+		}
+
+		struct snap_dir dir =
+		{
+			.path = arena_strdup(&snap.arena, line + path_off),
+			.dev = dev,
+			.ino = ino,
+			.mtime = {.tv_sec = sec, .tv_nsec = nsec},
+			.files = str_list_create_borrowed(),
+			.dirs = str_list_create_borrowed(),
+		};
+		free(line);
+
+		if (!read_names(&snap, fp, nfiles, &dir.files)
+		    || !read_names(&snap, fp, ndirs, &dir.dirs))
+		{
+			dir_destroy(&dir);
+			goto corrupt;
+		}
+
+		if (snap.old_size >= old_cap)
+		{
+			old_cap *= 2;
+			snap.old = realloc(snap.old, sizeof(struct snap_dir) * old_cap);
+		}
+		snap.old[snap.old_size++] = dir;
+	}
+
+	fclose(fp);
+	qsort(snap.old, snap.old_size, sizeof(struct snap_dir), dir_cmp);
+	return snap;
+
+corrupt:
+	fclose(fp);
+	for (size_t i = 0; i < snap.old_size; ++i)
+		dir_destroy(&snap.old[i]);
+	snap.old_size = 0;
+	return snap;
+}
+
+void
+snap_save(struct snap *snap, char const *file)
+{
+	char *tmp_file = malloc(strlen(file) + 5);
+	sprintf(tmp_file, "%s.tmp", file);
+	mkdir_recursive(tmp_file);
+
+	FILE *fp = fopen(tmp_file, "wb");
+	if (!fp)
+	{
+		fprintf(stderr, "cannot write directory snapshot: '%s'\n", tmp_file);
+		free(tmp_file);
+		return;
+	}
+
+	// the same directory may have been walked through both the source and
+	// the include directory.
+	qsort(snap->cur, snap->cur_size, sizeof(struct snap_dir), dir_cmp);
+
+	fprintf(fp, SNAP_MAGIC " %lld %ld\n", (long long)snap->cur_taken.tv_sec,
+	        (long)snap->cur_taken.tv_nsec);
+
+	for (size_t i = 0; i < snap->cur_size; ++i)
+	{
+		struct snap_dir const *dir = &snap->cur[i];
+		if ((i > 0 && !strcmp(dir->path, snap->cur[i - 1].path))
+		    || !ck_savable(dir))
+		{
+			continue;
+		}
+
+		fprintf(fp, "d %llu %llu %lld %ld %zu %zu %s\n",
+		        (unsigned long long)dir->dev, (unsigned long long)dir->ino,
+		        (long long)dir->mtime.tv_sec, (long)dir->mtime.tv_nsec,
+		        dir->files.size, dir->dirs.size, dir->path);
+
+		for (size_t j = 0; j < dir->files.size; ++j)
+			fprintf(fp, "%s\n", dir->files.data[j]);
+		for (size_t j = 0; j < dir->dirs.size; ++j)
+			fprintf(fp, "%s\n", dir->dirs.data[j]);
+	}
+
+	if (fclose(fp) || rename(tmp_file, file))
+	{
+		fprintf(stderr, "cannot write directory snapshot: '%s'\n", file);
+		remove(tmp_file);
+	}
+
+	free(tmp_file);
+}
+
+void
+snap_destroy(struct snap *snap)
+{
+	for (size_t i = 0; i < snap->old_size; ++i)
+		dir_destroy(&snap->old[i]);
+
+	for (size_t i = 0; i < snap->cur_size; ++i)
+		dir_destroy(&snap->cur[i]);
+
+	free(snap->old);
+	free(snap->cur);
+	arena_destroy(&snap->arena);
+}
+
+struct str_list
+snap_ext_find(struct snap *snap, char const *dir, struct str_list const *exts)
+{
+	struct str_list files = str_list_create();
+	walk(snap, dir, exts, &files, NULL);
+	return files;
+}
+
+static void
+walk(struct snap *snap, char const *path, struct str_list const *exts,
+     struct str_list *out_files, struct walk_anc const *up)
+{
+	struct stat s;
+	if (stat(path, &s) || !S_ISDIR(s.st_mode))
+		return;
+
+	// symbolic links are followed, so guard against directory cycles the
+	// same way `FTS_LOGICAL` would.
+	for (struct walk_anc const *anc = up; anc; anc = anc->up)
+	{
+		if (anc->dev == s.st_dev && anc->ino == s.st_ino)
+			return;
+	}
+
+	// names are all kept in the snapshot's arena, so reusing an old listing
+	// only copies pointers.
+	struct snap_dir dir;
+	struct snap_dir const *old = find_old(snap, path);
+	if (old && ck_fresh(old, &s, &snap->old_taken))
+	{
+		dir = (struct snap_dir)
+		{
+			.files = str_list_copy(&old->files),
+			.dirs = str_list_copy(&old->dirs),
+		};
+		++snap->hits;
+	}
+	else
+	{
+		list_dir(snap, path, &dir);
+		++snap->misses;
+	}
+
+	dir.path = arena_strdup(&snap->arena, path);
+	dir.dev = s.st_dev;
+	dir.ino = s.st_ino;
+	dir.mtime = s.st_mtim;
+
+	struct string ent_path = string_create();
+	string_push_str(&ent_path, path);
+	if (ent_path.len > 0 && path[ent_path.len - 1] != '/')
+		string_push_ch(&ent_path, '/');
+	size_t dir_len = ent_path.len;
+
+	for (size_t i = 0; i < dir.files.size; ++i)
+	{
+		char const *name = dir.files.data[i];
+		char const *ext = strrchr(name, '.');
+		ext = ext && ext != name ? ext + 1 : "\0";
+
+		if (!str_list_contains(exts, ext))
+			continue;
+
+		ent_path.len = dir_len;
+		string_push_buf(&ent_path, name, strlen(name) + 1);
+		str_list_add(out_files, ent_path.str);
+	}
+
+	struct walk_anc anc =
+	{
+		.dev = s.st_dev,
+		.ino = s.st_ino,
+		.up = up,
+	};
+
+	for (size_t i = 0; i < dir.dirs.size; ++i)
+	{
+		ent_path.len = dir_len;
+		char const *name = dir.dirs.data[i];
+		string_push_buf(&ent_path, name, strlen(name) + 1);
+		walk(snap, ent_path.str, exts, out_files, &anc);
+	}
+
+	string_destroy(&ent_path);
+	cur_add(snap, &dir);
+}
+
+static void
+list_dir(struct snap *snap, char const *path, struct snap_dir *out_dir)
+{
+	out_dir->files = str_list_create_borrowed();
+	out_dir->dirs = str_list_create_borrowed();
+
+	DIR *dp = opendir(path);
+	if (!dp)
+		return;
+
+	size_t path_len = strlen(path);
+	struct dirent *ent;
+	while ((ent = readdir(dp)))
+	{
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		unsigned char type = ent->d_type;
+		if (type == DT_LNK || type == DT_UNKNOWN)
+		{
+			char *ent_path = malloc(path_len + strlen(ent->d_name) + 2);
+			sprintf(ent_path, "%s/%s", path, ent->d_name);
+
+			struct stat s;
+			type = stat(ent_path, &s) ? DT_UNKNOWN
+			       : S_ISDIR(s.st_mode) ? DT_DIR
+			       : S_ISREG(s.st_mode) ? DT_REG
+			       : DT_UNKNOWN;
+
+			free(ent_path);
+		}
+
+		if (type == DT_REG || type == DT_DIR)
+		{
+			char *name = arena_strdup(&snap->arena, ent->d_name);
+			str_list_add(type == DT_REG ? &out_dir->files : &out_dir->dirs, name);
+		}
+	}
+
+	closedir(dp);
+}
+
+static bool
+ck_fresh(struct snap_dir const *dir, struct stat const *s,
+         struct timespec const *taken)
+{
+	// a directory whose mtime falls in the same second the snapshot was
+	// taken in may have been changed again without its mtime moving, so only
+	// trust listings that are strictly older.
+	return dir->dev == s->st_dev
+	       && dir->ino == s->st_ino
+	       && dir->mtime.tv_sec == s->st_mtim.tv_sec
+	       && dir->mtime.tv_nsec == s->st_mtim.tv_nsec
+	       && dir->mtime.tv_sec < taken->tv_sec;
+}
+
+static struct snap_dir const *
+find_old(struct snap const *snap, char const *path)
+{
+	if (!snap->old_size)
+		return NULL;
+
+	struct snap_dir key = {.path = (char *)path};
+	return bsearch(&key, snap->old, snap->old_size, sizeof(struct snap_dir),
+	               dir_cmp);
+}
+
+static void
+cur_add(struct snap *snap, struct snap_dir const *dir)
+{
+	if (snap->cur_size >= snap->cur_cap)
+	{
+		snap->cur_cap *= 2;
+		snap->cur = realloc(snap->cur, sizeof(struct snap_dir) * snap->cur_cap);
+	}
+
+	snap->cur[snap->cur_size++] = *dir;
+}
+
+static bool
+read_names(struct snap *snap, FILE *fp, size_t cnt, struct str_list *out_names)
+{
+	char *line = NULL;
+	size_t line_cap = 0;
+
+	for (size_t i = 0; i < cnt; ++i)
+	{
+		ssize_t line_len = getline(&line, &line_cap, fp);
+		if (line_len <= 0 || line[line_len - 1] != '\n')
+		{
+			free(line);
+			return false;
+		}
+
+		char *name = arena_strndup(&snap->arena, line, line_len - 1);
+		str_list_add(out_names, name);
+	}
+
+	free(line);
+	return true;
+}
+
+static bool
+ck_savable(struct snap_dir const *dir)
+{
+	// the snapshot is line based, so names containing newlines cannot be
+	// stored; such directories are simply listed every run.
+	if (strchr(dir->path, '\n'))
+		return false;
+
+	for (size_t i = 0; i < dir->files.size; ++i)
+	{
+		if (strchr(dir->files.data[i], '\n'))
+			return false;
+	}
+
+	for (size_t i = 0; i < dir->dirs.size; ++i)
+	{
+		if (strchr(dir->dirs.data[i], '\n'))
+			return false;
+	}
+
+	return true;
+}
+
+static int
+dir_cmp(void const *lhs, void const *rhs)
+{
+	struct snap_dir const *l = lhs, *r = rhs;
+	return strcmp(l->path, r->path);
+}
+
+static void
+dir_destroy(struct snap_dir *dir)
+{
+	str_list_destroy(&dir->files);
+	str_list_destroy(&dir->dirs);
+}
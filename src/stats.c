@@ -0,0 +1,117 @@
+#include "stats.h"
+
+#include <time.h>
+
+#include <sys/resource.h>
+
+struct stats stats;
+
+static void finalize(void);
+
+uint64_t
+stats_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+stats_add(uint64_t *ctr, uint64_t n)
+{
+	__atomic_add_fetch(ctr, n, __ATOMIC_RELAXED);
+}
+
+void
+stats_print(FILE *fp)
+{
+	finalize();
+	
+	fprintf(fp, "build statistics:\n"
+	        "\tconfiguration       %10.3f ms\n"
+	        "\tgenerating          %10.3f ms\n"
+	        "\tdiscovery           %10.3f ms\n"
+	        "\tpruning             %10.3f ms\n"
+	        "\tscheduling          %10.3f ms\n"
+	        "\tbuilding            %10.3f ms\n"
+	        "\tprofile training    %10.3f ms\n"
+	        "\ttesting             %10.3f ms\n"
+	        "\ttotal               %10.3f ms\n"
+	        "\tfiles discovered    %10llu\n"
+	        "\tsnapshot hits       %10llu\n"
+	        "\tsnapshot misses     %10llu\n"
+	        "\tfiles read          %10llu\n"
+	        "\tbytes read          %10llu\n"
+	        "\tstat calls          %10llu\n"
+	        "\tinclude scanning    %10.3f ms\n"
+	        "\tscan cache hits     %10llu\n"
+	        "\tjobs spawned        %10llu\n"
+	        "\tchild CPU time      %10.3f ms\n"
+	        "\tcompile time        %10.3f ms\n"
+	        "\tlink time           %10.3f ms\n"
+	        "\tLTO link time       %10.3f ms\n"
+	        "\tpeak memory         %10llu KiB\n",
+	        stats.conf_ns / 1e6, stats.gen_ns / 1e6, stats.discover_ns / 1e6,
+	        stats.prune_ns / 1e6, stats.schedule_ns / 1e6, stats.build_ns / 1e6,
+	        stats.train_ns / 1e6,
+	        stats.test_ns / 1e6, stats.total_ns / 1e6,
+	        (unsigned long long)stats.files_found,
+	        (unsigned long long)stats.snap_hits,
+	        (unsigned long long)stats.snap_misses,
+	        (unsigned long long)stats.files_read,
+	        (unsigned long long)stats.bytes_read,
+	        (unsigned long long)stats.stat_calls, stats.scan_ns / 1e6,
+	        (unsigned long long)stats.cache_hits,
+	        (unsigned long long)stats.jobs_spawned, stats.child_cpu_ns / 1e6,
+	        stats.compile_ns / 1e6, stats.link_ns / 1e6, stats.lto_ns / 1e6,
+	        (unsigned long long)stats.peak_rss);
+}
+
+void
+stats_write_json(FILE *fp)
+{
+	finalize();
+
+	fprintf(fp, "{\"conf_ns\":%llu,\"gen_ns\":%llu,\"discover_ns\":%llu,"
+	        "\"prune_ns\":%llu,"
+	        "\"schedule_ns\":%llu,\"build_ns\":%llu,\"train_ns\":%llu,"
+	        "\"test_ns\":%llu,"
+	        "\"total_ns\":%llu,"
+	        "\"files_found\":%llu,\"snap_hits\":%llu,\"snap_misses\":%llu,"
+	        "\"files_read\":%llu,\"bytes_read\":%llu,\"stat_calls\":%llu,"
+	        "\"scan_ns\":%llu,\"cache_hits\":%llu,\"jobs_spawned\":%llu,"
+	        "\"child_cpu_ns\":%llu,\"compile_ns\":%llu,\"link_ns\":%llu,"
+	        "\"lto_ns\":%llu,"
+	        "\"peak_rss_kib\":%llu}\n",
+	        (unsigned long long)stats.conf_ns,
+	        (unsigned long long)stats.gen_ns,
+	        (unsigned long long)stats.discover_ns,
+	        (unsigned long long)stats.prune_ns,
+	        (unsigned long long)stats.schedule_ns,
+	        (unsigned long long)stats.build_ns,
+	        (unsigned long long)stats.train_ns,
+	        (unsigned long long)stats.test_ns,
+	        (unsigned long long)stats.total_ns,
+	        (unsigned long long)stats.files_found,
+	        (unsigned long long)stats.snap_hits,
+	        (unsigned long long)stats.snap_misses,
+	        (unsigned long long)stats.files_read,
+	        (unsigned long long)stats.bytes_read,
+	        (unsigned long long)stats.stat_calls,
+	        (unsigned long long)stats.scan_ns,
+	        (unsigned long long)stats.cache_hits,
+	        (unsigned long long)stats.jobs_spawned,
+	        (unsigned long long)stats.child_cpu_ns,
+	        (unsigned long long)stats.compile_ns,
+	        (unsigned long long)stats.link_ns,
+	        (unsigned long long)stats.lto_ns,
+	        (unsigned long long)stats.peak_rss);
+}
+
+static void
+finalize(void)
+{
+	struct rusage ru;
+	if (!getrusage(RUSAGE_SELF, &ru))
+		stats.peak_rss = ru.ru_maxrss;
+}
@@ -0,0 +1,293 @@
+#include "test.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "graph.h"
+
+#define PASS_FILE "mincbuild.test"
+#define LOG_DIR "test"
+#define HIST_PREFIX "test:"
+
+struct item
+{
+	// `name` is what the test is recorded as in the history, and `sig` covers
+	// its command and everything it runs. a `blocked` test is not run, as
+	// one of the targets it depends on did not build.
+	struct test_conf const *test;
+	char *name, *log;
+	size_t sig, job;
+	double cost;
+	bool skipped, blocked;
+};
+
+static struct str_map passes_load(char const *file);
+static bool passes_save(struct item const *items, size_t nitems, struct graph const *graph, char const *file);
+static size_t mk_sig(struct conf_set const *cs, struct test_conf const *test);
+static int item_cmp(void const *lhs, void const *rhs);
+static char *mk_cmd(void *vp_test);
+
+bool
+test_run(struct conf_set const *cs, bool const *built, struct hist *hist,
+         bool skip_passed, struct graph_opts const *opts)
+{
+	if (!cs->ntests)
+		return true;
+
+	char *pass_file = malloc(strlen(cs->lib_dir) + strlen(PASS_FILE) + 2);
+	sprintf(pass_file, "%s/%s", cs->lib_dir, PASS_FILE);
+	struct str_map passes = passes_load(pass_file);
+
+	struct item *items = malloc(sizeof(struct item) * cs->ntests);
+	for (size_t i = 0; i < cs->ntests; ++i)
+	{
+		struct test_conf const *test = &cs->tests[i];
+		struct item *item = &items[i];
+		
+		*item = (struct item)
+		{
+			.test = test,
+			.name = malloc(strlen(HIST_PREFIX) + strlen(test->name) + 1),
+			.log = malloc(strlen(cs->lib_dir) + strlen(test->name) + 10),
+			.sig = mk_sig(cs, test),
+			.job = SIZE_MAX,
+			.blocked = false,
+		};
+		sprintf(item->name, HIST_PREFIX "%s", test->name);
+		sprintf(item->log, "%s/" LOG_DIR "/%s.log", cs->lib_dir, test->name);
+
+		struct hist_rec const *rec = hist_find(hist, item->name);
+		item->cost = rec ? rec->duration : -1.0;
+		for (size_t j = 0; j < test->deps.size; ++j)
+		{
+			if (!built[conf_set_find(cs, test->deps.data[j])])
+				item->blocked = true;
+		}
+
+		size_t sig;
+		item->skipped = !item->blocked && skip_passed && str_map_get(&passes, test->name, &sig)
+		                && sig == item->sig;
+	}
+
+	// the pool is kept busy longest by starting the slowest tests first, and
+	// tests never timed before may be among them.
+	qsort(items, cs->ntests, sizeof(struct item), item_cmp);
+
+	struct graph graph = graph_create(opts);
+	graph.mem_budget = cs->mem_budget;
+	graph.nice = cs->job_nice;
+	graph.affinity = cs->job_affinity;
+	graph.independent = true;
+
+	size_t mean_rss = hist_mean_rss(hist);
+	for (size_t i = 0; i < cs->ntests; ++i)
+	{
+		struct item *item = &items[i];
+		if (item->skipped || item->blocked)
+			continue;
+
+		// a log left from an earlier run would pass for one of this run.
+		unlink(item->log);
+		struct hist_rec const *rec = hist_find(hist, item->name);
+
+		char *err = malloc(strlen(item->log) + 36);
+		sprintf(err, "test failed, output saved to: '%s'!", item->log);
+
+		struct job job =
+		{
+			.mk_cmd = mk_cmd,
+			.ctx = (void *)item->test,
+			.name = strdup(item->name),
+			.err = err,
+			.success_rc = 0,
+			.counted = true,
+			.mem_est = rec ? rec->peak_rss : mean_rss,
+			.timeout = item->test->timeout,
+			.log = strdup(item->log),
+			.quiet = true,
+		};
+		item->job = graph_add(&graph, &job);
+	}
+
+	bool success = graph_run(&graph);
+
+	// the summary lists every test which did not pass again, so that they
+	// are not lost among the output of the others.
+	size_t npassed = 0, nfailed = 0, ntimed_out = 0, nskipped = 0, nnot_run = 0;
+	double duration = 0.0;
+	for (size_t i = 0; i < cs->ntests; ++i)
+	{
+		struct item const *item = &items[i];
+		if (item->skipped)
+		{
+			++nskipped;
+			continue;
+		}
+		else if (item->blocked)
+		{
+			++nnot_run;
+			continue;
+		}
+
+		struct job *job = &graph.data[item->job];
+		if (job->measured)
+		{
+			++npassed;
+			duration += job->duration;
+			hist_put(hist, &(struct hist_rec)
+			{
+				.name = job->name,
+				.peak_rss = job->peak_rss,
+				.size = 0,
+				.duration = job->duration,
+				.cpu_time = job->cpu_time,
+			});
+		}
+		else if (job->timed_out)
+			++ntimed_out;
+		else if (access(item->log, F_OK))
+			++nnot_run;
+		else
+			++nfailed;
+	}
+
+	printf("tests: %zu passed in %.2f s, %zu failed, %zu timed out, %zu "
+	       "skipped, %zu not run\n", npassed, duration, nfailed, ntimed_out,
+	       nskipped, nnot_run);
+	for (size_t i = 0; i < cs->ntests; ++i)
+	{
+		struct item const *item = &items[i];
+		if (item->skipped
+		    || (!item->blocked && graph.data[item->job].measured))
+		{
+			continue;
+		}
+
+		printf("\t%s %s\t%s\n",
+		       item->blocked ? "NOT RUN"
+		       : graph.data[item->job].timed_out ? "TIMEOUT"
+		       : "FAILED ",
+		       item->test->name, item->log);
+	}
+
+	success = passes_save(items, cs->ntests, &graph, pass_file) && success;
+
+	graph_destroy(&graph);
+	str_map_destroy(&passes);
+	free(pass_file);
+	for (size_t i = 0; i < cs->ntests; ++i)
+	{
+		free(items[i].name);
+		free(items[i].log);
+	}
+	free(items);
+
+	return success;
+}
+
+static struct str_map
+passes_load(char const *file)
+{
+	// the signature each test last passed with, one line per test of the
+	// form `<sig> <name>`.
+	struct str_map passes = str_map_create();
+	FILE *fp = fopen(file, "rb");
+	if (!fp)
+		return passes;
+
+	char *line = NULL;
+	size_t line_cap = 0;
+	while (getline(&line, &line_cap, fp) > 0)
+	{
+		size_t sig;
+		int name_off;
+		if (sscanf(line, "%zx %n", &sig, &name_off) != 1)
+			continue;
+		
+		line[strcspn(line, "\n")] = 0;
+		str_map_put(&passes, line + name_off, sig);
+	}
+
+	free(line);
+	fclose(fp);
+	return passes;
+}
+
+static bool
+passes_save(struct item const *items, size_t nitems,
+            struct graph const *graph, char const *file)
+{
+	// tests which passed now replace their earlier pass and skipped tests
+	// keep theirs, anything else has to pass again before it is skipped.
+	struct string buf = string_create();
+	char line[24];
+	for (size_t i = 0; i < nitems; ++i)
+	{
+		struct item const *item = &items[i];
+		if (!item->skipped
+		    && (item->job == SIZE_MAX || !graph->data[item->job].measured))
+		{
+			continue;
+		}
+
+		sprintf(line, "%016zx ", item->sig);
+		string_push_str(&buf, line);
+		string_push_str(&buf, item->test->name);
+		string_push_ch(&buf, '\n');
+	}
+
+	mkdir_recursive(file);
+	bool ok = write_file(file, buf.str, buf.len);
+	string_destroy(&buf);
+	return ok;
+}
+
+static size_t
+mk_sig(struct conf_set const *cs, struct test_conf const *test)
+{
+	// what is tested are the outputs of the targets the test depends on, and
+	// the program it runs if that is a file of its own. outputs are linked
+	// again by every build, so they are told apart by their contents.
+	struct str_list bins = str_list_create();
+	for (size_t i = 0; i < test->deps.size; ++i)
+	{
+		struct conf const *conf = &cs->data[conf_set_find(cs, test->deps.data[i])];
+		if (conf->produce_output)
+			str_list_add(&bins, conf->output);
+	}
+
+	char *prog = strndup(test->cmd, strcspn(test->cmd, " \t"));
+	str_list_add(&bins, prog);
+	free(prog);
+
+	size_t sig = str_hash(test->cmd);
+	for (size_t i = 0; i < bins.size; ++i)
+		sig = file_hash(bins.data[i], sig);
+
+	str_list_destroy(&bins);
+	return sig;
+}
+
+static int
+item_cmp(void const *lhs, void const *rhs)
+{
+	// longest first, with those which were never timed before all others.
+	double lcost = ((struct item const *)lhs)->cost;
+	double rcost = ((struct item const *)rhs)->cost;
+	lcost = lcost < 0.0 ? 1e300 : lcost;
+	rcost = rcost < 0.0 ? 1e300 : rcost;
+	return lcost < rcost ? 1 : lcost > rcost ? -1 : 0;
+}
+
+static char *
+mk_cmd(void *vp_test)
+{
+	struct test_conf const *test = vp_test;
+	return strdup(test->cmd);
+}
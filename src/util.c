@@ -1,6 +1,7 @@
 #include "util.h"
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +11,14 @@
 
 #define SANITIZE_ESCAPE " \t\n\v\f\r\\'\"<>;"
 #define FMT_SPEC_CH '%'
+#define STR_MAP_INIT_CAP 16
+#define ARENA_BLK_SIZE 16384
+#define ARENA_ALIGN 16
+#define BITSET_WORD_BITS (8 * sizeof(unsigned long))
+
+static size_t arena_pad(struct arena_blk const *blk);
+static void tmpl_push(struct fmt_tmpl *t, struct fmt_tok const *tok);
+static void tmpl_push_lit(struct fmt_tmpl *t, struct string *lit);
 
 struct string
 string_create(void)
@@ -43,8 +52,21 @@ string_push_ch(struct string *s, char ch)
 void
 string_push_str(struct string *s, char const *str)
 {
-	for (char const *c = str; *c; ++c)
-		string_push_ch(s, *c);
+	string_push_buf(s, str, strlen(str));
+}
+
+void
+string_push_buf(struct string *s, char const *buf, size_t len)
+{
+	if (s->len + len > s->cap)
+	{
+		while (s->len + len > s->cap)
+			s->cap *= 2;
+		s->str = realloc(s->str, s->cap);
+	}
+
+	memcpy(s->str + s->len, buf, len);
+	s->len += len;
 }
 
 char *
@@ -61,13 +83,22 @@ str_list_create(void)
 		.data = malloc(sizeof(char *)),
 		.size = 0,
 		.cap = 1,
+		.borrowed = false,
 	};
 }
 
+struct str_list
+str_list_create_borrowed(void)
+{
+	struct str_list s = str_list_create();
+	s.borrowed = true;
+	return s;
+}
+
 void
 str_list_destroy(struct str_list *s)
 {
-	for (size_t i = 0; i < s->size; ++i)
+	for (size_t i = 0; i < s->size && !s->borrowed; ++i)
 		free(s->data[i]);
 
 	free(s->data);
@@ -76,7 +107,8 @@ str_list_destroy(struct str_list *s)
 struct str_list
 str_list_copy(struct str_list const *s)
 {
-	struct str_list cp = str_list_create();
+	struct str_list cp = s->borrowed ? str_list_create_borrowed()
+	                     : str_list_create();
 
 	for (size_t i = 0; i < s->size; ++i)
 		str_list_add(&cp, s->data[i]);
@@ -93,13 +125,15 @@ str_list_add(struct str_list *s, char const *new)
 		s->data = realloc(s->data, sizeof(char *) * s->cap);
 	}
 
-	s->data[s->size++] = strdup(new);
+	s->data[s->size++] = s->borrowed ? (char *)new : strdup(new);
 }
 
 void
 str_list_rm(struct str_list *s, size_t ind)
 {
-	free(s->data[ind]);
+	if (!s->borrowed)
+		free(s->data[ind]);
+
 	str_list_rm_no_free(s, ind);
 }
 
@@ -122,6 +156,309 @@ str_list_contains(struct str_list const *s, char const *str)
 	return false;
 }
 
+struct arena
+arena_create(void)
+{
+	return (struct arena){.head = NULL};
+}
+
+void
+arena_destroy(struct arena *a)
+{
+	while (a->head)
+	{
+		struct arena_blk *next = a->head->next;
+		free(a->head);
+		a->head = next;
+	}
+}
+
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	// the data of a block need not start at an aligned address, so it is
+	// the returned pointer which is aligned and not the size.
+	size_t pad = a->head ? arena_pad(a->head) : 0;
+	if (!a->head || a->head->size - a->head->used < pad + size)
+	{
+		size_t min_size = size + ARENA_ALIGN - 1;
+		size_t blk_size = min_size > ARENA_BLK_SIZE ? min_size : ARENA_BLK_SIZE;
+		struct arena_blk *blk = malloc(sizeof(struct arena_blk) + blk_size);
+		blk->size = blk_size;
+		blk->used = 0;
+		pad = arena_pad(blk);
+
+		// oversized allocations get a block of their own behind the current
+		// one so the remaining space of the current block is not wasted.
+		if (a->head && blk_size > ARENA_BLK_SIZE)
+		{
+			blk->next = a->head->next;
+			a->head->next = blk;
+			blk->used = pad + size;
+			return blk->data + pad;
+		}
+
+		blk->next = a->head;
+		a->head = blk;
+	}
+
+	void *p = a->head->data + a->head->used + pad;
+	a->head->used += pad + size;
+	return p;
+}
+
+char *
+arena_strdup(struct arena *a, char const *str)
+{
+	return arena_strndup(a, str, strlen(str));
+}
+
+char *
+arena_strndup(struct arena *a, char const *str, size_t len)
+{
+	char *p = arena_alloc(a, len + 1);
+	memcpy(p, str, len);
+	p[len] = 0;
+	return p;
+}
+
+struct str_map
+str_map_create(void)
+{
+	return (struct str_map)
+	{
+		.data = calloc(STR_MAP_INIT_CAP, sizeof(struct str_map_ent)),
+		.size = 0,
+		.cap = STR_MAP_INIT_CAP,
+	};
+}
+
+void
+str_map_destroy(struct str_map *m)
+{
+	for (size_t i = 0; i < m->cap; ++i)
+		free(m->data[i].key);
+
+	free(m->data);
+}
+
+char const *
+str_map_put(struct str_map *m, char const *key, size_t val)
+{
+	// keep load at or below one half so probe sequences stay short.
+	if (2 * (m->size + 1) > m->cap)
+	{
+		struct str_map old = *m;
+		m->cap *= 2;
+		m->size = 0;
+		m->data = calloc(m->cap, sizeof(struct str_map_ent));
+
+		for (size_t i = 0; i < old.cap; ++i)
+		{
+			if (!old.data[i].key)
+				continue;
+
+			size_t j = str_hash(old.data[i].key) & (m->cap - 1);
+			while (m->data[j].key)
+				j = (j + 1) & (m->cap - 1);
+
+			m->data[j] = old.data[i];
+			++m->size;
+		}
+
+		free(old.data);
+	}
+
+	size_t i = str_hash(key) & (m->cap - 1);
+	while (m->data[i].key && strcmp(m->data[i].key, key))
+		i = (i + 1) & (m->cap - 1);
+
+	if (!m->data[i].key)
+	{
+		m->data[i].key = strdup(key);
+		++m->size;
+	}
+
+	m->data[i].val = val;
+	return m->data[i].key;
+}
+
+bool
+str_map_get(struct str_map const *m, char const *key, size_t *out_val)
+{
+	size_t i = str_hash(key) & (m->cap - 1);
+	while (m->data[i].key)
+	{
+		if (!strcmp(m->data[i].key, key))
+		{
+			*out_val = m->data[i].val;
+			return true;
+		}
+
+		i = (i + 1) & (m->cap - 1);
+	}
+
+	return false;
+}
+
+size_t
+str_hash(char const *str)
+{
+	// FNV-1a.
+	size_t hash = 14695981039346656037ull;
+	for (unsigned char const *c = (unsigned char const *)str; *c; ++c)
+	{
+		hash ^= *c;
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+size_t
+file_hash(char const *path, size_t hash)
+{
+	// FNV-1a continued over the contents, which leave the hash as it was if
+	// the file cannot be read.
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return hash;
+
+	unsigned char buf[65536];
+	for (size_t n; (n = fread(buf, 1, sizeof(buf), fp));)
+	{
+		for (size_t i = 0; i < n; ++i)
+		{
+			hash ^= buf[i];
+			hash *= 1099511628211ull;
+		}
+	}
+
+	fclose(fp);
+	return hash;
+}
+
+struct id_list
+id_list_create(void)
+{
+	return (struct id_list)
+	{
+		.data = malloc(sizeof(size_t)),
+		.size = 0,
+		.cap = 1,
+	};
+}
+
+void
+id_list_destroy(struct id_list *l)
+{
+	free(l->data);
+}
+
+void
+id_list_add(struct id_list *l, size_t id)
+{
+	if (l->size >= l->cap)
+	{
+		l->cap *= 2;
+		l->data = realloc(l->data, sizeof(size_t) * l->cap);
+	}
+
+	l->data[l->size++] = id;
+}
+
+struct bitset
+bitset_create(size_t size)
+{
+	return (struct bitset)
+	{
+		.data = calloc(size / BITSET_WORD_BITS + 1, sizeof(unsigned long)),
+		.size = size,
+	};
+}
+
+void
+bitset_destroy(struct bitset *b)
+{
+	free(b->data);
+}
+
+void
+bitset_set(struct bitset *b, size_t ind)
+{
+	b->data[ind / BITSET_WORD_BITS] |= 1ul << ind % BITSET_WORD_BITS;
+}
+
+void
+bitset_set_atomic(struct bitset *b, size_t ind)
+{
+	// for bitsets written to by several threads at once, as neighbouring
+	// bits share a word.
+	unsigned long mask = 1ul << ind % BITSET_WORD_BITS;
+	__atomic_fetch_or(&b->data[ind / BITSET_WORD_BITS], mask, __ATOMIC_RELAXED);
+}
+
+void
+bitset_clr(struct bitset *b, size_t ind)
+{
+	b->data[ind / BITSET_WORD_BITS] &= ~(1ul << ind % BITSET_WORD_BITS);
+}
+
+bool
+bitset_test(struct bitset const *b, size_t ind)
+{
+	return ind < b->size
+	       && b->data[ind / BITSET_WORD_BITS] & 1ul << ind % BITSET_WORD_BITS;
+}
+
+struct intern
+intern_create(void)
+{
+	return (struct intern)
+	{
+		.ids = str_map_create(),
+		.strs = malloc(sizeof(char const *)),
+		.size = 0,
+		.cap = 1,
+	};
+}
+
+void
+intern_destroy(struct intern *in)
+{
+	str_map_destroy(&in->ids);
+	free(in->strs);
+}
+
+size_t
+intern_add(struct intern *in, char const *str)
+{
+	size_t id;
+	if (str_map_get(&in->ids, str, &id))
+		return id;
+
+	if (in->size >= in->cap)
+	{
+		in->cap *= 2;
+		in->strs = realloc(in->strs, sizeof(char const *) * in->cap);
+	}
+
+	in->strs[in->size] = str_map_put(&in->ids, str, in->size);
+	return in->size++;
+}
+
+bool
+intern_find(struct intern const *in, char const *str, size_t *out_id)
+{
+	return str_map_get(&in->ids, str, out_id);
+}
+
+char const *
+intern_str(struct intern const *in, size_t id)
+{
+	return in->strs[id];
+}
+
 struct fmt_spec
 fmt_spec_create(void)
 {
@@ -172,7 +509,9 @@ fmt_inplace(struct string *out_str, struct fmt_spec const *f, char const *fmt,
 	{
 		if (fmt[i] != FMT_SPEC_CH)
 		{
-			string_push_ch(out_str, fmt[i]);
+			size_t lit_len = strcspn(fmt + i, (char[]){FMT_SPEC_CH, 0});
+			string_push_buf(out_str, fmt + i, lit_len);
+			i += lit_len - 1;
 			continue;
 		}
 
@@ -206,6 +545,126 @@ fmt_str(struct fmt_spec const *f, char const *fmt, void *data)
 	return str;
 }
 
+struct fmt_tmpl
+fmt_tmpl_create(struct fmt_spec const *f, char const *fmt)
+{
+	struct fmt_tmpl t =
+	{
+		.data = malloc(sizeof(struct fmt_tok)),
+		.size = 0,
+		.cap = 1,
+		.lit_len = 0,
+	};
+
+	// walk `fmt` exactly the way `fmt_inplace()` does, but collect runs of
+	// literal text into single tokens instead of expanding anything.
+	struct string lit = string_create();
+	for (size_t i = 0, fmt_len = strlen(fmt), j; i < fmt_len; ++i)
+	{
+		if (fmt[i] != FMT_SPEC_CH)
+		{
+			string_push_ch(&lit, fmt[i]);
+			continue;
+		}
+
+		++i;
+		for (j = 0; j < f->size; ++j)
+		{
+			if (!fmt[i] || fmt[i] == FMT_SPEC_CH)
+			{
+				string_push_ch(&lit, FMT_SPEC_CH);
+				break;
+			}
+			else if (fmt[i] == f->data[j].ch)
+			{
+				struct fmt_tok tok = {.fn = f->data[j].fn, .ch = fmt[i]};
+				tmpl_push_lit(&t, &lit);
+				tmpl_push(&t, &tok);
+				break;
+			}
+		}
+
+		if (j == f->size)
+			--i;
+	}
+
+	tmpl_push_lit(&t, &lit);
+	string_destroy(&lit);
+	
+	return t;
+}
+
+void
+fmt_tmpl_destroy(struct fmt_tmpl *t)
+{
+	for (size_t i = 0; i < t->size; ++i)
+		free(t->data[i].lit);
+
+	free(t->data);
+}
+
+void
+fmt_tmpl_bake(struct fmt_tmpl *t, char const *chs, void *data)
+{
+	// expand every spec in `chs` once with `data`, merging the result into
+	// the surrounding literals so later expansions only handle what varies.
+	struct fmt_tmpl old = *t;
+	t->data = malloc(sizeof(struct fmt_tok));
+	t->size = t->lit_len = 0;
+	t->cap = 1;
+
+	struct string lit = string_create();
+	for (size_t i = 0; i < old.size; ++i)
+	{
+		struct fmt_tok const *tok = &old.data[i];
+		
+		if (!tok->fn)
+			string_push_buf(&lit, tok->lit, tok->lit_len);
+		else if (strchr(chs, tok->ch))
+			tok->fn(&lit, data);
+		else
+		{
+			tmpl_push_lit(t, &lit);
+			tmpl_push(t, tok);
+		}
+	}
+
+	tmpl_push_lit(t, &lit);
+	string_destroy(&lit);
+	fmt_tmpl_destroy(&old);
+}
+
+void
+fmt_tmpl_inplace(struct string *out_str, struct fmt_tmpl const *t, void *data)
+{
+	for (size_t i = 0; i < t->size; ++i)
+	{
+		struct fmt_tok const *tok = &t->data[i];
+		if (tok->fn)
+			tok->fn(out_str, data);
+		else
+			string_push_buf(out_str, tok->lit, tok->lit_len);
+	}
+}
+
+char *
+fmt_tmpl_str(struct fmt_tmpl const *t, void *data)
+{
+	// the literal part is known up front, so size the buffer for it plus
+	// some room for what gets spliced in.
+	struct string s =
+	{
+		.str = malloc(t->lit_len + 256),
+		.len = 0,
+		.cap = t->lit_len + 256,
+	};
+	
+	fmt_tmpl_inplace(&s, t, data);
+	string_push_ch(&s, 0);
+
+	return s.str;
+}
+
 void
 mkdir_recursive(char const *dir)
 {
@@ -226,27 +685,141 @@ mkdir_recursive(char const *dir)
 	string_destroy(&path_build);
 }
 
+bool
+read_file(char const *path, struct string *out_conts)
+{
+	FILE *fp = fopen(path, "rb");
+	if (!fp)
+		return false;
+
+	char buf[65536];
+	for (size_t n; (n = fread(buf, 1, sizeof(buf), fp));)
+		string_push_buf(out_conts, buf, n);
+
+	bool ok = !ferror(fp);
+	fclose(fp);
+	return ok;
+}
+
+bool
+write_file(char const *path, char const *buf, size_t len)
+{
+	FILE *fp = fopen(path, "wb");
+	if (!fp)
+	{
+		fprintf(stderr, "failed to open file for writing: '%s'!\n", path);
+		return false;
+	}
+
+	bool ok = fwrite(buf, 1, len, fp) == len;
+	if (fclose(fp) || !ok)
+	{
+		fprintf(stderr, "failed to write file: '%s'!\n", path);
+		return false;
+	}
+
+	return true;
+}
+
+size_t
+mem_available(void)
+{
+	// in KiB, or 0 if it cannot be determined.
+	FILE *fp = fopen("/proc/meminfo", "rb");
+	if (!fp)
+		return 0;
+
+	size_t avail = 0;
+	char line[128];
+	while (fgets(line, sizeof(line), fp))
+	{
+		if (sscanf(line, "MemAvailable: %zu kB", &avail) == 1)
+			break;
+	}
+
+	fclose(fp);
+	return avail;
+}
+
 char *
 sanitize_path(char const *path)
 {
 	struct string san_path = string_create();
+	sanitize_path_inplace(&san_path, path);
+	
+	char *san_path_str = string_to_str(&san_path);
+	string_destroy(&san_path);
+	
+	return san_path_str;
+}
 
-	for (char const *c = path; *c; ++c)
+void
+sanitize_path_inplace(struct string *out_str, char const *path)
+{
+	for (char const *c = path; *c;)
 	{
-		if (strchr(SANITIZE_ESCAPE, *c))
-			string_push_ch(&san_path, '\\');
+		size_t run_len = strcspn(c, SANITIZE_ESCAPE);
+		string_push_buf(out_str, c, run_len);
+		c += run_len;
 		
-		string_push_ch(&san_path, *c);
+		if (*c)
+		{
+			string_push_ch(out_str, '\\');
+			string_push_ch(out_str, *c++);
+		}
 	}
+}
+
+void
+json_str_inplace(struct string *out_str, char const *buf, size_t len)
+{
+	string_push_ch(out_str, '"');
 	
-	char *san_path_str = string_to_str(&san_path);
-	string_destroy(&san_path);
+	for (size_t i = 0; i < len; ++i)
+	{
+		unsigned char ch = buf[i];
+		if (ch == '"' || ch == '\\')
+		{
+			string_push_ch(out_str, '\\');
+			string_push_ch(out_str, ch);
+		}
+		else if (ch == '\n')
+			string_push_buf(out_str, "\\n", 2);
+		else if (ch == '\t')
+			string_push_buf(out_str, "\\t", 2);
+		else if (ch < 0x20 || ch == 0x7f)
+		{
+			char esc[7];
+			sprintf(esc, "\\u%04x", ch);
+			string_push_buf(out_str, esc, 6);
+		}
+		else
+			string_push_ch(out_str, ch);
+	}
 	
-	return san_path_str;
+	string_push_ch(out_str, '"');
 }
 
-struct str_list
-ext_find(char *dir, struct str_list const *exts)
+void
+shell_quote_inplace(struct string *out_str, char const *str)
+{
+	// single quotes keep everything literal, except single quotes themselves,
+	// which have to be closed, escaped and reopened.
+	string_push_ch(out_str, '\'');
+	
+	for (char const *c = str; *c; ++c)
+	{
+		if (*c == '\'')
+			string_push_buf(out_str, "'\\''", 4);
+		else
+			string_push_ch(out_str, *c);
+	}
+	
+	string_push_ch(out_str, '\'');
+}
+
+bool
+ext_find(char *dir, struct str_list const *exts, struct str_list *out_files)
 {
 	unsigned long fts_opts = FTS_LOGICAL | FTS_COMFOLLOW | FTS_NOCHDIR;
 	char *const fts_dirs[] = {dir, NULL};
@@ -255,13 +828,16 @@ ext_find(char *dir, struct str_list const *exts)
 	if (!fts_p)
 	{
 		fputs("failed to fts_open()!\n", stderr);
-		exit(1);
+		return false;
 	}
 
-	struct str_list files = str_list_create();
+	*out_files = str_list_create();
 
 	if (!fts_children(fts_p, 0))
-		return files;
+	{
+		fts_close(fts_p);
+		return true;
+	}
 
 	FTSENT *fts_ent;
 	while (fts_ent = fts_read(fts_p))
@@ -273,9 +849,46 @@ ext_find(char *dir, struct str_list const *exts)
 		ext = ext && ext != fts_ent->fts_path ? ext + 1 : "\0";
 
 		if (str_list_contains(exts, ext))
-			str_list_add(&files, fts_ent->fts_path);
+			str_list_add(out_files, fts_ent->fts_path);
 	}
 
 	fts_close(fts_p);
-	return files;
+	return true;
+}
+
+static size_t
+arena_pad(struct arena_blk const *blk)
+{
+	uintptr_t next = (uintptr_t)(blk->data + blk->used);
+	return -next & (ARENA_ALIGN - 1);
+}
+
+static void
+tmpl_push(struct fmt_tmpl *t, struct fmt_tok const *tok)
+{
+	if (t->size >= t->cap)
+	{
+		t->cap *= 2;
+		t->data = realloc(t->data, sizeof(struct fmt_tok) * t->cap);
+	}
+
+	t->data[t->size++] = *tok;
+	t->lit_len += tok->lit_len;
+}
+
+static void
+tmpl_push_lit(struct fmt_tmpl *t, struct string *lit)
+{
+	if (!lit->len)
+		return;
+
+	struct fmt_tok tok =
+	{
+		.fn = NULL,
+		.lit = strndup(lit->str, lit->len),
+		.lit_len = lit->len,
+	};
+	
+	tmpl_push(t, &tok);
+	lit->len = 0;
 }